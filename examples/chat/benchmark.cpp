@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <malloc.h>
+#include "chat_message.hpp"
+
+typedef std::deque<chat_message_ptr> chat_message_queue;
+
+// Nanoseconds to encode and then decode the header of a message with a body
+// of the given length.
+double header_nanoseconds(chat_message::framing framing, std::size_t body_length, std::size_t count)
+{
+  chat_message msg;
+  msg.body_length(body_length);
+  std::size_t total = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    msg.encode_header(framing);
+    if (msg.decode_header(framing))
+    {
+      total += msg.body_length();
+    }
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  if (total != body_length * count)
+  {
+    std::cerr << "decoded the wrong length\n";
+    std::exit(1);
+  }
+  return std::chrono::duration<double, std::nano>(elapsed).count() / count;
+}
+
+// Heap bytes held for each message waiting in a write queue, counting the
+// queue's own entry. Large bodies are queued fewer times, to stay within
+// max_queued_bytes.
+const std::size_t max_queued_bytes = 64 << 20;
+
+double queued_bytes(std::size_t body_length, std::size_t count)
+{
+  count = std::max<std::size_t>(1, std::min(count, max_queued_bytes / (body_length + 1)));
+  chat_message msg;
+  msg.body_length(body_length);
+  msg.encode_header();
+  std::size_t before = mallinfo2().uordblks;
+  chat_message_queue queue;
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    queue.push_back(make_chat_message(msg));
+  }
+  std::size_t after = mallinfo2().uordblks;
+  return static_cast<double>(after - before) / count;
+}
+
+// Return the value of a "--name=value" argument, or null if arg is not name.
+const char *option_value(const char *arg, const char *name)
+{
+  std::size_t length = std::strlen(name);
+  if (std::strncmp(arg, name, length) == 0 && arg[length] == '=')
+  {
+    return arg + length + 1;
+  }
+  return nullptr;
+}
+
+int main(int argc, char *argv[])
+{
+  std::size_t count = 10000000;
+  std::size_t queued = 100000;
+  std::vector<std::size_t> sizes = {16, 100, 512, 4096, 65536};
+  for (int i = 1; i < argc; ++i)
+  {
+    const char *value = nullptr;
+    if ((value = option_value(argv[i], "--count")))
+    {
+      count = std::strtoul(value, nullptr, 10);
+    }
+    else if ((value = option_value(argv[i], "--queued")))
+    {
+      queued = std::strtoul(value, nullptr, 10);
+    }
+    else if ((value = option_value(argv[i], "--sizes")))
+    {
+      sizes.clear();
+      for (char *end = nullptr; *value; value = *end ? end + 1 : end)
+      {
+        sizes.push_back(std::strtoul(value, &end, 10));
+      }
+    }
+    else
+    {
+      std::cerr << "Usage: benchmark [options]\n";
+      std::cerr << "  Measures encoding and decoding chat message headers in each framing,\n";
+      std::cerr << "  and the memory held by each queued message, for each body size.\n";
+      std::cerr << "  Options:\n";
+      std::cerr << "    --count=<n>     headers encoded and decoded per size (default 10000000)\n";
+      std::cerr << "    --queued=<n>    messages queued per size, up to 64 MB (default 100000)\n";
+      std::cerr << "    --sizes=<a,b>   body sizes (default 16,100,512,4096,65536)\n";
+      return 1;
+    }
+  }
+
+  std::cout << std::setw(8) << "body" << std::setw(14) << "binary ns" << std::setw(14) << "ascii ns"
+            << std::setw(16) << "queued bytes" << "\n";
+  for (std::size_t size : sizes)
+  {
+    std::cout << std::setw(8) << size << std::fixed << std::setprecision(2)
+              << std::setw(14) << header_nanoseconds(chat_message::binary, size, count);
+    if (size <= chat_message::max_ascii_body_length)
+    {
+      std::cout << std::setw(14) << header_nanoseconds(chat_message::ascii, size, count);
+    }
+    else
+    {
+      std::cout << std::setw(14) << "-";
+    }
+    std::cout << std::setw(16) << std::setprecision(0) << queued_bytes(size, queued) << "\n";
+  }
+  return 0;
+}
@@ -1,7 +1,11 @@
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
 #include <iostream>
+#include <string>
 #include <thread>
+#include <vector>
 #include <boost/asio.hpp>
 #include "chat_message.hpp"
 
@@ -13,9 +17,11 @@ class chat_client
 {
 public:
   chat_client(boost::asio::io_context &io_context,
-              const tcp::resolver::results_type &endpoints)
+              const tcp::resolver::results_type &endpoints,
+              chat_message::framing framing)
       : io_context_(io_context),
-        socket_(io_context)
+        socket_(io_context),
+        framing_(framing)
   {
     do_connect(endpoints);
   }
@@ -55,7 +61,7 @@ private:
     boost::asio::async_read(socket_,
                             boost::asio::buffer(read_msg_.data(), chat_message::header_length),
                             [this](boost::system::error_code ec, std::size_t /*length*/) {
-                              if (!ec && read_msg_.decode_header())
+                              if (!ec && read_msg_.decode_header(framing_))
                               {
                                 do_read_body();
                               }
@@ -84,15 +90,16 @@ private:
                             });
   }
 
+  // Write everything queued, up to the limits of one gathered write.
   void do_write()
   {
+    gather_chat_messages(write_msgs_, write_buffers_);
     boost::asio::async_write(socket_,
-                             boost::asio::buffer(write_msgs_.front().data(),
-                                                 write_msgs_.front().length()),
+                             write_buffers_,
                              [this](boost::system::error_code ec, std::size_t /*length*/) {
                                if (!ec)
                                {
-                                 write_msgs_.pop_front();
+                                 write_msgs_.erase(write_msgs_.begin(), write_msgs_.begin() + write_buffers_.size());
                                  if (!write_msgs_.empty())
                                  {
                                    do_write();
@@ -107,36 +114,40 @@ private:
 
   boost::asio::io_context &io_context_;
   tcp::socket socket_;
+  chat_message::framing framing_;
   chat_message read_msg_;
   chat_message_queue write_msgs_;
+  std::vector<boost::asio::const_buffer> write_buffers_;
 };
 
 int main(int argc, char *argv[])
 {
   try
   {
-    if (argc != 3)
+    if (argc != 3 && !(argc == 4 && std::strcmp(argv[3], "--framing=ascii") == 0))
     {
-      std::cerr << "Usage: chat_client <host> <port>\n";
+      std::cerr << "Usage: chat_client <host> <port> [--framing=ascii]\n";
       return 1;
     }
+    chat_message::framing framing = argc == 4 ? chat_message::ascii : chat_message::binary;
 
     boost::asio::io_context io_context;
 
     tcp::resolver resolver(io_context);
     auto endpoints = resolver.resolve(argv[1], argv[2]);
-    chat_client c(io_context, endpoints);
+    chat_client c(io_context, endpoints, framing);
 
     std::thread t([&io_context]() { io_context.run(); });
 
-    char line[chat_message::max_body_length + 1];
-    while (std::cin.getline(line, chat_message::max_body_length + 1))
+    // Longer lines are cut to what the framing allows.
+    std::string line;
+    while (std::getline(std::cin, line))
     {
       chat_message msg;
 
-      msg.body_length(std::strlen(line));
-      std::memcpy(msg.body(), line, msg.body_length());
-      msg.encode_header();
+      msg.body_length(std::min(line.size(), chat_message::max_length(framing)));
+      std::memcpy(msg.body(), line.data(), msg.body_length());
+      msg.encode_header(framing);
       c.write(msg);
     }
 
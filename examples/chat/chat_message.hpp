@@ -1,9 +1,11 @@
 #ifndef CHAT_MESSAGE_HPP
 #define CHAT_MESSAGE_HPP
 
-#include <cstdio>
-#include <cstdlib>
+#include <algorithm>
 #include <cstring>
+#include <memory>
+#include <vector>
+#include <boost/asio/buffer.hpp>
 
 class chat_message
 {
@@ -14,76 +16,251 @@ public:
   };
   enum
   {
-    max_body_length = 512
+    max_body_length = 1 << 20,
+    max_ascii_body_length = 512
   };
 
+  // How the header gives the body's length: as a 32-bit little-endian
+  // integer, or as four ASCII digits, padded with spaces, for peers speaking
+  // the original protocol.
+  enum framing
+  {
+    binary,
+    ascii
+  };
+
+  // The storage holds the header and the body, and no more.
   chat_message()
-      : body_length_(0)
+      : data_(header_length)
   {
   }
 
   const char *data() const
   {
-    return data_;
+    return data_.data();
   }
 
   char *data()
   {
-    return data_;
+    return data_.data();
   }
 
   std::size_t length() const
   {
-    return header_length + body_length_;
+    return data_.size();
   }
 
   const char *body() const
   {
-    return data_ + header_length;
+    return data_.data() + header_length;
   }
 
   char *body()
   {
-    return data_ + header_length;
+    return data_.data() + header_length;
   }
 
   std::size_t body_length() const
   {
-    return body_length_;
+    return data_.size() - header_length;
   }
 
   void body_length(std::size_t new_length)
   {
-    body_length_ = new_length;
-    if (body_length_ > max_body_length)
+    data_.resize(header_length + std::min<std::size_t>(new_length, max_body_length));
+  }
+
+  static std::size_t max_length(framing f)
+  {
+    return f == ascii ? max_ascii_body_length : max_body_length;
+  }
+
+  // Fails for a body longer than the framing allows, or than limit. The
+  // storage grows to the whole message here, before the body is read.
+  bool decode_header(framing f = binary, std::size_t limit = max_body_length)
+  {
+    const unsigned char *header = reinterpret_cast<const unsigned char *>(data_.data());
+    std::size_t length = 0;
+    if (f == binary)
+    {
+      length = header[0] | header[1] << 8 | header[2] << 16 | static_cast<std::size_t>(header[3]) << 24;
+    }
+    else
+    {
+      std::size_t i = 0;
+      while (i < header_length && header[i] == ' ')
+      {
+        ++i;
+      }
+      if (i == header_length)
+      {
+        return fail_header();
+      }
+      for (; i < header_length; ++i)
+      {
+        if (header[i] < '0' || header[i] > '9')
+        {
+          return fail_header();
+        }
+        length = length * 10 + (header[i] - '0');
+      }
+    }
+
+    if (length > std::min(limit, max_length(f)))
+    {
+      return fail_header();
+    }
+    data_.resize(header_length + length);
+    return true;
+  }
+
+  // The body must be no longer than the framing allows.
+  void encode_header(framing f = binary)
+  {
+    std::size_t length = body_length();
+    unsigned char *header = reinterpret_cast<unsigned char *>(data_.data());
+    if (f == binary)
+    {
+      header[0] = static_cast<unsigned char>(length);
+      header[1] = static_cast<unsigned char>(length >> 8);
+      header[2] = static_cast<unsigned char>(length >> 16);
+      header[3] = static_cast<unsigned char>(length >> 24);
+    }
+    else
+    {
+      for (int i = header_length - 1; i >= 0; --i)
+      {
+        header[i] = length || i == header_length - 1 ? '0' + length % 10 : ' ';
+        length /= 10;
+      }
+    }
+  }
+
+private:
+  bool fail_header()
+  {
+    data_.resize(header_length);
+    return false;
+  }
+
+  std::vector<char> data_;
+};
+
+// Allocates single objects from a free list kept by each thread, falling
+// back to the heap. A block freed on another thread joins that thread's list.
+template <typename T>
+class chat_pool_allocator
+{
+public:
+  typedef T value_type;
+
+  chat_pool_allocator() noexcept {}
+
+  template <typename U>
+  chat_pool_allocator(const chat_pool_allocator<U> &) noexcept {}
+
+  T *allocate(std::size_t n)
+  {
+    std::vector<void *> &blocks = free_list().blocks;
+    if (n == 1 && !blocks.empty())
     {
-      body_length_ = max_body_length;
+      void *block = blocks.back();
+      blocks.pop_back();
+      return static_cast<T *>(block);
     }
+    return static_cast<T *>(::operator new(n * sizeof(T)));
   }
 
-  bool decode_header()
+  void deallocate(T *block, std::size_t n) noexcept
   {
-    char header[header_length + 1] = "";
-    std::strncat(header, data_, header_length);
-    body_length_ = std::atoi(header);
-    if (body_length_ > max_body_length)
+    std::vector<void *> &blocks = free_list().blocks;
+    if (n == 1 && blocks.size() < max_free_blocks)
     {
-      body_length_ = 0;
-      return false;
+      blocks.push_back(block);
+      return;
     }
+    ::operator delete(block);
+  }
+
+  template <typename U>
+  bool operator==(const chat_pool_allocator<U> &) const noexcept
+  {
     return true;
   }
 
-  void encode_header()
+  template <typename U>
+  bool operator!=(const chat_pool_allocator<U> &) const noexcept
   {
-    char header[header_length + 1] = "";
-    std::sprintf(header, "%4d", static_cast<int>(body_length_));
-    std::memcpy(data_, header, header_length);
+    return false;
   }
 
 private:
-  char data_[header_length + max_body_length];
-  std::size_t body_length_;
+  // Enough for the recent messages of a room and those in flight.
+  static const std::size_t max_free_blocks = 1024;
+
+  struct blocks_holder
+  {
+    ~blocks_holder()
+    {
+      for (void *block : blocks)
+      {
+        ::operator delete(block);
+      }
+    }
+
+    std::vector<void *> blocks;
+  };
+
+  static blocks_holder &free_list()
+  {
+    thread_local blocks_holder holder;
+    return holder;
+  }
 };
 
+// A message as it is delivered: allocated once, with its reference count,
+// from the pool, and shared unchanged by the room's history and every
+// participant's write queue, so a broadcast costs the same whatever the size
+// of the message.
+typedef std::shared_ptr<const chat_message> chat_message_ptr;
+
+inline chat_message_ptr make_chat_message(const chat_message &msg)
+{
+  return std::allocate_shared<chat_message>(chat_pool_allocator<chat_message>(), msg);
+}
+
+// The most messages and bytes sent by one gathered write. Asio passes at
+// most 64 buffers to a single sendmsg.
+const std::size_t max_write_messages = 64;
+const std::size_t max_write_bytes = 65536;
+
+inline const chat_message &chat_message_ref(const chat_message &msg)
+{
+  return msg;
+}
+
+inline const chat_message &chat_message_ref(const chat_message_ptr &msg)
+{
+  return *msg;
+}
+
+// Fill buffers with the messages at the front of queue, as many as one
+// gathered write sends, and at least one.
+template <typename Queue>
+void gather_chat_messages(const Queue &queue, std::vector<boost::asio::const_buffer> &buffers)
+{
+  buffers.clear();
+  std::size_t bytes = 0;
+  for (const auto &entry : queue)
+  {
+    const chat_message &msg = chat_message_ref(entry);
+    if (buffers.size() == max_write_messages || (!buffers.empty() && bytes + msg.length() > max_write_bytes))
+    {
+      break;
+    }
+    buffers.push_back(boost::asio::buffer(msg.data(), msg.length()));
+    bytes += msg.length();
+  }
+}
+
 #endif // CHAT_MESSAGE_HPP
\ No newline at end of file
@@ -1,18 +1,87 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
 #include <iostream>
 #include <list>
 #include <memory>
-#include <set>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 #include <boost/asio.hpp>
+#include "../trace/trace.hpp"
 #include "chat_message.hpp"
+#include "mpsc_queue.hpp"
 
 using boost::asio::ip::tcp;
 
 //----------------------------------------------------------------------
 
-typedef std::deque<chat_message> chat_message_queue;
+typedef std::deque<chat_message_ptr> chat_message_queue;
+
+// What a session does with a message that would take its write queue past
+// its limits.
+enum queue_policy
+{
+  // Drop the oldest messages not yet being written.
+  drop_oldest,
+  // Drop the new message.
+  drop_newest,
+  // Drop the queued messages for the new message's room, which supersedes
+  // them, then the oldest if that is not enough.
+  coalesce,
+  // Close the connection.
+  disconnect
+};
+
+struct server_options
+{
+  // The shards, each a thread with its own sessions.
+  std::size_t threads = 1;
+
+  chat_message::framing framing = chat_message::binary;
+
+  // The longest body a session reads. Storage for the whole message is
+  // taken as soon as its header arrives, so this bounds what a connection
+  // holds while a peer sends a body slowly, or not at all.
+  std::size_t max_body_length = 65536;
+
+  // The most messages, and bytes, waiting to be written to one session. A
+  // message is always taken by an empty queue, however long.
+  std::size_t max_queue_messages = 1024;
+  std::size_t max_queue_bytes = 1 << 20;
+  queue_policy policy = drop_oldest;
+
+  // The rooms of one server, which are never removed, and the recent
+  // messages each keeps for those joining it. The messages are shared by the
+  // shards, so histories hold at most max_rooms * max_history_bytes.
+  std::size_t max_rooms = 1024;
+  std::size_t max_history_messages = 100;
+  std::size_t max_history_bytes = 65536;
+
+  // The most messages waiting in one shard's inbox for it to order or
+  // deliver. Past that they are dropped, so a shard that falls behind holds
+  // at most max_inbox_messages * max_body_length.
+  std::size_t max_inbox_messages = 1024;
+
+  // The seconds between printed metrics, 0 for none.
+  long stats_interval = 0;
+};
+
+// Counters shared by the sessions of a server across its shards.
+struct metrics
+{
+  std::atomic<std::size_t> sessions_over_limit{0};
+  std::atomic<std::size_t> messages_dropped{0};
+  std::atomic<std::size_t> messages_coalesced{0};
+  std::atomic<std::size_t> sessions_disconnected{0};
+};
 
 //----------------------------------------------------------------------
 
@@ -20,55 +89,369 @@ class chat_participaint
 {
 public:
   virtual ~chat_participaint() {}
-  virtual void deliver(const chat_message &msg) = 0;
+  virtual void deliver(const chat_message_ptr &msg) = 0;
 };
 
-typedef std::shared_ptr<chat_participaint> chat_participaint_ptr;
+class chat_room;
+class chat_room_shard;
+
+// A participant's membership of one room, owned by the participant. The room
+// keeps the participant's position in its array here, so leaving needs no
+// search.
+struct chat_subscription
+{
+  chat_room_shard *room;
+  std::size_t slot;
+};
 
 //----------------------------------------------------------------------
 
-class chat_room
+// A hop between shards: a message for the room's owner to order, or one it
+// has ordered for the shard's participants.
+struct shard_message
+{
+  enum kind_type
+  {
+    publish,
+    deliver
+  };
+
+  kind_type kind;
+  chat_room *room;
+  chat_message_ptr msg;
+};
+
+// A thread with its own io_context, running the sessions placed on it and the
+// rooms it owns. Other shards reach it only through its inbox.
+class chat_shard
+{
+public:
+  chat_shard(std::size_t index, std::size_t max_inbox)
+      : sessions(0),
+        dropped(0),
+        index_(index),
+        work_(boost::asio::make_work_guard(io_context_)),
+        max_inbox_(max_inbox),
+        queued_(0),
+        scheduled_(false)
+  {
+  }
+
+  boost::asio::io_context &io_context()
+  {
+    return io_context_;
+  }
+
+  std::size_t index() const
+  {
+    return index_;
+  }
+
+  // Called from any thread. The first message into an idle inbox schedules
+  // a drain; the rest ride along with it. A message finding the inbox full is
+  // dropped, and missing from this shard's copy of its room.
+  void post(shard_message msg)
+  {
+    if (queued_.fetch_add(1, std::memory_order_relaxed) >= max_inbox_)
+    {
+      queued_.fetch_sub(1, std::memory_order_relaxed);
+      ++dropped;
+      return;
+    }
+    inbox_.push(std::move(msg));
+    if (!scheduled_.exchange(true, std::memory_order_acq_rel))
+    {
+      boost::asio::post(io_context_, [this]() { drain(); });
+    }
+  }
+
+  void run()
+  {
+    io_context_.run();
+  }
+
+  void stop()
+  {
+    io_context_.stop();
+  }
+
+  // Sessions placed on the shard, for picking the least busy. Declared
+  // first, as sessions still queued in the io_context count down when it is
+  // destroyed.
+  std::atomic<std::size_t> sessions;
+
+  // Messages dropped for a full inbox.
+  std::atomic<std::size_t> dropped;
+
+private:
+  void drain();
+
+  // Messages handled before the shard goes back to its sockets.
+  enum
+  {
+    max_drain = 64
+  };
+
+  std::size_t index_;
+  boost::asio::io_context io_context_;
+  boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_;
+  mpsc_queue<shard_message> inbox_;
+  std::size_t max_inbox_;
+
+  // The messages pushed and not yet popped.
+  std::atomic<std::size_t> queued_;
+  std::atomic<bool> scheduled_;
+};
+
+typedef std::vector<std::unique_ptr<chat_shard>> chat_shards;
+
+//----------------------------------------------------------------------
+
+// The part of a room on one shard: its participants there, in a flat array,
+// and the room's recent messages. Only touched on that shard's thread.
+class chat_room_shard
 {
 public:
-  void join(chat_participaint_ptr participaint)
+  chat_room_shard(chat_room &room, std::size_t shard, const server_options &opts)
+      : room_(room), shard_(shard), options_(opts)
+  {
+  }
+
+  void join(chat_participaint *participaint, chat_subscription &subscription)
   {
     std::cout << "chat_room::join: " << std::endl;
-    participaints_.insert(participaint);
-    for (auto msg : recent_msgs_)
+    subscription.room = this;
+    subscription.slot = members_.size();
+    members_.push_back(member{participaint, &subscription});
+    for (const chat_message_ptr &msg : recent_msgs_)
     {
       participaint->deliver(msg);
     }
   }
 
-  void leave(chat_participaint_ptr participaint)
+  // Move the last member into the leaving one's slot.
+  void leave(chat_subscription &subscription)
   {
     std::cout << "chat_room::leave: " << std::endl;
-    participaints_.erase(participaint);
+    member last = members_.back();
+    members_[subscription.slot] = last;
+    last.subscription->slot = subscription.slot;
+    members_.pop_back();
   }
 
-  void deliver(const chat_message &msg)
+  // Send a message read on this shard to the whole room.
+  void publish(const chat_message_ptr &msg);
+
+  void deliver(const chat_message_ptr &msg)
   {
     recent_msgs_.push_back(msg);
-    while (recent_msgs_.size() > max_recent_msgs)
+    recent_bytes_ += msg->length();
+    while (recent_msgs_.size() > options_.max_history_messages || recent_bytes_ > options_.max_history_bytes)
     {
+      recent_bytes_ -= recent_msgs_.front()->length();
       recent_msgs_.pop_front();
     }
 
-    for (auto participaint : participaints_)
+    for (const member &m : members_)
     {
-      participaint->deliver(msg);
+      m.participaint->deliver(msg);
     }
   }
 
 private:
-  std::set<chat_participaint_ptr> participaints_;
-  enum
+  struct member
   {
-    max_recent_msgs = 100
+    chat_participaint *participaint;
+    chat_subscription *subscription;
   };
+
+  chat_room &room_;
+  std::size_t shard_;
+  const server_options &options_;
+  std::vector<member> members_;
   chat_message_queue recent_msgs_;
+  std::size_t recent_bytes_ = 0;
+};
+
+// A room spread over every shard and owned by one of them. Messages go to the
+// owner first, which hands them on to each shard in the same order, so every
+// shard keeps the same recent messages and a join never leaves its shard.
+// Each shard then delivers to its own participants, on its own thread.
+class chat_room
+{
+public:
+  chat_room(chat_shards &shards, std::size_t owner, const server_options &opts)
+      : shards_(shards), owner_(owner)
+  {
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+    {
+      locals_.emplace_back(new chat_room_shard(*this, i, opts));
+    }
+  }
+
+  chat_room_shard &local(std::size_t shard)
+  {
+    return *locals_[shard];
+  }
+
+  // Called on the shard a message was read on.
+  void publish(std::size_t from, const chat_message_ptr &msg)
+  {
+    if (from == owner_)
+    {
+      order(msg);
+    }
+    else
+    {
+      shards_[owner_]->post(shard_message{shard_message::publish, this, msg});
+    }
+  }
+
+  // Called on the owner.
+  void order(const chat_message_ptr &msg)
+  {
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+    {
+      if (i == owner_)
+      {
+        locals_[i]->deliver(msg);
+      }
+      else
+      {
+        shards_[i]->post(shard_message{shard_message::deliver, this, msg});
+      }
+    }
+  }
+
+private:
+  chat_shards &shards_;
+  std::size_t owner_;
+  std::vector<std::unique_ptr<chat_room_shard>> locals_;
 };
 
+void chat_room_shard::publish(const chat_message_ptr &msg)
+{
+  room_.publish(shard_, msg);
+}
+
+void chat_shard::drain()
+{
+  shard_message msg;
+  for (std::size_t handled = 0; handled < max_drain; ++handled)
+  {
+    if (!inbox_.pop(msg))
+    {
+      // Going idle; a push that saw the drain still scheduled is picked up
+      // here, since the exchange orders after it.
+      scheduled_.exchange(false, std::memory_order_acq_rel);
+      if (inbox_.empty() || scheduled_.exchange(true, std::memory_order_acq_rel))
+      {
+        return;
+      }
+      continue;
+    }
+    queued_.fetch_sub(1, std::memory_order_relaxed);
+
+    if (msg.kind == shard_message::publish)
+    {
+      msg.room->order(msg.msg);
+    }
+    else
+    {
+      msg.room->local(index_).deliver(msg.msg);
+    }
+  }
+
+  // Let the shard's sockets run before the rest.
+  boost::asio::post(io_context_, [this]() { drain(); });
+}
+
+// The rooms of a server by name, created by the first join. Each shard looks
+// names up in its own index and takes the lock only for a name it has not
+// seen.
+class chat_rooms
+{
+public:
+  // The longest room name, in bytes.
+  enum
+  {
+    max_name_length = 64
+  };
+
+  chat_rooms(chat_shards &shards, std::size_t seed, const server_options &opts)
+      : shards_(shards), seed_(seed), options_(opts), locals_(shards.size())
+  {
+  }
+
+  // Called on the given shard. Returns null for a name no one has joined.
+  chat_room_shard *find(const std::string &name, std::size_t shard)
+  {
+    return lookup(name, shard, false);
+  }
+
+  // Called on the given shard. Returns null for a name that is too long, or
+  // a new one once the server has its most rooms.
+  chat_room_shard *create(const std::string &name, std::size_t shard)
+  {
+    if (name.empty() || name.size() > max_name_length)
+    {
+      return nullptr;
+    }
+    return lookup(name, shard, true);
+  }
+
+private:
+  chat_room_shard *lookup(const std::string &name, std::size_t shard, bool create)
+  {
+    std::unordered_map<std::string, chat_room_shard *> &local = locals_[shard];
+    auto found = local.find(name);
+    if (found != local.end())
+    {
+      return found->second;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto room = rooms_.find(name);
+    if (room == rooms_.end())
+    {
+      if (!create || rooms_.size() >= options_.max_rooms)
+      {
+        return nullptr;
+      }
+      std::size_t owner = (std::hash<std::string>()(name) + seed_) % shards_.size();
+      room = rooms_.emplace(name, std::unique_ptr<chat_room>(new chat_room(shards_, owner, options_))).first;
+    }
+    chat_room_shard *room_shard = &room->second->local(shard);
+    local.emplace(name, room_shard);
+    return room_shard;
+  }
+
+  chat_shards &shards_;
+  std::size_t seed_;
+  const server_options &options_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<chat_room>> rooms_;
+  std::vector<std::unordered_map<std::string, chat_room_shard *>> locals_;
+};
+
+// The room sessions join on connecting, and that takes messages not addressed
+// to another.
+const char *const default_room = "lobby";
+
+// The room a message is for: the name after a leading '#', up to the first
+// space, or else the default room.
+std::string_view chat_topic(const chat_message &msg)
+{
+  const char *body = msg.body();
+  std::size_t length = msg.body_length();
+  if (length > 1 && body[0] == '#')
+  {
+    const char *end = static_cast<const char *>(std::memchr(body, ' ', length));
+    return std::string_view(body + 1, (end ? end : body + length) - (body + 1));
+  }
+  return default_room;
+}
+
 //----------------------------------------------------------------------
 
 class chat_session
@@ -76,22 +459,41 @@ class chat_session
       public std::enable_shared_from_this<chat_session>
 {
 public:
-  chat_session(tcp::socket socket, chat_room &room)
+  chat_session(tcp::socket socket, chat_shard &shard, chat_rooms &rooms,
+               const server_options &opts, metrics &metrics)
       : socket_(std::move(socket)),
-        room_(room)
+        shard_(shard),
+        rooms_(rooms),
+        options_(opts),
+        metrics_(metrics),
+        queued_bytes_(0),
+        over_limit_(false)
+  {
+    ++shard_.sessions;
+  }
+
+  ~chat_session()
   {
+    --shard_.sessions;
   }
 
+  // Called on the session's shard.
   void start()
   {
-    room_.join(shared_from_this());
+    join(default_room);
     do_read_header();
   }
 
-  void deliver(const chat_message &msg)
+  void deliver(const chat_message_ptr &msg)
   {
+    if (!socket_.is_open() || (!fits(*msg) && !overflow(*msg)))
+    {
+      return;
+    }
+
     bool write_in_progress = !write_msgs_.empty();
     write_msgs_.push_back(msg);
+    queued_bytes_ += msg->length();
     if (!write_in_progress)
     {
       do_write();
@@ -99,21 +501,150 @@ public:
   }
 
 private:
+  bool fits(const chat_message &msg) const
+  {
+    return write_msgs_.empty() ||
+           (write_msgs_.size() < options_.max_queue_messages && queued_bytes_ + msg.length() <= options_.max_queue_bytes);
+  }
+
+  // Apply the queue policy to a message that does not fit, returning whether
+  // it is to be queued after all. The messages of the write in progress,
+  // at the front of the queue, are never dropped.
+  bool overflow(const chat_message &msg)
+  {
+    if (!over_limit_)
+    {
+      over_limit_ = true;
+      ++metrics_.sessions_over_limit;
+    }
+
+    std::size_t in_flight = write_buffers_.size();
+    if (options_.policy == disconnect)
+    {
+      ++metrics_.sessions_disconnected;
+      drop(write_msgs_.begin() + in_flight, write_msgs_.end());
+      boost::system::error_code ignored_ec;
+      socket_.close(ignored_ec);
+      return false;
+    }
+
+    if (options_.policy == coalesce)
+    {
+      std::string_view topic = chat_topic(msg);
+      auto superseded = std::stable_partition(write_msgs_.begin() + in_flight, write_msgs_.end(),
+                                              [topic](const chat_message_ptr &queued) {
+                                                return chat_topic(*queued) != topic;
+                                              });
+      metrics_.messages_coalesced += write_msgs_.end() - superseded;
+      drop(superseded, write_msgs_.end());
+    }
+
+    if (options_.policy != drop_newest)
+    {
+      while (!fits(msg) && write_msgs_.size() > in_flight)
+      {
+        ++metrics_.messages_dropped;
+        drop(write_msgs_.begin() + in_flight, write_msgs_.begin() + in_flight + 1);
+      }
+    }
+
+    if (!fits(msg))
+    {
+      ++metrics_.messages_dropped;
+      return false;
+    }
+    return true;
+  }
+
+  void drop(chat_message_queue::iterator first, chat_message_queue::iterator last)
+  {
+    for (auto it = first; it != last; ++it)
+    {
+      queued_bytes_ -= (*it)->length();
+    }
+    write_msgs_.erase(first, last);
+  }
+
+  void join(const std::string &name)
+  {
+    if (subscriptions_.count(name) || subscriptions_.size() >= max_subscriptions)
+    {
+      return;
+    }
+    if (chat_room_shard *room = rooms_.create(name, shard_.index()))
+    {
+      room->join(this, subscriptions_[name]);
+    }
+  }
+
+  void leave(const std::string &name)
+  {
+    auto found = subscriptions_.find(name);
+    if (found != subscriptions_.end())
+    {
+      found->second.room->leave(found->second);
+      subscriptions_.erase(found);
+    }
+  }
+
+  void leave_all()
+  {
+    for (auto &subscription : subscriptions_)
+    {
+      subscription.second.room->leave(subscription.second);
+    }
+    subscriptions_.clear();
+  }
+
+  // "/join <room>" and "/leave <room>" change the session's subscriptions,
+  // "#<room> <text>" goes to that room's subscribers as it is, and anything
+  // else to the default room. A message for a room no one has joined is
+  // dropped.
+  void handle_message()
+  {
+    const char *body = read_msg_.body();
+    std::size_t length = read_msg_.body_length();
+    if (starts_with(body, length, "/join "))
+    {
+      join(std::string(body + 6, length - 6));
+    }
+    else if (starts_with(body, length, "/leave "))
+    {
+      leave(std::string(body + 7, length - 7));
+    }
+    else
+    {
+      std::string_view topic = chat_topic(read_msg_);
+      chat_room_shard *room = nullptr;
+      if (topic.size() <= chat_rooms::max_name_length &&
+          (room = rooms_.find(std::string(topic), shard_.index())))
+      {
+        room->publish(make_chat_message(read_msg_));
+      }
+    }
+  }
+
+  static bool starts_with(const char *body, std::size_t length, const char *prefix)
+  {
+    std::size_t prefix_length = std::strlen(prefix);
+    return length > prefix_length && std::memcmp(body, prefix, prefix_length) == 0;
+  }
+
   void do_read_header()
   {
     auto self(shared_from_this());
     boost::asio::async_read(socket_,
                             boost::asio::buffer(read_msg_.data(), chat_message::header_length),
-                            [this, self](boost::system::error_code ec, std::size_t /*length*/) {
-                              if (!ec && read_msg_.decode_header())
+                            trace::traced("read_header", "chat", this, [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                              if (!ec && read_msg_.decode_header(options_.framing, options_.max_body_length))
                               {
                                 do_read_body();
                               }
                               else
                               {
-                                room_.leave(shared_from_this());
+                                leave_all();
                               }
-                            });
+                            }));
   }
 
   void do_read_body()
@@ -121,46 +652,97 @@ private:
     auto self(shared_from_this());
     boost::asio::async_read(socket_,
                             boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-                            [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                            trace::traced("read_body", "chat", this, [this, self](boost::system::error_code ec, std::size_t /*length*/) {
                               if (!ec)
                               {
-                                room_.deliver(read_msg_);
+                                handle_message();
+
+                                // Give back the storage of a large message
+                                // rather than hold it while the session idles.
+                                if (read_msg_.body_length() > max_kept_body_length)
+                                {
+                                  read_msg_ = chat_message();
+                                }
                                 do_read_header();
                               }
                               else
                               {
-                                room_.leave(shared_from_this());
+                                leave_all();
                               }
-                            });
+                            }));
   }
 
+  // Write everything queued, up to the limits of one gathered write, and
+  // then whatever was queued meanwhile.
   void do_write()
   {
+    gather_chat_messages(write_msgs_, write_buffers_);
     auto self(shared_from_this());
-    boost::asio::async_write(socket_,
-                             boost::asio::buffer(write_msgs_.front().data(),
-                                                 write_msgs_.front().length()),
-                             [this, self](boost::system::error_code ec, std::size_t /*length*/) {
-                               if (!ec)
-                               {
-                                 write_msgs_.pop_front();
-                                 if (!write_msgs_.empty())
-                                 {
-                                   do_write();
-                                 }
-                                 else
-                                 {
-                                   // do not leave the chat room upon written one message
-                                   // room_.leave(shared_from_this());
-                                 }
-                               }
-                             });
+    auto handler = trace::traced("write", "chat", this, [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+      if (!ec)
+      {
+        drop(write_msgs_.begin(), write_msgs_.begin() + write_buffers_.size());
+        if (!write_msgs_.empty())
+        {
+          do_write();
+        }
+        else
+        {
+          // do not leave the chat room upon written one message
+          // room_.leave(shared_from_this());
+        }
+      }
+      else
+      {
+        // Nothing more reaches a peer that is gone; the pending read fails
+        // and leaves the rooms.
+        drop(write_msgs_.begin(), write_msgs_.end());
+        boost::system::error_code ignored_ec;
+        socket_.close(ignored_ec);
+      }
+    });
+
+    // A lone message, the usual case while the client keeps up, takes the
+    // cheaper single buffer path.
+    if (write_buffers_.size() == 1)
+    {
+      boost::asio::async_write(socket_, write_buffers_.front(), std::move(handler));
+    }
+    else
+    {
+      boost::asio::async_write(socket_, write_buffers_, std::move(handler));
+    }
   }
 
+
+  // The most rooms one session is in at a time, as rooms outlive their
+  // members.
+  enum
+  {
+    max_subscriptions = 32
+  };
+
+  // The largest body whose storage read_msg_ keeps for the next message.
+  enum
+  {
+    max_kept_body_length = 4096
+  };
+
   tcp::socket socket_;
-  chat_room &room_;
+  chat_shard &shard_;
+  chat_rooms &rooms_;
+  const server_options &options_;
+  metrics &metrics_;
+  std::unordered_map<std::string, chat_subscription> subscriptions_;
   chat_message read_msg_;
   chat_message_queue write_msgs_;
+  std::vector<boost::asio::const_buffer> write_buffers_;
+
+  // The bytes of the messages in write_msgs_.
+  std::size_t queued_bytes_;
+
+  // Whether the session has been past its limits, counted once.
+  bool over_limit_;
 };
 
 //----------------------------------------------------------------------
@@ -168,51 +750,234 @@ private:
 class chat_server
 {
 public:
-  chat_server(boost::asio::io_context &io_context,
-              const tcp::endpoint &endpoint)
-      : acceptor_(io_context, endpoint)
+  // Accepts on the first shard. Rooms are spread over the shards by name,
+  // with seed telling apart those of different servers. Messages are
+  // forwarded as they were read, so every session of a server uses the same
+  // framing.
+  chat_server(chat_shards &shards, std::size_t seed,
+              const tcp::endpoint &endpoint, const server_options &opts)
+      : shards_(shards),
+        acceptor_(shards.front()->io_context(), endpoint),
+        rooms_(shards, seed, opts),
+        options_(opts),
+        stats_timer_(shards.front()->io_context())
   {
     do_accept();
+
+    if (options_.stats_interval > 0)
+    {
+      do_report();
+    }
   }
 
 private:
+  // Place each connection on the shard with the fewest sessions.
   void do_accept()
   {
+    chat_shard &shard = **std::min_element(shards_.begin(), shards_.end(),
+                                           [](const std::unique_ptr<chat_shard> &a, const std::unique_ptr<chat_shard> &b) {
+                                             return a->sessions < b->sessions;
+                                           });
     acceptor_.async_accept(
-        [this](boost::system::error_code ec, tcp::socket socket) {
+        shard.io_context(),
+        trace::traced("accept", "chat", this, [this, &shard](boost::system::error_code ec, tcp::socket socket) {
           if (!ec)
           {
-            std::make_shared<chat_session>(std::move(socket), room_)->start();
+            auto session = std::make_shared<chat_session>(std::move(socket), shard, rooms_, options_, metrics_);
+            boost::asio::post(shard.io_context(), [session]() { session->start(); });
           }
 
           do_accept();
-        });
+        }));
+  }
+
+  void do_report()
+  {
+    stats_timer_.expires_after(std::chrono::seconds(options_.stats_interval));
+    stats_timer_.async_wait([this](const boost::system::error_code &ec) {
+      if (ec)
+      {
+        return;
+      }
+
+      std::cout << "port " << acceptor_.local_endpoint().port() << ": sessions over limit "
+                << metrics_.sessions_over_limit << ", messages dropped " << metrics_.messages_dropped
+                << ", coalesced " << metrics_.messages_coalesced << ", sessions disconnected "
+                << metrics_.sessions_disconnected << ", sessions";
+      for (const std::unique_ptr<chat_shard> &shard : shards_)
+      {
+        std::cout << " " << shard->sessions;
+      }
+      std::cout << ", inbox dropped";
+      for (const std::unique_ptr<chat_shard> &shard : shards_)
+      {
+        std::cout << " " << shard->dropped;
+      }
+      std::cout << std::endl;
+
+      do_report();
+    });
   }
 
+  chat_shards &shards_;
   tcp::acceptor acceptor_;
-  chat_room room_;
+  chat_rooms rooms_;
+  const server_options &options_;
+  metrics metrics_;
+  boost::asio::steady_timer stats_timer_;
 };
 
+// Return the value of a "--name=value" argument, or null if arg is not name.
+const char *option_value(const char *arg, const char *name)
+{
+  std::size_t length = std::strlen(name);
+  if (std::strncmp(arg, name, length) == 0 && arg[length] == '=')
+  {
+    return arg + length + 1;
+  }
+  return nullptr;
+}
+
 int main(int argc, char *argv[])
 {
   try
   {
     if (argc < 2)
     {
-      std::cerr << "Usage: chat_server <port> [<port> ...]\n";
+      std::cerr << "Usage: chat_server <port> [<port> ...] [options]\n";
+      std::cerr << "  Options:\n";
+      std::cerr << "    --threads=<n>             shards, each a thread with its own sessions\n";
+      std::cerr << "                              (default one per core)\n";
+      std::cerr << "    --framing=ascii           four ASCII digits of length, for clients of the\n";
+      std::cerr << "                              original protocol\n";
+      std::cerr << "    --max-body-size=<n>       longest message body read (default 65536, at\n";
+      std::cerr << "                              most 1048576)\n";
+      std::cerr << "    --max-queue-messages=<n>  messages waiting for one session (default 1024)\n";
+      std::cerr << "    --max-queue-bytes=<n>     bytes waiting for one session (default 1048576)\n";
+      std::cerr << "    --queue-policy=<p>        drop-oldest (default), drop-newest, coalesce or\n";
+      std::cerr << "                              disconnect, for messages past those limits\n";
+      std::cerr << "    --max-rooms=<n>           rooms of one server (default 1024)\n";
+      std::cerr << "    --max-history-messages=<n>\n";
+      std::cerr << "                              recent messages kept by a room (default 100)\n";
+      std::cerr << "    --max-history-bytes=<n>   bytes of them (default 65536)\n";
+      std::cerr << "    --max-inbox-messages=<n>  messages waiting to pass to one shard\n";
+      std::cerr << "                              (default 1024)\n";
+      std::cerr << "    --stats=<s>               print metrics every s seconds\n";
       return 1;
     }
 
-    boost::asio::io_context io_context;
+    server_options opts;
+    opts.threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<unsigned short> ports;
+    for (int i = 1; i < argc; ++i)
+    {
+      const char *value = nullptr;
+      if ((value = option_value(argv[i], "--threads")))
+      {
+        opts.threads = std::max(1L, std::strtol(value, nullptr, 10));
+      }
+      else if ((value = option_value(argv[i], "--framing")))
+      {
+        opts.framing = std::strcmp(value, "ascii") == 0 ? chat_message::ascii : chat_message::binary;
+      }
+      else if ((value = option_value(argv[i], "--max-body-size")))
+      {
+        opts.max_body_length = std::min<std::size_t>(std::strtoul(value, nullptr, 10), chat_message::max_body_length);
+      }
+      else if ((value = option_value(argv[i], "--max-queue-messages")))
+      {
+        opts.max_queue_messages = std::max(1L, std::strtol(value, nullptr, 10));
+      }
+      else if ((value = option_value(argv[i], "--max-queue-bytes")))
+      {
+        opts.max_queue_bytes = std::strtoul(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--queue-policy")))
+      {
+        if (std::strcmp(value, "drop-oldest") == 0)
+        {
+          opts.policy = drop_oldest;
+        }
+        else if (std::strcmp(value, "drop-newest") == 0)
+        {
+          opts.policy = drop_newest;
+        }
+        else if (std::strcmp(value, "coalesce") == 0)
+        {
+          opts.policy = coalesce;
+        }
+        else if (std::strcmp(value, "disconnect") == 0)
+        {
+          opts.policy = disconnect;
+        }
+        else
+        {
+          std::cerr << "Unknown queue policy: " << value << "\n";
+          return 1;
+        }
+      }
+      else if ((value = option_value(argv[i], "--max-rooms")))
+      {
+        opts.max_rooms = std::strtoul(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--max-history-messages")))
+      {
+        opts.max_history_messages = std::strtoul(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--max-history-bytes")))
+      {
+        opts.max_history_bytes = std::strtoul(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--max-inbox-messages")))
+      {
+        opts.max_inbox_messages = std::max(1L, std::strtol(value, nullptr, 10));
+      }
+      else if ((value = option_value(argv[i], "--stats")))
+      {
+        opts.stats_interval = std::strtol(value, nullptr, 10);
+      }
+      else
+      {
+        ports.push_back(std::atoi(argv[i]));
+      }
+    }
+
+    chat_shards shards;
+    for (std::size_t i = 0; i < opts.threads; ++i)
+    {
+      shards.emplace_back(new chat_shard(i, opts.max_inbox_messages));
+    }
+    boost::asio::io_context &io_context = shards.front()->io_context();
+
+    // Record asynchronous operations when TRACE is set, and write them out as
+    // a Chrome trace on SIGUSR1.
+    std::unique_ptr<trace::signal_dumper> dumper;
+    if (std::getenv("TRACE"))
+    {
+      trace::enable();
+      dumper.reset(new trace::signal_dumper(io_context));
+    }
 
     std::list<chat_server> servers;
-    for (int i = 1; i < argc; ++i)
+    for (std::size_t i = 0; i < ports.size(); ++i)
     {
-      tcp::endpoint endpoint(tcp::v4(), std::atoi(argv[i]));
-      servers.emplace_back(io_context, endpoint);
+      tcp::endpoint endpoint(tcp::v4(), ports[i]);
+      servers.emplace_back(shards, i % shards.size(), endpoint, opts);
     }
 
-    io_context.run();
+    // The first shard runs on this thread.
+    std::vector<std::thread> runners;
+    for (std::size_t i = 1; i < shards.size(); ++i)
+    {
+      runners.emplace_back([&shards, i]() { shards[i]->run(); });
+    }
+    shards.front()->run();
+
+    for (std::size_t i = 1; i < shards.size(); ++i)
+    {
+      shards[i]->stop();
+      runners[i - 1].join();
+    }
   }
   catch (std::exception &e)
   {
@@ -0,0 +1,78 @@
+#ifndef MPSC_QUEUE_HPP
+#define MPSC_QUEUE_HPP
+
+#include <atomic>
+#include <utility>
+
+// A queue that any number of threads push to and a single thread pops from,
+// without locks. A push is one exchange on the head; the consumer follows the
+// links the producers leave behind, and the node it last popped serves as the
+// stub the next push links to (after Dmitry Vyukov's MPSC queue).
+template <typename T>
+class mpsc_queue
+{
+public:
+  mpsc_queue()
+      : head_(new node()), tail_(head_.load(std::memory_order_relaxed))
+  {
+  }
+
+  mpsc_queue(const mpsc_queue &) = delete;
+  mpsc_queue &operator=(const mpsc_queue &) = delete;
+
+  ~mpsc_queue()
+  {
+    T value;
+    while (pop(value))
+    {
+    }
+    delete tail_;
+  }
+
+  // Called from any thread.
+  void push(T value)
+  {
+    node *n = new node(std::move(value));
+    node *prev = head_.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+
+  // Called from the consumer only. A push still linking its node is not seen
+  // until it finishes.
+  bool pop(T &value)
+  {
+    node *tail = tail_;
+    node *next = tail->next.load(std::memory_order_acquire);
+    if (!next)
+    {
+      return false;
+    }
+    value = std::move(next->value);
+    tail_ = next;
+    delete tail;
+    return true;
+  }
+
+  // Called from the consumer only.
+  bool empty() const
+  {
+    return tail_->next.load(std::memory_order_acquire) == nullptr;
+  }
+
+private:
+  struct node
+  {
+    node() : next(nullptr) {}
+    explicit node(T v) : next(nullptr), value(std::move(v)) {}
+
+    std::atomic<node *> next;
+    T value;
+  };
+
+  // Producers and the consumer touch different ends, kept on separate cache
+  // lines so they do not contend.
+  alignas(64) std::atomic<node *> head_;
+  alignas(64) node *tail_;
+};
+
+#endif // MPSC_QUEUE_HPP
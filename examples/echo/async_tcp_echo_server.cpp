@@ -2,10 +2,46 @@
 #include <iostream>
 #include <memory>
 #include <utility>
+#include <vector>
 #include <boost/asio.hpp>
+#include "../trace/trace.hpp"
 
 using boost::asio::ip::tcp;
 
+enum
+{
+  max_length = 1024
+};
+
+// Buffers are borrowed from a pool kept by each thread only while data is in
+// flight, so an idle session holds no buffer at all.
+std::vector<std::unique_ptr<char[]>> &buffer_pool()
+{
+  thread_local std::vector<std::unique_ptr<char[]>> pool;
+  return pool;
+}
+
+std::unique_ptr<char[]> acquire_buffer()
+{
+  std::vector<std::unique_ptr<char[]>> &pool = buffer_pool();
+  if (pool.empty())
+  {
+    return std::unique_ptr<char[]>(new char[max_length]);
+  }
+  std::unique_ptr<char[]> buffer = std::move(pool.back());
+  pool.pop_back();
+  return buffer;
+}
+
+void release_buffer(std::unique_ptr<char[]> buffer)
+{
+  std::vector<std::unique_ptr<char[]>> &pool = buffer_pool();
+  if (pool.size() < 64)
+  {
+    pool.push_back(std::move(buffer));
+  }
+}
+
 class session
     : public std::enable_shared_from_this<session>
 {
@@ -17,6 +53,10 @@ public:
 
   void start()
   {
+    // Reads are only attempted once the socket is readable, and must not
+    // block if the readiness turns out to be spurious.
+    boost::system::error_code ignored_ec;
+    socket_.non_blocking(true, ignored_ec);
     do_read();
   }
 
@@ -24,33 +64,44 @@ private:
   void do_read()
   {
     auto self(shared_from_this());
-    socket_.async_read_some(boost::asio::buffer(data_, max_length),
-                            [this, self](boost::system::error_code ec, std::size_t length) {
-                              if (!ec)
-                              {
-                                do_write(length);
-                              }
-                            });
+    socket_.async_wait(tcp::socket::wait_read,
+                       trace::traced("read", "echo", this, [this, self](boost::system::error_code ec) {
+                         if (ec)
+                         {
+                           return;
+                         }
+
+                         data_ = acquire_buffer();
+                         std::size_t length = socket_.read_some(boost::asio::buffer(data_.get(), max_length), ec);
+                         if (ec == boost::asio::error::would_block)
+                         {
+                           release_buffer(std::move(data_));
+                           do_read();
+                         }
+                         else if (!ec)
+                         {
+                           do_write(length);
+                         }
+                       }));
   }
 
   void do_write(std::size_t length)
   {
     auto self(shared_from_this());
-    boost::asio::async_write(socket_, boost::asio::buffer(data_, length),
-                             [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+    boost::asio::async_write(socket_, boost::asio::buffer(data_.get(), length),
+                             trace::traced("write", "echo", this, [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+                               release_buffer(std::move(data_));
                                if (!ec)
                                {
                                  do_read();
                                }
-                             });
+                             }));
   }
 
   tcp::socket socket_;
-  enum
-  {
-    max_length = 1024
-  };
-  char data_[max_length];
+
+  // The data being echoed, held only while a write is in progress.
+  std::unique_ptr<char[]> data_;
 };
 
 class server
@@ -66,14 +117,14 @@ private:
   void do_accept()
   {
     acceptor_.async_accept(
-        [this](boost::system::error_code ec, tcp::socket socket) {
+        trace::traced("accept", "echo", this, [this](boost::system::error_code ec, tcp::socket socket) {
           if (!ec)
           {
             std::make_shared<session>(std::move(socket))->start();
           }
 
           do_accept();
-        });
+        }));
   }
 
   tcp::acceptor acceptor_;
@@ -90,6 +141,16 @@ int main(int argc, char *argv[])
     }
 
     boost::asio::io_context io_context;
+
+    // Record asynchronous operations when TRACE is set, and write them out as
+    // a Chrome trace on SIGUSR1.
+    std::unique_ptr<trace::signal_dumper> dumper;
+    if (std::getenv("TRACE"))
+    {
+      trace::enable();
+      dumper.reset(new trace::signal_dumper(io_context));
+    }
+
     server s(io_context, std::atoi(argv[1]));
     io_context.run();
   }
@@ -0,0 +1,256 @@
+#include <zlib.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../server/archive.hpp"
+#include "../server/mime_types.hpp"
+
+// Packs a doc_root directory into a single archive that http_server serves
+// with --archive. Headers are rendered and text files compressed here, ahead
+// of time, so the server does no per-file work at all.
+
+namespace format = http::server::archive_format;
+
+namespace
+{
+
+// Only compress content that is likely to shrink, and only keep the result
+// if it saves a worthwhile fraction of the transfer.
+const std::size_t min_compress_size = 256;
+const double max_compress_ratio = 0.9;
+
+// One file of doc_root being packed.
+struct input_file
+{
+  std::string request_path;
+  std::string content;
+  std::string gzip_content;
+  std::string type;
+};
+
+std::string extension_of(const std::string &path)
+{
+  std::size_t last_slash_pos = path.find_last_of("/");
+  std::size_t last_dot_pos = path.find_last_of(".");
+  if (last_dot_pos != std::string::npos && last_dot_pos > last_slash_pos)
+  {
+    return path.substr(last_dot_pos + 1);
+  }
+  return std::string();
+}
+
+bool read_file(const std::filesystem::path &path, std::string &content)
+{
+  std::ifstream is(path, std::ios::in | std::ios::binary);
+  std::ostringstream os;
+  os << is.rdbuf();
+  content = os.str();
+  return !is.bad();
+}
+
+// Compress with the gzip wrapper. Returns false on failure.
+bool gzip(const std::string &in, std::string &out)
+{
+  z_stream zs = z_stream();
+  if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    return false;
+  }
+  out.resize(deflateBound(&zs, in.size()));
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+  zs.avail_in = in.size();
+  zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  zs.avail_out = out.size();
+  int result = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  return result == Z_STREAM_END;
+}
+
+// A strong validator: the content never changes once packed.
+std::string etag_of(const std::string &content)
+{
+  std::uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : content)
+  {
+    hash = (hash ^ c) * 1099511628211ull;
+  }
+  std::ostringstream os;
+  os << std::hex << "\"" << hash << "\"";
+  return os.str();
+}
+
+// Appends to the archive being built, keeping track of offsets.
+class writer
+{
+public:
+  explicit writer(std::ofstream &os)
+      : os_(os), offset_(0)
+  {
+  }
+
+  std::uint64_t write(const void *data, std::size_t length)
+  {
+    std::uint64_t offset = offset_;
+    os_.write(static_cast<const char *>(data), length);
+    offset_ += length;
+    return offset;
+  }
+
+  std::uint64_t write(const std::string &s)
+  {
+    return write(s.data(), s.size());
+  }
+
+  // Pad with zeros to a multiple of alignment.
+  void align(std::size_t alignment)
+  {
+    static const char zeros[format::page_size] = {};
+    write(zeros, (alignment - offset_ % alignment) % alignment);
+  }
+
+  std::uint64_t offset() const
+  {
+    return offset_;
+  }
+
+private:
+  std::ofstream &os_;
+  std::uint64_t offset_;
+};
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  if (argc != 3)
+  {
+    std::cerr << "Usage: pack <doc_root> <archive>\n";
+    return 1;
+  }
+  std::filesystem::path root(argv[1]);
+  std::string archive_path = argv[2];
+
+  // Collect the files in request path order, which is the order of the index.
+  // An entry that cannot be checked, such as a dangling symlink, is reported
+  // and skipped; only a failure to advance the walk ends it.
+  std::vector<input_file> files;
+  std::size_t skipped = 0;
+  std::error_code ec;
+  for (std::filesystem::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec))
+  {
+    std::error_code entry_ec;
+    bool regular = it->is_regular_file(entry_ec);
+    if (entry_ec)
+    {
+      std::cerr << "skipping " << it->path() << ": " << entry_ec.message() << "\n";
+      ++skipped;
+      continue;
+    }
+    if (!regular)
+    {
+      continue;
+    }
+    input_file f;
+    f.request_path = "/" + it->path().lexically_relative(root).generic_string();
+    if (!read_file(it->path(), f.content))
+    {
+      std::cerr << "cannot read " << it->path() << "\n";
+      return 1;
+    }
+    f.type = http::server::mime_types::extension_to_type(extension_of(f.request_path));
+    if (f.type.compare(0, 5, "text/") == 0 && f.content.size() >= min_compress_size &&
+        (!gzip(f.content, f.gzip_content) ||
+         f.gzip_content.size() > f.content.size() * max_compress_ratio))
+    {
+      f.gzip_content.clear();
+    }
+    files.push_back(std::move(f));
+  }
+  if (ec)
+  {
+    std::cerr << "cannot walk " << root << ": " << ec.message() << "\n";
+    return 1;
+  }
+  std::sort(files.begin(), files.end(),
+            [](const input_file &a, const input_file &b) { return a.request_path < b.request_path; });
+
+  // Write to a temporary file and rename it into place, so that a server
+  // reloading the archive never sees a partial one.
+  std::string part_path = archive_path + ".part";
+  std::ofstream os(part_path.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  writer w(os);
+  format::file_header fh = format::file_header();
+  w.write(&fh, sizeof(fh));
+
+  // Bodies come first, each starting on a page boundary.
+  std::vector<format::index_entry> index(files.size());
+  std::size_t compressed = 0;
+  for (std::size_t i = 0; i < files.size(); ++i)
+  {
+    w.align(format::page_size);
+    index[i].variants[format::identity].body_offset = w.write(files[i].content);
+    index[i].variants[format::identity].body_size = files[i].content.size();
+    if (!files[i].gzip_content.empty())
+    {
+      w.align(format::page_size);
+      index[i].variants[format::gzip].body_offset = w.write(files[i].gzip_content);
+      index[i].variants[format::gzip].body_size = files[i].gzip_content.size();
+      ++compressed;
+    }
+  }
+
+  // Then the paths and the pre-rendered header blocks.
+  for (std::size_t i = 0; i < files.size(); ++i)
+  {
+    const input_file &f = files[i];
+    index[i].path_offset = w.write(f.request_path);
+    index[i].path_size = f.request_path.size();
+
+    std::string etag = etag_of(f.content);
+    std::string vary = f.gzip_content.empty() ? "" : "Vary: Accept-Encoding\r\n";
+    std::string identity_headers =
+        "Content-Length: " + std::to_string(f.content.size()) + "\r\n" +
+        "Content-Type: " + f.type + "\r\n" +
+        "ETag: " + etag + "\r\n" + vary;
+    index[i].variants[format::identity].headers_offset = w.write(identity_headers);
+    index[i].variants[format::identity].headers_size = identity_headers.size();
+    if (!f.gzip_content.empty())
+    {
+      std::string gzip_headers =
+          "Content-Length: " + std::to_string(f.gzip_content.size()) + "\r\n" +
+          "Content-Type: " + f.type + "\r\n" +
+          "Content-Encoding: gzip\r\n" +
+          "ETag: " + etag.substr(0, etag.size() - 1) + "-gzip\"\r\n" + vary;
+      index[i].variants[format::gzip].headers_offset = w.write(gzip_headers);
+      index[i].variants[format::gzip].headers_size = gzip_headers.size();
+    }
+  }
+
+  // And finally the index, whose position is recorded in the file header.
+  w.align(alignof(format::index_entry));
+  fh.index_offset = w.write(index.data(), index.size() * sizeof(format::index_entry));
+  std::copy(format::magic, format::magic + sizeof(format::magic), fh.magic);
+  fh.version = format::version;
+  fh.entry_count = index.size();
+  fh.size = w.offset();
+  os.seekp(0);
+  os.write(reinterpret_cast<const char *>(&fh), sizeof(fh));
+  os.close();
+  if (!os || std::rename(part_path.c_str(), archive_path.c_str()) != 0)
+  {
+    std::cerr << "cannot write " << archive_path << "\n";
+    std::remove(part_path.c_str());
+    return 1;
+  }
+
+  std::cout << archive_path << ": " << files.size() << " files, " << compressed
+            << " with gzip variants, " << fh.size << " bytes, " << skipped << " skipped\n";
+  return 0;
+}
@@ -0,0 +1,141 @@
+#include "archive.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace http
+{
+namespace server
+{
+
+namespace
+{
+
+// Whether [offset, offset + length) lies within a file of the given size.
+bool in_bounds(std::uint64_t offset, std::uint64_t length, std::uint64_t size)
+{
+  return offset <= size && length <= size - offset;
+}
+
+// Compare a path stored in the archive with a request path.
+int compare_path(const char *data, const archive_format::index_entry &e,
+                 const char *path, std::size_t path_size)
+{
+  int result = std::memcmp(data + e.path_offset, path, std::min<std::size_t>(e.path_size, path_size));
+  if (result != 0)
+  {
+    return result;
+  }
+  return e.path_size < path_size ? -1 : e.path_size > path_size ? 1 : 0;
+}
+
+// Find the value of the ETag line in a pre-rendered header block, or an
+// empty view.
+std::string_view find_etag(std::string_view block)
+{
+  static const char prefix[] = "ETag: ";
+  std::size_t begin = block.find(prefix);
+  while (begin != std::string_view::npos && begin != 0 && block.compare(begin - 2, 2, "\r\n") != 0)
+  {
+    begin = block.find(prefix, begin + 1);
+  }
+  if (begin == std::string_view::npos)
+  {
+    return std::string_view();
+  }
+  begin += sizeof(prefix) - 1;
+  std::size_t end = block.find("\r\n", begin);
+  return block.substr(begin, end == std::string_view::npos ? end : end - begin);
+}
+
+} // namespace
+
+archive::archive(const std::string &path)
+    : index_(nullptr), entry_count_(0)
+{
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    throw std::runtime_error("cannot open archive " + path);
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0)
+  {
+    ::close(fd);
+    throw std::runtime_error("cannot stat archive " + path);
+  }
+
+  // Requests touch scattered parts of the archive, so leave read-ahead alone.
+  mapping_.reset(new mapped_file(fd, st.st_size, false));
+  ::close(fd);
+  if (!mapping_->valid())
+  {
+    throw std::runtime_error("cannot map archive " + path);
+  }
+
+  // Check every offset once, so that lookups can trust them.
+  using namespace archive_format;
+  const char *data = mapping_->data();
+  std::uint64_t size = mapping_->size();
+  const file_header *fh = reinterpret_cast<const file_header *>(data);
+  if (size < sizeof(file_header) || std::memcmp(fh->magic, magic, sizeof(magic)) != 0 ||
+      fh->version != version || fh->size != size || fh->index_offset % alignof(index_entry) != 0 ||
+      !in_bounds(fh->index_offset, std::uint64_t(fh->entry_count) * sizeof(index_entry), size))
+  {
+    throw std::runtime_error("not a valid archive: " + path);
+  }
+  index_ = reinterpret_cast<const index_entry *>(data + fh->index_offset);
+  entry_count_ = fh->entry_count;
+  for (std::size_t i = 0; i < entry_count_; ++i)
+  {
+    const index_entry &e = index_[i];
+    bool ok = in_bounds(e.path_offset, e.path_size, size) &&
+              (i == 0 || compare_path(data, index_[i - 1], data + e.path_offset, e.path_size) < 0);
+    for (const variant &v : e.variants)
+    {
+      ok = ok && in_bounds(v.headers_offset, v.headers_size, size) &&
+           in_bounds(v.body_offset, v.body_size, size);
+    }
+    if (!ok || e.variants[identity].body_offset == 0)
+    {
+      throw std::runtime_error("not a valid archive: " + path);
+    }
+  }
+}
+
+bool archive::find(const std::string &request_path, bool accept_gzip, file &f) const
+{
+  using namespace archive_format;
+  const char *data = mapping_->data();
+  const index_entry *end = index_ + entry_count_;
+  const index_entry *e = std::lower_bound(index_, end, request_path,
+                                          [data](const index_entry &entry, const std::string &path) {
+                                            return compare_path(data, entry, path.data(), path.size()) < 0;
+                                          });
+  if (e == end || compare_path(data, *e, request_path.data(), request_path.size()) != 0)
+  {
+    return false;
+  }
+
+  const variant *v = &e->variants[identity];
+  if (accept_gzip && e->variants[gzip].body_offset != 0)
+  {
+    v = &e->variants[gzip];
+  }
+  f.headers = std::string_view(data + v->headers_offset, v->headers_size);
+  f.etag = find_etag(f.headers);
+  f.data = data + v->body_offset;
+  f.size = v->body_size;
+  return true;
+}
+
+std::size_t archive::size() const
+{
+  return entry_count_;
+}
+
+} // namespace server
+} // namespace http
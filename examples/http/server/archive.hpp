@@ -0,0 +1,107 @@
+#ifndef HTTP_ARCHIVE_HPP
+#define HTTP_ARCHIVE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "mapped_file.hpp"
+
+namespace http
+{
+namespace server
+{
+
+// The layout of a packed doc_root, as written by the pack tool. All integers
+// are little endian. The file starts with a file_header, file bodies follow
+// at page-aligned offsets, then the paths and header blocks, and finally the
+// index: one index_entry per file, sorted by request path.
+namespace archive_format
+{
+
+const char magic[8] = {'H', 'T', 'T', 'P', 'P', 'A', 'C', 'K'};
+const std::uint32_t version = 1;
+const std::size_t page_size = 4096;
+
+// The encodings stored for each file. Only content that compresses well has
+// a gzip variant.
+enum encoding
+{
+  identity = 0,
+  gzip = 1,
+  encoding_count = 2
+};
+
+struct file_header
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t entry_count;
+  std::uint64_t index_offset;
+  std::uint64_t size;
+};
+
+// One encoding of a file. headers is a pre-rendered block of
+// "Name: value\r\n" lines; a variant that is not present has body_offset 0.
+struct variant
+{
+  std::uint64_t headers_offset;
+  std::uint64_t body_offset;
+  std::uint64_t body_size;
+  std::uint32_t headers_size;
+  std::uint32_t reserved;
+};
+
+struct index_entry
+{
+  std::uint64_t path_offset;
+  std::uint32_t path_size;
+  std::uint32_t reserved;
+  variant variants[encoding_count];
+};
+
+} // namespace archive_format
+
+// A read-only doc_root packed into a single file and served from one memory
+// mapping. Looking up a file never touches the filesystem.
+class archive
+{
+public:
+  archive(const archive &) = delete;
+  archive &operator=(const archive &) = delete;
+
+  // Map and validate an archive. Throws std::runtime_error if the file cannot
+  // be mapped or is not a well-formed archive.
+  explicit archive(const std::string &path);
+
+  // A file found in the archive. The headers are its pre-rendered block,
+  // sent as they are, and etag points into them.
+  struct file
+  {
+    std::string_view headers;
+    std::string_view etag;
+    const char *data;
+    std::size_t size;
+  };
+
+  // Find a file by its decoded request path, preferring the gzip variant if
+  // accept_gzip is set. Returns false if there is no such file.
+  bool find(const std::string &request_path, bool accept_gzip, file &f) const;
+
+  // The number of files in the archive.
+  std::size_t size() const;
+
+private:
+  // The mapping of the whole archive.
+  std::unique_ptr<mapped_file> mapping_;
+
+  // The index at the end of the mapping.
+  const archive_format::index_entry *index_;
+  std::size_t entry_count_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_ARCHIVE_HPP
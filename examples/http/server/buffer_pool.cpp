@@ -0,0 +1,63 @@
+#include "buffer_pool.hpp"
+#include <memory>
+#include <vector>
+
+namespace http
+{
+namespace server
+{
+
+namespace
+{
+
+// Buffers are only borrowed for the duration of a completion handler, so a
+// thread rarely needs more than one at a time.
+const std::size_t max_pooled_buffers = 4;
+
+std::vector<std::unique_ptr<char[]>> &thread_pool()
+{
+  thread_local std::vector<std::unique_ptr<char[]>> pool;
+  return pool;
+}
+
+} // namespace
+
+pooled_buffer::pooled_buffer()
+{
+  std::vector<std::unique_ptr<char[]>> &pool = thread_pool();
+  if (pool.empty())
+  {
+    data_ = new char[buffer_size];
+  }
+  else
+  {
+    data_ = pool.back().release();
+    pool.pop_back();
+  }
+}
+
+pooled_buffer::~pooled_buffer()
+{
+  std::vector<std::unique_ptr<char[]>> &pool = thread_pool();
+  if (pool.size() < max_pooled_buffers)
+  {
+    pool.emplace_back(data_);
+  }
+  else
+  {
+    delete[] data_;
+  }
+}
+
+char *pooled_buffer::data()
+{
+  return data_;
+}
+
+std::size_t pooled_buffer::size() const
+{
+  return buffer_size;
+}
+
+} // namespace server
+} // namespace http
@@ -0,0 +1,39 @@
+#ifndef HTTP_BUFFER_POOL_HPP
+#define HTTP_BUFFER_POOL_HPP
+
+#include <cstddef>
+
+namespace http
+{
+namespace server
+{
+
+// A read buffer borrowed from a small pool kept by each thread and returned
+// when it goes out of scope. Connections only hold one while they process
+// data they have just read, so idle connections use no buffer memory at all.
+class pooled_buffer
+{
+public:
+  pooled_buffer(const pooled_buffer &) = delete;
+  pooled_buffer &operator=(const pooled_buffer &) = delete;
+
+  // The size of every buffer.
+  static const std::size_t buffer_size = 8192;
+
+  // Borrow a buffer from the calling thread's pool.
+  pooled_buffer();
+
+  // Return the buffer to the pool of the thread destroying it.
+  ~pooled_buffer();
+
+  char *data();
+  std::size_t size() const;
+
+private:
+  char *data_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_BUFFER_POOL_HPP
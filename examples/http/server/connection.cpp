@@ -1,22 +1,68 @@
 #include "connection.hpp"
+#include <cstdio>
 #include <utility>
 #include <vector>
+#include <boost/algorithm/string/predicate.hpp>
+#include "../../trace/trace.hpp"
+#include "buffer_pool.hpp"
 #include "connection_manager.hpp"
 #include "request_handler.hpp"
+#include "tls_context.hpp"
 
 namespace http
 {
 namespace server
 {
 
+namespace
+{
+
+// Whether the client asks to send another request on the same connection.
+bool wants_keep_alive(const request &req)
+{
+  const header *h = req.find(known_header::connection);
+  if (req.http_version_major != 1)
+  {
+    return false;
+  }
+  if (req.http_version_minor >= 1)
+  {
+    return !h || !boost::algorithm::icontains(h->value, "close");
+  }
+  return h && boost::algorithm::icontains(h->value, "keep-alive");
+}
+
+} // namespace
+
 connection::connection(boost::asio::ip::tcp::socket socket,
-                       connection_manager &manager, request_handler &handler)
-    : socket_(std::move(socket)), connection_manager_(manager), request_handler_(handler)
+                       connection_manager &manager, request_handler &handler,
+                       const options &opts, rate_limiter &limiter,
+                       boost::asio::ssl::context *tls)
+    : socket_(std::move(socket)), connection_manager_(manager), request_handler_(handler),
+      request_parser_(opts.max_body_size), reading_body_(false), chunked_(false),
+      keep_alive_(false), options_(opts), rate_limiter_(limiter), http2_writing_(false)
 {
+  if (tls)
+  {
+    tls_stream_.reset(new boost::asio::ssl::stream<boost::asio::ip::tcp::socket &>(socket_, *tls));
+  }
 }
 
 void connection::start()
 {
+  // Reads are only attempted once the socket is readable, and must not block
+  // if the readiness turns out to be spurious.
+  boost::system::error_code ignored_ec;
+  socket_.non_blocking(true, ignored_ec);
+  if (rate_limiter_.enabled())
+  {
+    client_ = socket_.remote_endpoint(ignored_ec).address();
+  }
+  if (tls_stream_)
+  {
+    do_handshake();
+    return;
+  }
   do_read();
 }
 
@@ -25,56 +71,471 @@ void connection::stop()
   socket_.close();
 }
 
+void connection::do_handshake()
+{
+  auto self(shared_from_this());
+  tls_stream_->async_handshake(boost::asio::ssl::stream_base::server,
+  trace::traced("handshake", "http", this, [this, self](boost::system::error_code ec) {
+    if (!ec)
+    {
+      // A client that chose HTTP/2 by ALPN starts with the connection preface.
+      if (tls_context::negotiated_http2(tls_stream_->native_handle()))
+      {
+        start_http2(std::string(), nullptr, nullptr);
+        return;
+      }
+      do_read();
+    }
+    else if (ec != boost::asio::error::operation_aborted)
+    {
+      connection_manager_.stop(shared_from_this());
+    }
+  }));
+}
+
 void connection::do_read()
+{
+  do_read_some(&connection::handle_read);
+}
+
+void connection::do_read_some(void (connection::*handler)(const char *begin, const char *end))
 {
   auto self(shared_from_this());
-  socket_.async_read_some(boost::asio::buffer(buffer_),
-                          [this, self](boost::system::error_code ec, std::size_t bytes_transferred) {
-                            if (!ec)
-                            {
-                              request_parser::result_type result;
-                              std::tie(result, std::ignore) = request_parser_.parse(
-                                  request_, buffer_.data(), buffer_.data() + bytes_transferred);
-
-                              if (result == request_parser::good)
-                              {
-                                request_handler_.handle_request(request_, reply_);
-                                do_write();
-                              }
-                              else if (result == request_parser::bad)
-                              {
-                                reply_ = reply::stock_reply(reply::bad_request);
-                                do_write();
-                              }
-                              else
-                              {
-                                do_read();
-                              }
-                            }
-                            else if (ec != boost::asio::error::operation_aborted)
-                            {
-                              connection_manager_.stop(shared_from_this());
-                            }
-                          });
+  if (tls_stream_)
+  {
+    // Data may already be waiting, decrypted, inside the TLS layer where
+    // socket readiness cannot show it, so the buffer is held for the read.
+    auto buffer = std::make_shared<pooled_buffer>();
+    tls_stream_->async_read_some(boost::asio::buffer(buffer->data(), buffer->size()),
+    trace::traced("read", "http", this, [this, self, handler, buffer](boost::system::error_code ec, std::size_t bytes_transferred) {
+      if (!ec)
+      {
+        (this->*handler)(buffer->data(), buffer->data() + bytes_transferred);
+        return;
+      }
+      if (ec == boost::asio::error::eof || ec == boost::asio::ssl::error::stream_truncated)
+      {
+        keep_tls_session();
+      }
+      if (ec != boost::asio::error::operation_aborted)
+      {
+        connection_manager_.stop(shared_from_this());
+      }
+    }));
+    return;
+  }
+  socket_.async_wait(boost::asio::ip::tcp::socket::wait_read,
+                     trace::traced("read", "http", this, [this, self, handler](boost::system::error_code ec) {
+                       if (!ec)
+                       {
+                         pooled_buffer buffer;
+                         std::size_t bytes_transferred = socket_.read_some(
+                             boost::asio::buffer(buffer.data(), buffer.size()), ec);
+                         if (ec == boost::asio::error::would_block)
+                         {
+                           do_read_some(handler);
+                           return;
+                         }
+                         if (!ec)
+                         {
+                           (this->*handler)(buffer.data(), buffer.data() + bytes_transferred);
+                           return;
+                         }
+                       }
+                       if (ec != boost::asio::error::operation_aborted)
+                       {
+                         connection_manager_.stop(shared_from_this());
+                       }
+                     }));
 }
 
-void connection::do_write()
+void connection::handle_read(const char *begin, const char *end)
+{
+  request_parser::result_type result = request_parser::indeterminate;
+  if (!reading_body_)
+  {
+    {
+      trace::span parse_span("parse", "http");
+      std::tie(result, begin) = request_parser_.parse(request_, begin, end);
+    }
+    if (result == request_parser::good && !rate_limiter_.allow(client_))
+    {
+      // Refused before the body is read or the handler does any work.
+      do_write_rejected();
+      return;
+    }
+    if (result == request_parser::good)
+    {
+      std::string settings;
+      // Over TLS, HTTP/2 is only chosen by ALPN.
+      if (options_.http2 && !tls_stream_ && http2_session::is_preface(request_))
+      {
+        start_http2(std::string(), begin, end);
+        return;
+      }
+
+      result = request_parser_.begin_body(request_);
+      if (options_.http2 && !tls_stream_ && result == request_parser::good &&
+          http2_session::is_upgrade(request_, settings))
+      {
+        start_http2(settings, begin, end);
+        return;
+      }
+
+      if (result == request_parser::indeterminate)
+      {
+        reading_body_ = true;
+        body_sink_ = request_handler_.open_body(request_);
+        if (begin == end && request_parser::expects_continue(request_))
+        {
+          do_write_continue();
+          return;
+        }
+      }
+    }
+  }
+
+  // The body is passed on straight from the read buffer, so memory use does
+  // not depend on its size.
+  if (reading_body_ && result == request_parser::indeterminate)
+  {
+    std::tie(result, begin) = request_parser_.parse_body(
+        begin, end, [this](const char *data, std::size_t length) {
+          request_.body_length += length;
+          if (body_sink_)
+          {
+            body_sink_.write(data, length);
+          }
+        });
+  }
+
+  if (result == request_parser::good)
+  {
+    if (body_sink_)
+    {
+      body_sink_.write(nullptr, 0);
+    }
+    keep_alive_ = wants_keep_alive(request_);
+    if (keep_alive_)
+    {
+      // A pipelined request outlives the borrowed read buffer.
+      pending_.assign(begin, end);
+    }
+    {
+      trace::span handler_span("handler", "http");
+      request_handler_.handle_request(request_, reply_);
+    }
+    do_write();
+  }
+  else if (result == request_parser::bad)
+  {
+    keep_alive_ = false;
+    reply_ = reply::stock_reply(reply::bad_request);
+    do_write();
+  }
+  else if (result == request_parser::too_large)
+  {
+    keep_alive_ = false;
+    reply_ = reply::stock_reply(reply::payload_too_large);
+    do_write();
+  }
+  else if (reading_body_ && body_sink_.wait)
+  {
+    // Read no more of the body than the sink can keep up with.
+    auto self(shared_from_this());
+    body_sink_.wait([this, self]() {
+      do_read();
+    });
+  }
+  else
+  {
+    do_read();
+  }
+}
+
+void connection::do_write_continue()
 {
+  static const char continue_reply[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
   auto self(shared_from_this());
-  boost::asio::async_write(socket_, reply_.to_buffers(),
-  [this, self](boost::system::error_code ec, std::size_t) {
+  async_write(boost::asio::buffer(continue_reply, sizeof(continue_reply) - 1),
+  trace::traced("write", "http", this, [this, self](boost::system::error_code ec, std::size_t) {
     if (!ec)
     {
-      // Initiate graceful connection closure.
-      boost::system::error_code ignored_ec;
-      socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+      do_read();
     }
-
-    if (ec != boost::asio::error::operation_aborted)
+    else if (ec != boost::asio::error::operation_aborted)
     {
       connection_manager_.stop(shared_from_this());
     }
+  }));
+}
+
+void connection::do_write()
+{
+  if (reply_.deferred)
+  {
+    // Write the reply once the handler has completed it.
+    reply::deferred_source deferred = std::move(reply_.deferred);
+    reply_.deferred = nullptr;
+    auto self(shared_from_this());
+    deferred(reply_, [this, self]() {
+      do_write();
+    });
+    return;
+  }
+
+  // A streamed reply of unknown length is delimited by chunks for clients
+  // that understand them, and by closing the connection for the rest.
+  bool has_length = reply_.has_header("Content-Length");
+  if (reply_.body)
+  {
+    if (!has_length && request_.http_version_major == 1 && request_.http_version_minor >= 1)
+    {
+      chunked_ = true;
+      reply_.http_version_minor = 1;
+      reply_.headers.push_back(header{"Transfer-Encoding", "chunked"});
+    }
+    keep_alive_ = keep_alive_ && (has_length || chunked_);
+  }
+  else if (!has_length && reply_.status >= 200 && reply_.status != reply::no_content &&
+           reply_.status != reply::not_modified)
+  {
+    reply_.headers.push_back(header{"Content-Length", std::to_string(reply_.content_buffer().size())});
+  }
+
+  if (keep_alive_)
+  {
+    if (request_.http_version_minor >= 1)
+    {
+      reply_.http_version_minor = 1;
+    }
+    else
+    {
+      reply_.headers.push_back(header{"Connection", "keep-alive"});
+    }
+  }
+
+  auto self(shared_from_this());
+  async_write(reply_.to_buffers(),
+  trace::traced("write", "http", this, [this, self](boost::system::error_code ec, std::size_t) {
+    if (!ec && reply_.body)
+    {
+      do_write_body();
+      return;
+    }
+
+    finish_reply(ec);
+  }));
+}
+
+void connection::do_write_rejected()
+{
+  static const char too_many_requests[] =
+      "HTTP/1.1 429 Too Many Requests\r\n"
+      "Content-Length: 0\r\n"
+      "Retry-After: 1\r\n"
+      "Connection: close\r\n"
+      "\r\n";
+
+  keep_alive_ = false;
+  auto self(shared_from_this());
+  async_write(boost::asio::buffer(too_many_requests, sizeof(too_many_requests) - 1),
+  trace::traced("write", "http", this, [this, self](boost::system::error_code ec, std::size_t) {
+    finish_reply(ec);
+  }));
+}
+
+void connection::do_write_body()
+{
+  enum
+  {
+    body_buffer_size = 8192
+  };
+  body_buffer_.resize(body_buffer_size);
+
+  // The next piece is only produced once the previous one has been written,
+  // so a slow client throttles the source instead of growing a queue.
+  auto self(shared_from_this());
+  reply_.body(boost::asio::buffer(body_buffer_),
+              [this, self](boost::system::error_code ec, std::size_t length) {
+                if (ec)
+                {
+                  // The headers are already sent, so the only way to report
+                  // the failure is to cut the reply short.
+                  connection_manager_.stop(shared_from_this());
+                  return;
+                }
+
+                if (length == 0 && !chunked_)
+                {
+                  finish_reply(ec);
+                  return;
+                }
+
+                static const char crlf[] = {'\r', '\n'};
+                static const char last_chunk[] = {'0', '\r', '\n', '\r', '\n'};
+                std::vector<boost::asio::const_buffer> buffers;
+                if (!chunked_)
+                {
+                  buffers.push_back(boost::asio::buffer(body_buffer_.data(), length));
+                }
+                else if (length == 0)
+                {
+                  buffers.push_back(boost::asio::buffer(last_chunk));
+                }
+                else
+                {
+                  int n = std::snprintf(chunk_size_.data(), chunk_size_.size(), "%zx\r\n", length);
+                  buffers.push_back(boost::asio::buffer(chunk_size_.data(), n));
+                  buffers.push_back(boost::asio::buffer(body_buffer_.data(), length));
+                  buffers.push_back(boost::asio::buffer(crlf));
+                }
+
+                async_write(buffers,
+                trace::traced("write", "http", this, [this, self, length](boost::system::error_code ec, std::size_t) {
+                  if (!ec && length > 0)
+                  {
+                    do_write_body();
+                    return;
+                  }
+
+                  finish_reply(ec);
+                }));
+              });
+}
+
+void connection::finish_reply(boost::system::error_code ec)
+{
+  if (!ec && keep_alive_)
+  {
+    // Drop everything about the finished request, so that an idle
+    // connection holds on to as little memory as possible.
+    request_ = request();
+    request_parser_.reset();
+    reading_body_ = false;
+    body_sink_ = request_handler::body_sink();
+    reply_ = reply();
+    chunked_ = false;
+    std::vector<char>().swap(body_buffer_);
+
+    if (pending_.empty())
+    {
+      do_read();
+      return;
+    }
+    std::string data;
+    data.swap(pending_);
+    handle_read(data.data(), data.data() + data.size());
+    return;
+  }
+
+  if (!ec)
+  {
+    // Initiate graceful connection closure. Over TLS the close is not
+    // announced with close_notify, as clients that keep the connection alive
+    // rely on the reply's length rather than on the close.
+    keep_tls_session();
+    boost::system::error_code ignored_ec;
+    socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+  }
+
+  if (ec != boost::asio::error::operation_aborted)
+  {
+    connection_manager_.stop(shared_from_this());
+  }
+}
+
+void connection::keep_tls_session()
+{
+  if (tls_stream_)
+  {
+    SSL_set_shutdown(tls_stream_->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+  }
+}
+
+void connection::start_http2(const std::string &upgrade_settings, const char *begin, const char *end)
+{
+  keep_alive_ = false;
+  http2_session_ = std::make_shared<http2_session>(request_handler_, options_);
+
+  // Frames are small and interleaved with the client's flow control updates,
+  // so delaying them to coalesce writes only stalls the connection.
+  boost::system::error_code ignored_ec;
+  socket_.set_option(boost::asio::ip::tcp::no_delay(true), ignored_ec);
+
+  // Streamed replies may produce output while no read or write is pending.
+  std::weak_ptr<connection> weak_self(shared_from_this());
+  http2_session_->on_output([weak_self]() {
+    if (auto self = weak_self.lock())
+    {
+      self->do_write_http2();
+    }
   });
+
+  if (tls_stream_)
+  {
+    http2_session_->start_negotiated();
+  }
+  else if (upgrade_settings.empty())
+  {
+    http2_session_->start_prior_knowledge();
+  }
+  else
+  {
+    http2_session_->start_upgrade(request_, upgrade_settings);
+  }
+  http2_session_->consume(begin, end - begin);
+
+  do_write_http2();
+  do_read_http2();
+}
+
+void connection::do_read_http2()
+{
+  do_read_some(&connection::handle_read_http2);
+}
+
+void connection::handle_read_http2(const char *begin, const char *end)
+{
+  http2_session_->consume(begin, end - begin);
+  do_write_http2();
+  if (!http2_session_->closed())
+  {
+    do_read_http2();
+  }
+}
+
+void connection::do_write_http2()
+{
+  if (http2_writing_)
+  {
+    return;
+  }
+
+  if (!http2_session_->take_output(http2_output_))
+  {
+    if (http2_session_->closed())
+    {
+      finish_reply(boost::system::error_code());
+    }
+    return;
+  }
+
+  http2_writing_ = true;
+  auto self(shared_from_this());
+  async_write(boost::asio::buffer(http2_output_),
+  trace::traced("write", "http", this, [this, self](boost::system::error_code ec, std::size_t) {
+    http2_writing_ = false;
+    if (!ec)
+    {
+      do_write_http2();
+    }
+    else if (ec != boost::asio::error::operation_aborted)
+    {
+      connection_manager_.stop(shared_from_this());
+    }
+  }));
 }
 
 }; // namespace server
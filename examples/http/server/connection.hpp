@@ -3,7 +3,14 @@
 
 #include <array>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 #include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include "http2_session.hpp"
+#include "options.hpp"
+#include "rate_limiter.hpp"
 #include "reply.hpp"
 #include "request.hpp"
 #include "request_handler.hpp"
@@ -24,9 +31,12 @@ public:
   connection(const connection &) = delete;
   connection &operator=(const connection &) = delete;
 
-  // Construct a connection with the given socket.
+  // Construct a connection with the given socket, speaking TLS if a context
+  // is given.
   explicit connection(boost::asio::ip::tcp::socket socket,
-                      connection_manager& manager, request_handler& handler);
+                      connection_manager& manager, request_handler& handler,
+                      const options &opts, rate_limiter &limiter,
+                      boost::asio::ssl::context *tls = nullptr);
 
   // Start the first asynchronous operation for the connection.
   void start();
@@ -35,24 +45,81 @@ public:
   void stop();
 
 private:
+  // Perform the TLS handshake, then read the first request.
+  void do_handshake();
 
   // Perform an asynchronous read operation.
   void do_read();
 
+  // Wait until the client sends data, then read it into a buffer borrowed
+  // for the duration of the handler, which must consume all of it.
+  void do_read_some(void (connection::*handler)(const char *begin, const char *end));
+
+  // Parse data received from the client.
+  void handle_read(const char *begin, const char *end);
+
+  // Tell the client to go ahead and send the request body.
+  void do_write_continue();
+
   // Perform an asynchronous write operation.
   void do_write();
 
+  // Refuse a request from a client over its rate limit and close.
+  void do_write_rejected();
+
+  // Write the next piece of a streamed reply's content.
+  void do_write_body();
+
+  // Wait for the next request once the reply has been written, or close the
+  // connection.
+  void finish_reply(boost::system::error_code ec);
+
+  // Switch the connection to HTTP/2, passing it any data already read.
+  // Settings are given for an upgrade from HTTP/1.1; without them the client
+  // either chose HTTP/2 by ALPN or sent the connection preface directly.
+  void start_http2(const std::string &upgrade_settings, const char *begin, const char *end);
+
+  // Keep the TLS session resumable once the connection is freed, which
+  // OpenSSL otherwise only allows after a TLS shutdown.
+  void keep_tls_session();
+
+  // Perform an asynchronous read operation for an HTTP/2 session.
+  void do_read_http2();
+
+  // Pass data received from the client to the HTTP/2 session.
+  void handle_read_http2(const char *begin, const char *end);
+
+  // Write the output of the HTTP/2 session, unless a write is in progress.
+  void do_write_http2();
+
+  // Write all of the buffers to the client, through TLS if it is in use.
+  template <typename ConstBufferSequence, typename WriteHandler>
+  void async_write(const ConstBufferSequence &buffers, WriteHandler &&handler)
+  {
+    if (tls_stream_)
+    {
+      boost::asio::async_write(*tls_stream_, buffers, std::forward<WriteHandler>(handler));
+    }
+    else
+    {
+      boost::asio::async_write(socket_, buffers, std::forward<WriteHandler>(handler));
+    }
+  }
+
   // Socket for the connection.
   boost::asio::ip::tcp::socket socket_;
 
+  // The TLS layer over the socket, if the connection uses TLS.
+  std::unique_ptr<boost::asio::ssl::stream<boost::asio::ip::tcp::socket &>> tls_stream_;
+
   // The manager for this connection.
   connection_manager& connection_manager_;
 
   // The handler used to process the incoming request.
   request_handler& request_handler_;
 
-  // Buffer for incoming data.
-  std::array<char, 8192> buffer_;
+  // Data received after the end of a request, kept for the next one.
+  std::string pending_;
 
   // The incoming request.
   request request_;
@@ -60,8 +127,44 @@ private:
   // The parser for the incoming request.
   request_parser request_parser_;
 
+  // Whether the headers have been parsed and the body is being read.
+  bool reading_body_;
+
+  // Receives the body of the incoming request.
+  request_handler::body_sink body_sink_;
+
   // The reply to be sent back to the client.
   reply reply_;
+
+  // Whether the content of a streamed reply is sent in chunks.
+  bool chunked_;
+
+  // Whether the connection stays open for another request after the reply.
+  bool keep_alive_;
+
+  // Buffer for the content of a streamed reply.
+  std::vector<char> body_buffer_;
+
+  // The size line of the chunk being written.
+  std::array<char, 20> chunk_size_;
+
+  // Optional server behaviour.
+  const options &options_;
+
+  // Limits the rate of requests from each client.
+  rate_limiter &rate_limiter_;
+
+  // The client's address, if requests are rate limited.
+  boost::asio::ip::address client_;
+
+  // The HTTP/2 session, once the connection has switched to HTTP/2.
+  std::shared_ptr<http2_session> http2_session_;
+
+  // The HTTP/2 output being written.
+  std::string http2_output_;
+
+  // Whether an HTTP/2 write is in progress.
+  bool http2_writing_;
 };
 
 typedef std::shared_ptr<connection> connection_ptr;
@@ -0,0 +1,250 @@
+#include "file_cache.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include "mime_types.hpp"
+
+namespace http
+{
+namespace server
+{
+
+namespace
+{
+
+// A file found while walking doc_root.
+struct scanned_file
+{
+  std::string request_path;
+  file_entry entry;
+  bool ok;
+};
+
+// Run fn(i) for every i in [0, count) on the given number of threads.
+template <typename Function>
+void parallel_for(std::size_t count, std::size_t threads, Function fn)
+{
+  std::atomic<std::size_t> next(0);
+  auto worker = [&]() {
+    for (std::size_t i = next++; i < count; i = next++)
+    {
+      fn(i);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (std::size_t i = 1; i < threads; ++i)
+  {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto &t : pool)
+  {
+    t.join();
+  }
+}
+
+// Print a progress line each time another tenth of the work is done.
+class progress
+{
+public:
+  progress(const char *phase, std::size_t total)
+      : phase_(phase), total_(total), done_(0)
+  {
+  }
+
+  void step()
+  {
+    std::size_t done = ++done_;
+    if (done * 10 / total_ != (done - 1) * 10 / total_)
+    {
+      std::ostringstream os;
+      os << "warm-up: " << phase_ << " " << done << "/" << total_ << "\n";
+      std::cerr << os.str();
+    }
+  }
+
+private:
+  const char *phase_;
+  std::size_t total_;
+  std::atomic<std::size_t> done_;
+};
+
+double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+std::string extension_of(const std::string &path)
+{
+  std::size_t last_slash_pos = path.find_last_of("/");
+  std::size_t last_dot_pos = path.find_last_of(".");
+  if (last_dot_pos != std::string::npos && last_dot_pos > last_slash_pos)
+  {
+    return path.substr(last_dot_pos + 1);
+  }
+  return std::string();
+}
+
+// Fill in the size, headers and ETag of a file.
+void resolve(scanned_file &f)
+{
+  std::error_code ec;
+  std::filesystem::path path(f.entry.full_path);
+  f.entry.size = std::filesystem::file_size(path, ec);
+  if (ec)
+  {
+    return;
+  }
+  auto mtime = std::filesystem::last_write_time(path, ec);
+  if (ec)
+  {
+    return;
+  }
+
+  // Weak validator in the style of most servers: size and modification time.
+  std::ostringstream etag;
+  etag << std::hex << "\"" << f.entry.size << "-"
+       << mtime.time_since_epoch().count() << "\"";
+
+  f.entry.headers.resize(3);
+  f.entry.headers[0].name = "Content-Length";
+  f.entry.headers[0].value = std::to_string(f.entry.size);
+  f.entry.headers[1].name = "Content-Type";
+  f.entry.headers[1].value = mime_types::extension_to_type(extension_of(f.request_path));
+  f.entry.headers[2].name = "ETag";
+  f.entry.headers[2].value = etag.str();
+  f.ok = true;
+}
+
+// Read a whole file into memory.
+bool preload(file_entry &entry)
+{
+  std::ifstream is(entry.full_path.c_str(), std::ios::in | std::ios::binary);
+  auto content = std::make_shared<std::string>(entry.size, '\0');
+  if (!is || !is.read(&(*content)[0], content->size()) || is.peek() != EOF)
+  {
+    return false;
+  }
+  entry.content = std::move(content);
+  return true;
+}
+
+} // namespace
+
+file_cache::file_cache()
+{
+}
+
+warm_up_report file_cache::warm_up(const std::string &doc_root,
+                                   std::size_t threads, std::size_t preload_budget)
+{
+  warm_up_report report = warm_up_report();
+  threads = std::max<std::size_t>(threads, 1);
+  auto start = std::chrono::steady_clock::now();
+
+  // List every regular file under doc_root. The directory walk itself is cheap
+  // compared to the per-file work done below. An entry that cannot be
+  // checked, such as a dangling symlink, is counted and skipped; only a
+  // failure to advance the walk ends it.
+  std::vector<scanned_file> files;
+  std::filesystem::path root(doc_root);
+  std::error_code ec;
+  for (std::filesystem::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec))
+  {
+    std::error_code entry_ec;
+    bool regular = it->is_regular_file(entry_ec);
+    if (entry_ec)
+    {
+      ++report.errors;
+    }
+    else if (regular)
+    {
+      scanned_file f;
+      f.request_path = "/" + it->path().lexically_relative(root).generic_string();
+      f.entry.full_path = doc_root + f.request_path;
+      f.entry.size = 0;
+      f.ok = false;
+      files.push_back(std::move(f));
+    }
+  }
+  report.files = files.size();
+
+  // Stat every file and compute its headers.
+  progress scanned("resolved", files.size());
+  parallel_for(files.size(), threads, [&](std::size_t i) {
+    resolve(files[i]);
+    scanned.step();
+  });
+  report.scan_ms = elapsed_ms(start);
+
+  // Spend the budget on the smallest files first, so that it covers as many
+  // requests as possible.
+  std::vector<scanned_file *> candidates;
+  for (auto &f : files)
+  {
+    if (f.ok)
+    {
+      candidates.push_back(&f);
+    }
+    else
+    {
+      ++report.errors;
+    }
+  }
+  std::sort(candidates.begin(), candidates.end(),
+            [](const scanned_file *a, const scanned_file *b) { return a->entry.size < b->entry.size; });
+  std::size_t used = 0;
+  std::size_t count = 0;
+  while (count < candidates.size() && used + candidates[count]->entry.size <= preload_budget)
+  {
+    used += candidates[count++]->entry.size;
+  }
+
+  start = std::chrono::steady_clock::now();
+  std::atomic<std::size_t> loaded_files(0);
+  std::atomic<std::size_t> loaded_bytes(0);
+  progress loaded("preloaded", count);
+  parallel_for(count, threads, [&](std::size_t i) {
+    if (preload(candidates[i]->entry))
+    {
+      ++loaded_files;
+      loaded_bytes += candidates[i]->entry.size;
+    }
+    loaded.step();
+  });
+  report.preloaded_files = loaded_files;
+  report.preloaded_bytes = loaded_bytes;
+  report.load_ms = elapsed_ms(start);
+
+  for (auto f : candidates)
+  {
+    entries_.emplace(std::move(f->request_path), std::move(f->entry));
+  }
+
+  std::cerr << "warm-up: " << report.files << " files resolved in " << report.scan_ms << " ms, "
+            << report.preloaded_files << " files (" << report.preloaded_bytes << " bytes) preloaded in "
+            << report.load_ms << " ms, " << report.errors << " errors\n";
+  return report;
+}
+
+const file_entry *file_cache::find(const std::string &request_path) const
+{
+  auto it = entries_.find(request_path);
+  return it == entries_.end() ? nullptr : &it->second;
+}
+
+bool file_cache::empty() const
+{
+  return entries_.empty();
+}
+
+} // namespace server
+} // namespace http
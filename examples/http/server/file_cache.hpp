@@ -0,0 +1,77 @@
+#ifndef HTTP_FILE_CACHE_HPP
+#define HTTP_FILE_CACHE_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "header.hpp"
+
+namespace http
+{
+namespace server
+{
+
+// Everything about a file under doc_root that can be computed ahead of the
+// first request for it.
+struct file_entry
+{
+  // Path of the file on disk.
+  std::string full_path;
+
+  // Size of the file when it was scanned.
+  std::size_t size;
+
+  // The Content-Length, Content-Type and ETag headers for the file.
+  std::vector<header> headers;
+
+  // The file content, or null if it did not fit in the preload budget.
+  std::shared_ptr<const std::string> content;
+};
+
+// Summary of a warm-up pass.
+struct warm_up_report
+{
+  std::size_t files;
+  std::size_t preloaded_files;
+  std::size_t preloaded_bytes;
+  std::size_t errors;
+  double scan_ms;
+  double load_ms;
+};
+
+// Cache of file metadata and content filled in once, before the server starts
+// accepting connections. The cache assumes doc_root is not modified while the
+// server is running, as is the case for a deployed release.
+class file_cache
+{
+public:
+  file_cache(const file_cache &) = delete;
+  file_cache &operator=(const file_cache &) = delete;
+
+  // Construct an empty cache.
+  file_cache();
+
+  // Walk doc_root using the given number of threads, resolving every regular
+  // file and preloading the smallest ones until preload_budget bytes are used.
+  // Progress is reported on std::cerr.
+  warm_up_report warm_up(const std::string &doc_root, std::size_t threads,
+                         std::size_t preload_budget);
+
+  // Find the entry for a decoded request path, e.g. "/index.html". Returns
+  // null if the path was not seen during warm-up.
+  const file_entry *find(const std::string &request_path) const;
+
+  // Whether warm-up has been run.
+  bool empty() const;
+
+private:
+  // Entries keyed by request path.
+  std::unordered_map<std::string, file_entry> entries_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_FILE_CACHE_HPP
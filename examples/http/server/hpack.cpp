@@ -0,0 +1,577 @@
+#include "hpack.hpp"
+
+namespace http
+{
+namespace server
+{
+namespace hpack
+{
+
+namespace
+{
+
+struct static_entry
+{
+  const char *name;
+  const char *value;
+};
+
+// RFC 7541 Appendix A.
+const static_entry static_table[61] =
+    {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""}};
+
+const std::size_t static_table_size = sizeof(static_table) / sizeof(static_table[0]);
+
+struct huffman_symbol
+{
+  std::uint32_t code;
+  int bits;
+};
+
+// RFC 7541 Appendix B, indexed by symbol. The last entry is EOS.
+const huffman_symbol huffman_table[257] =
+    {
+        {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+        {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+        {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+        {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+        {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+        {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+        {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+        {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+        {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+        {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+        {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+        {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+        {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+        {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+        {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+        {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+        {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+        {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+        {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+        {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+        {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+        {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+        {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+        {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+        {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+        {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+        {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+        {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+        {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+        {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+        {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+        {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+        {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+        {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+        {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+        {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+        {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+        {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+        {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+        {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+        {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+        {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+        {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+        {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+        {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+        {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+        {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+        {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+        {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+        {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+        {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+        {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+        {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+        {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+        {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+        {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+        {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+        {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+        {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+        {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+        {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+        {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+        {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+        {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+        {0x3fffffff, 30}};
+
+const int eos_symbol = 256;
+
+// A binary tree built from the code table, walked one bit at a time.
+class huffman_tree
+{
+public:
+  huffman_tree()
+  {
+    nodes_.push_back(node());
+    for (int symbol = 0; symbol <= eos_symbol; ++symbol)
+    {
+      std::size_t n = 0;
+      for (int bit = huffman_table[symbol].bits - 1; bit >= 0; --bit)
+      {
+        int branch = (huffman_table[symbol].code >> bit) & 1;
+        if (nodes_[n].child[branch] == 0)
+        {
+          nodes_[n].child[branch] = static_cast<int>(nodes_.size());
+          nodes_.push_back(node());
+        }
+        n = nodes_[n].child[branch];
+      }
+      nodes_[n].symbol = symbol;
+    }
+  }
+
+  bool decode(const std::uint8_t *data, std::size_t length, std::string &out) const
+  {
+    std::size_t n = 0;
+    int depth = 0;
+    bool all_ones = true;
+    for (std::size_t i = 0; i < length; ++i)
+    {
+      for (int bit = 7; bit >= 0; --bit)
+      {
+        int branch = (data[i] >> bit) & 1;
+        n = nodes_[n].child[branch];
+        if (n == 0)
+        {
+          return false;
+        }
+        ++depth;
+        all_ones = all_ones && branch == 1;
+        if (nodes_[n].symbol >= 0)
+        {
+          if (nodes_[n].symbol == eos_symbol)
+          {
+            return false;
+          }
+          out.push_back(static_cast<char>(nodes_[n].symbol));
+          n = 0;
+          depth = 0;
+          all_ones = true;
+        }
+      }
+    }
+
+    // Padding must be a prefix of EOS, i.e. at most seven one bits.
+    return depth < 8 && all_ones;
+  }
+
+private:
+  struct node
+  {
+    int child[2] = {0, 0};
+    int symbol = -1;
+  };
+
+  std::vector<node> nodes_;
+};
+
+const huffman_tree &tree()
+{
+  static const huffman_tree t;
+  return t;
+}
+
+// The size of an entry as defined by RFC 7541 section 4.1.
+std::size_t entry_size(const header &h)
+{
+  return h.name.size() + h.value.size() + 32;
+}
+
+// Whether a field changes from response to response, so that adding it to the
+// dynamic table would only evict more useful entries.
+bool is_volatile(const std::string &name)
+{
+  return name == "content-length" || name == "etag" || name == "date" || name == "set-cookie";
+}
+
+} // namespace
+
+dynamic_table::dynamic_table()
+    : size_(0), max_size_(4096)
+{
+}
+
+const header *dynamic_table::at(std::size_t index) const
+{
+  static std::vector<header> statics = [] {
+    std::vector<header> v;
+    for (const static_entry &e : static_table)
+    {
+      v.push_back(header{e.name, e.value});
+    }
+    return v;
+  }();
+
+  if (index == 0)
+  {
+    return nullptr;
+  }
+  else if (index <= static_table_size)
+  {
+    return &statics[index - 1];
+  }
+  else if (index - static_table_size <= entries_.size())
+  {
+    return &entries_[index - static_table_size - 1];
+  }
+  return nullptr;
+}
+
+std::size_t dynamic_table::find(const header &h, bool &name_only) const
+{
+  std::size_t name_index = 0;
+  for (std::size_t i = 0; i < static_table_size; ++i)
+  {
+    if (h.name == static_table[i].name)
+    {
+      if (h.value == static_table[i].value)
+      {
+        name_only = false;
+        return i + 1;
+      }
+      if (name_index == 0)
+      {
+        name_index = i + 1;
+      }
+    }
+  }
+  for (std::size_t i = 0; i < entries_.size(); ++i)
+  {
+    if (h.name == entries_[i].name)
+    {
+      if (h.value == entries_[i].value)
+      {
+        name_only = false;
+        return static_table_size + i + 1;
+      }
+      if (name_index == 0)
+      {
+        name_index = static_table_size + i + 1;
+      }
+    }
+  }
+  name_only = true;
+  return name_index;
+}
+
+void dynamic_table::insert(const header &h)
+{
+  // An entry larger than the table empties it and is not added.
+  entries_.push_front(h);
+  size_ += entry_size(h);
+  evict();
+}
+
+void dynamic_table::max_size(std::size_t size)
+{
+  max_size_ = size;
+  evict();
+}
+
+std::size_t dynamic_table::max_size() const
+{
+  return max_size_;
+}
+
+void dynamic_table::evict()
+{
+  while (size_ > max_size_ && !entries_.empty())
+  {
+    size_ -= entry_size(entries_.back());
+    entries_.pop_back();
+  }
+}
+
+decoder::decoder(std::size_t max_table_size, std::size_t max_header_list_size)
+    : max_table_size_(max_table_size), max_header_list_size_(max_header_list_size)
+{
+  table_.max_size(max_table_size);
+}
+
+std::size_t decoder::max_header_list_size() const
+{
+  return max_header_list_size_;
+}
+
+bool decoder::decode(const std::uint8_t *data, std::size_t length, std::vector<header> &headers)
+{
+  const std::uint8_t *p = data;
+  const std::uint8_t *end = data + length;
+  std::size_t list_size = 0;
+  while (p != end)
+  {
+    std::size_t index = 0;
+    if (*p & 0x80)
+    {
+      // Indexed header field.
+      const header *h = nullptr;
+      if (!decode_integer(p, end, 7, index) || !(h = table_.at(index)))
+      {
+        return false;
+      }
+      list_size += entry_size(*h);
+      if (list_size > max_header_list_size_)
+      {
+        return false;
+      }
+      headers.push_back(*h);
+    }
+    else if ((*p & 0xe0) == 0x20)
+    {
+      // Dynamic table size update.
+      if (!decode_integer(p, end, 5, index) || index > max_table_size_)
+      {
+        return false;
+      }
+      table_.max_size(index);
+    }
+    else
+    {
+      // Literal header field, with incremental indexing (01), without
+      // indexing (0000) or never indexed (0001).
+      bool indexing = (*p & 0xc0) == 0x40;
+      header h;
+      if (!decode_integer(p, end, indexing ? 6 : 4, index))
+      {
+        return false;
+      }
+      if (index != 0)
+      {
+        const header *name = table_.at(index);
+        if (!name)
+        {
+          return false;
+        }
+        h.name = name->name;
+      }
+      else if (!decode_string(p, end, h.name))
+      {
+        return false;
+      }
+      if (!decode_string(p, end, h.value))
+      {
+        return false;
+      }
+      if (indexing)
+      {
+        table_.insert(h);
+      }
+      list_size += entry_size(h);
+      if (list_size > max_header_list_size_)
+      {
+        return false;
+      }
+      headers.push_back(std::move(h));
+    }
+  }
+  return true;
+}
+
+bool decoder::decode_string(const std::uint8_t *&p, const std::uint8_t *end, std::string &out)
+{
+  if (p == end)
+  {
+    return false;
+  }
+  bool huffman = (*p & 0x80) != 0;
+  std::size_t length = 0;
+  if (!decode_integer(p, end, 7, length) || length > static_cast<std::size_t>(end - p))
+  {
+    return false;
+  }
+  if (huffman)
+  {
+    if (!huffman_decode(p, length, out))
+    {
+      return false;
+    }
+  }
+  else
+  {
+    out.assign(reinterpret_cast<const char *>(p), length);
+  }
+  p += length;
+  return true;
+}
+
+encoder::encoder()
+    : size_changed_(false)
+{
+}
+
+void encoder::max_table_size(std::size_t size)
+{
+  // Never grow beyond the default, which bounds our own memory use.
+  if (size > 4096)
+  {
+    size = 4096;
+  }
+  if (size != table_.max_size())
+  {
+    table_.max_size(size);
+    size_changed_ = true;
+  }
+}
+
+void encoder::encode(const std::vector<header> &headers, std::string &out)
+{
+  if (size_changed_)
+  {
+    encode_integer(0x20, 5, table_.max_size(), out);
+    size_changed_ = false;
+  }
+
+  for (const header &h : headers)
+  {
+    bool name_only = false;
+    std::size_t index = table_.find(h, name_only);
+    if (index != 0 && !name_only)
+    {
+      encode_integer(0x80, 7, index, out);
+      continue;
+    }
+
+    // Strings are sent without Huffman coding: responses are dominated by
+    // their bodies, and this keeps encoding a plain copy.
+    bool indexing = !is_volatile(h.name);
+    if (indexing)
+    {
+      encode_integer(0x40, 6, index, out);
+    }
+    else
+    {
+      encode_integer(0x00, 4, index, out);
+    }
+    if (index == 0)
+    {
+      encode_integer(0x00, 7, h.name.size(), out);
+      out += h.name;
+    }
+    encode_integer(0x00, 7, h.value.size(), out);
+    out += h.value;
+    if (indexing)
+    {
+      table_.insert(h);
+    }
+  }
+}
+
+void encode_integer(std::uint8_t first_byte, int prefix_bits, std::size_t value, std::string &out)
+{
+  std::size_t max_prefix = (1u << prefix_bits) - 1;
+  if (value < max_prefix)
+  {
+    out.push_back(static_cast<char>(first_byte | value));
+    return;
+  }
+  out.push_back(static_cast<char>(first_byte | max_prefix));
+  value -= max_prefix;
+  while (value >= 128)
+  {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+bool decode_integer(const std::uint8_t *&p, const std::uint8_t *end, int prefix_bits, std::size_t &value)
+{
+  if (p == end)
+  {
+    return false;
+  }
+  std::size_t max_prefix = (1u << prefix_bits) - 1;
+  value = *p++ & max_prefix;
+  if (value < max_prefix)
+  {
+    return true;
+  }
+  for (int shift = 0; p != end; shift += 7)
+  {
+    // No field in this server comes near 2^28.
+    if (shift > 21)
+    {
+      return false;
+    }
+    std::uint8_t b = *p++;
+    value += static_cast<std::size_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool huffman_decode(const std::uint8_t *data, std::size_t length, std::string &out)
+{
+  return tree().decode(data, length, out);
+}
+
+} // namespace hpack
+} // namespace server
+} // namespace http
@@ -0,0 +1,130 @@
+#ifndef HTTP_HPACK_HPP
+#define HTTP_HPACK_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+#include "header.hpp"
+
+namespace http
+{
+namespace server
+{
+namespace hpack
+{
+
+// The table of recently sent header fields shared by an encoder and the
+// decoder at the other end of the connection.
+class dynamic_table
+{
+public:
+  // Construct a table with the default size of 4096 bytes.
+  dynamic_table();
+
+  // Find an entry by its index, counting from 1 across the static table and
+  // then this table. Returns null if the index is out of range.
+  const header *at(std::size_t index) const;
+
+  // Find the index of an exact match, or failing that of an entry with the
+  // same name. Returns 0 if there is neither. Sets name_only when only the
+  // name matched.
+  std::size_t find(const header &h, bool &name_only) const;
+
+  // Add an entry, evicting the oldest ones to make room for it.
+  void insert(const header &h);
+
+  // Change the maximum size, evicting entries that no longer fit.
+  void max_size(std::size_t size);
+
+  // The current maximum size.
+  std::size_t max_size() const;
+
+private:
+  // Evict entries until the table fits in its maximum size.
+  void evict();
+
+  // The entries, newest first.
+  std::deque<header> entries_;
+
+  // The size of the entries as defined by RFC 7541 section 4.1.
+  std::size_t size_;
+
+  // The maximum size.
+  std::size_t max_size_;
+};
+
+// Decodes header blocks received from the client.
+class decoder
+{
+public:
+  // Construct a decoder allowing up to max_table_size bytes of dynamic table,
+  // as advertised in our SETTINGS_HEADER_TABLE_SIZE, and header lists of up
+  // to max_header_list_size bytes, as advertised in our
+  // SETTINGS_MAX_HEADER_LIST_SIZE.
+  explicit decoder(std::size_t max_table_size = 4096, std::size_t max_header_list_size = 65536);
+
+  // Decode a complete header block, appending the fields to headers. Returns
+  // false if the block is malformed, or if its fields, sized as in RFC 7541
+  // section 4.1, add up to more than the header list limit. Either is a
+  // connection error.
+  bool decode(const std::uint8_t *data, std::size_t length, std::vector<header> &headers);
+
+  // The largest header list accepted.
+  std::size_t max_header_list_size() const;
+
+private:
+  // Decode a string literal.
+  bool decode_string(const std::uint8_t *&p, const std::uint8_t *end, std::string &out);
+
+  // The dynamic table maintained by the client's encoder.
+  dynamic_table table_;
+
+  // The largest dynamic table size the client may ask for.
+  std::size_t max_table_size_;
+
+  // The largest header list accepted. Indexed fields are copied out of the
+  // dynamic table, so a small block could otherwise expand without bound.
+  std::size_t max_header_list_size_;
+};
+
+// Encodes header blocks sent to the client.
+class encoder
+{
+public:
+  // Construct an encoder using the default dynamic table size.
+  encoder();
+
+  // Limit the dynamic table to the size in the client's
+  // SETTINGS_HEADER_TABLE_SIZE. The change is signalled at the start of the
+  // next header block.
+  void max_table_size(std::size_t size);
+
+  // Append the encoding of a header block to out. Names must be lower case.
+  void encode(const std::vector<header> &headers, std::string &out);
+
+private:
+  // The dynamic table the client's decoder mirrors.
+  dynamic_table table_;
+
+  // Whether a dynamic table size update must be sent.
+  bool size_changed_;
+};
+
+// Encode an integer with an n-bit prefix, whose other bits are taken from
+// first_byte.
+void encode_integer(std::uint8_t first_byte, int prefix_bits, std::size_t value, std::string &out);
+
+// Decode an integer with an n-bit prefix. Returns false if the input is
+// truncated or the value is unreasonably large.
+bool decode_integer(const std::uint8_t *&p, const std::uint8_t *end, int prefix_bits, std::size_t &value);
+
+// Decode a Huffman-coded string. Returns false if the coding is invalid.
+bool huffman_decode(const std::uint8_t *data, std::size_t length, std::string &out);
+
+} // namespace hpack
+} // namespace server
+} // namespace http
+
+#endif // HTTP_HPACK_HPP
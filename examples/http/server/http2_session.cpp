@@ -0,0 +1,1043 @@
+#include "http2_session.hpp"
+#include <algorithm>
+#include <cctype>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
+
+namespace http
+{
+namespace server
+{
+
+namespace
+{
+
+namespace frame_type
+{
+const std::uint8_t data = 0x0;
+const std::uint8_t headers = 0x1;
+const std::uint8_t priority = 0x2;
+const std::uint8_t rst_stream = 0x3;
+const std::uint8_t settings = 0x4;
+const std::uint8_t push_promise = 0x5;
+const std::uint8_t ping = 0x6;
+const std::uint8_t goaway = 0x7;
+const std::uint8_t window_update = 0x8;
+const std::uint8_t continuation = 0x9;
+} // namespace frame_type
+
+namespace flag
+{
+const std::uint8_t end_stream = 0x1;
+const std::uint8_t ack = 0x1;
+const std::uint8_t end_headers = 0x4;
+const std::uint8_t padded = 0x8;
+const std::uint8_t priority = 0x20;
+} // namespace flag
+
+namespace error_code
+{
+const std::uint32_t no_error = 0x0;
+const std::uint32_t protocol_error = 0x1;
+const std::uint32_t internal_error = 0x2;
+const std::uint32_t flow_control_error = 0x3;
+const std::uint32_t stream_closed = 0x5;
+const std::uint32_t frame_size_error = 0x6;
+const std::uint32_t refused_stream = 0x7;
+const std::uint32_t compression_error = 0x9;
+} // namespace error_code
+
+namespace setting
+{
+const std::uint16_t header_table_size = 0x1;
+const std::uint16_t max_concurrent_streams = 0x3;
+const std::uint16_t initial_window_size = 0x4;
+const std::uint16_t max_frame_size = 0x5;
+const std::uint16_t max_header_list_size = 0x6;
+} // namespace setting
+
+const char client_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// The size of a frame header.
+const std::size_t frame_header_size = 9;
+
+// The largest frame we accept, which is the protocol default.
+const std::size_t local_max_frame_size = 16384;
+
+// The number of concurrent streams a client may open.
+const std::uint32_t max_concurrent_streams = 100;
+
+// The largest flow control window allowed by the protocol.
+const std::int64_t max_window = 0x7fffffff;
+
+// Receive window credit is returned to the client in batches of this size.
+const std::int64_t window_update_threshold = 32768;
+
+// Output beyond this size waits until the connection has written the rest.
+const std::size_t output_limit = 65536;
+
+std::uint32_t read_u32(const std::uint8_t *p)
+{
+  return (static_cast<std::uint32_t>(p[0]) << 24) | (static_cast<std::uint32_t>(p[1]) << 16) |
+         (static_cast<std::uint32_t>(p[2]) << 8) | static_cast<std::uint32_t>(p[3]);
+}
+
+void append_u32(std::string &out, std::uint32_t value)
+{
+  out.push_back(static_cast<char>(value >> 24));
+  out.push_back(static_cast<char>(value >> 16));
+  out.push_back(static_cast<char>(value >> 8));
+  out.push_back(static_cast<char>(value));
+}
+
+// Strip the padding of a DATA or HEADERS frame. Returns false if the padding
+// is longer than the frame.
+bool strip_padding(std::uint8_t flags, const std::uint8_t *&payload, std::size_t &length)
+{
+  if (flags & flag::padded)
+  {
+    if (length < 1 || payload[0] >= length)
+    {
+      return false;
+    }
+    length -= 1 + payload[0];
+    payload += 1;
+  }
+  return true;
+}
+
+// Decode the base64url value of an HTTP2-Settings header.
+bool base64url_decode(const std::string &in, std::string &out)
+{
+  int bits = 0;
+  std::uint32_t value = 0;
+  for (char c : in)
+  {
+    int digit;
+    if (c >= 'A' && c <= 'Z')
+      digit = c - 'A';
+    else if (c >= 'a' && c <= 'z')
+      digit = c - 'a' + 26;
+    else if (c >= '0' && c <= '9')
+      digit = c - '0' + 52;
+    else if (c == '-' || c == '+')
+      digit = 62;
+    else if (c == '_' || c == '/')
+      digit = 63;
+    else if (c == '=')
+      break;
+    else
+      return false;
+    value = (value << 6) | digit;
+    bits += 6;
+    if (bits >= 8)
+    {
+      bits -= 8;
+      out.push_back(static_cast<char>((value >> bits) & 0xff));
+    }
+  }
+  return true;
+}
+
+// Whether a header only has meaning for a single HTTP/1.x connection, and so
+// must not appear in HTTP/2.
+bool is_connection_specific(const std::string &name)
+{
+  return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+         name == "transfer-encoding" || name == "upgrade";
+}
+
+} // namespace
+
+http2_session::http2_session(request_handler &handler, const options &opts)
+    : request_handler_(handler),
+      max_body_size_(opts.max_body_size),
+      last_stream_id_(0),
+      continuation_id_(0),
+      send_window_(65535),
+      recv_window_(65535),
+      initial_window_size_(65535),
+      max_frame_size_(16384),
+      goaway_received_(false),
+      closed_(false),
+      pumping_(false)
+{
+}
+
+bool http2_session::is_preface(const request &req)
+{
+  return req.method == "PRI" && req.uri == "*" && req.http_version_major == 2 &&
+         req.http_version_minor == 0 && req.headers.empty();
+}
+
+bool http2_session::is_upgrade(const request &req, std::string &settings)
+{
+  if (req.http_version_major != 1 || req.http_version_minor < 1)
+  {
+    return false;
+  }
+
+  // The parser has already refused a repeated HTTP2-Settings header.
+  const header *upgrade_header = req.find(known_header::upgrade);
+  const header *settings_header = req.find(known_header::http2_settings);
+  if (!upgrade_header || !settings_header)
+  {
+    return false;
+  }
+
+  bool upgrade = false;
+  std::vector<std::string> tokens;
+  boost::algorithm::split(tokens, upgrade_header->value, [](char c) { return c == ','; });
+  for (std::string &token : tokens)
+  {
+    boost::algorithm::trim(token);
+    upgrade = upgrade || token == "h2c";
+  }
+  settings = settings_header->value;
+  return upgrade;
+}
+
+void http2_session::start_prior_knowledge()
+{
+  preface_.assign(client_preface + 18);
+
+  std::string payload;
+  payload.push_back(static_cast<char>(setting::max_concurrent_streams >> 8));
+  payload.push_back(static_cast<char>(setting::max_concurrent_streams));
+  append_u32(payload, max_concurrent_streams);
+  payload.push_back(static_cast<char>(setting::max_header_list_size >> 8));
+  payload.push_back(static_cast<char>(setting::max_header_list_size));
+  append_u32(payload, static_cast<std::uint32_t>(decoder_.max_header_list_size()));
+  write_frame(frame_type::settings, 0, 0, payload.data(), payload.size());
+}
+
+void http2_session::start_negotiated()
+{
+  start_prior_knowledge();
+  preface_.assign(client_preface);
+}
+
+void http2_session::start_upgrade(const request &req, const std::string &settings)
+{
+  static const char switching_protocols[] =
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: h2c\r\n"
+      "\r\n";
+  output_.append(switching_protocols);
+  start_prior_knowledge();
+  preface_.assign(client_preface);
+
+  // The settings are those of an implicitly acknowledged SETTINGS frame.
+  std::string payload;
+  if (!base64url_decode(settings, payload) ||
+      !apply_settings(reinterpret_cast<const std::uint8_t *>(payload.data()), payload.size()))
+  {
+    connection_error(error_code::protocol_error);
+    return;
+  }
+
+  // The request is stream 1, already half closed by the client.
+  auto s = std::make_shared<stream>();
+  s->id = 1;
+  s->req = req;
+  s->send_window = initial_window_size_;
+  last_stream_id_ = 1;
+  streams_[1] = s;
+  end_request(s);
+}
+
+void http2_session::consume(const char *data, std::size_t length)
+{
+  if (closed_)
+  {
+    return;
+  }
+
+  // Match the rest of the connection preface.
+  while (!preface_.empty() && length > 0)
+  {
+    if (*data != preface_[0])
+    {
+      connection_error(error_code::protocol_error);
+      return;
+    }
+    preface_.erase(0, 1);
+    ++data;
+    --length;
+  }
+
+  input_.append(data, length);
+  const std::uint8_t *p = reinterpret_cast<const std::uint8_t *>(input_.data());
+  std::size_t available = input_.size();
+  std::size_t pos = 0;
+  while (!closed_ && available - pos >= frame_header_size)
+  {
+    const std::uint8_t *h = p + pos;
+    std::size_t frame_length = (static_cast<std::size_t>(h[0]) << 16) | (h[1] << 8) | h[2];
+    if (frame_length > local_max_frame_size)
+    {
+      connection_error(error_code::frame_size_error);
+      break;
+    }
+    if (available - pos < frame_header_size + frame_length)
+    {
+      break;
+    }
+    handle_frame(h[3], h[4], read_u32(h + 5) & 0x7fffffff, h + frame_header_size, frame_length);
+    pos += frame_header_size + frame_length;
+  }
+  input_.erase(0, pos);
+
+  pump();
+}
+
+bool http2_session::take_output(std::string &buffer)
+{
+  pump();
+  if (output_.empty())
+  {
+    return false;
+  }
+  buffer.clear();
+  buffer.swap(output_);
+  return true;
+}
+
+void http2_session::on_output(std::function<void()> handler)
+{
+  on_output_ = handler;
+}
+
+bool http2_session::closed() const
+{
+  return closed_;
+}
+
+void http2_session::handle_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id,
+                                 const std::uint8_t *payload, std::size_t length)
+{
+  // A header block must not be interleaved with any other frame.
+  if (continuation_id_ != 0 && (type != frame_type::continuation || id != continuation_id_))
+  {
+    connection_error(error_code::protocol_error);
+    return;
+  }
+
+  switch (type)
+  {
+  case frame_type::data:
+    handle_data(flags, id, payload, length);
+    break;
+  case frame_type::headers:
+    handle_headers(flags, id, payload, length);
+    break;
+  case frame_type::priority:
+    if (id == 0 || length != 5)
+    {
+      connection_error(id == 0 ? error_code::protocol_error : error_code::frame_size_error);
+    }
+    break;
+  case frame_type::rst_stream:
+    if (id == 0 || id > last_stream_id_)
+    {
+      connection_error(error_code::protocol_error);
+    }
+    else if (length != 4)
+    {
+      connection_error(error_code::frame_size_error);
+    }
+    else
+    {
+      streams_.erase(id);
+    }
+    break;
+  case frame_type::settings:
+    handle_settings(flags, id, payload, length);
+    break;
+  case frame_type::push_promise:
+    connection_error(error_code::protocol_error);
+    break;
+  case frame_type::ping:
+    if (id != 0)
+    {
+      connection_error(error_code::protocol_error);
+    }
+    else if (length != 8)
+    {
+      connection_error(error_code::frame_size_error);
+    }
+    else if (!(flags & flag::ack))
+    {
+      write_frame(frame_type::ping, flag::ack, 0, payload, length);
+    }
+    break;
+  case frame_type::goaway:
+    goaway_received_ = true;
+    break;
+  case frame_type::window_update:
+    handle_window_update(id, payload, length);
+    break;
+  case frame_type::continuation:
+    handle_continuation(flags, id, payload, length);
+    break;
+  default:
+    // Unknown frame types are ignored.
+    break;
+  }
+}
+
+void http2_session::handle_data(std::uint8_t flags, std::uint32_t id,
+                                const std::uint8_t *payload, std::size_t length)
+{
+  if (id == 0 || id > last_stream_id_)
+  {
+    connection_error(error_code::protocol_error);
+    return;
+  }
+
+  // The whole frame, padding included, counts against flow control.
+  recv_window_ -= length;
+  if (recv_window_ < 0)
+  {
+    connection_error(error_code::flow_control_error);
+    return;
+  }
+  if (recv_window_ <= 65535 - window_update_threshold)
+  {
+    write_window_update(0, static_cast<std::uint32_t>(65535 - recv_window_));
+    recv_window_ = 65535;
+  }
+
+  auto it = streams_.find(id);
+  if (it == streams_.end())
+  {
+    // Frames may still arrive for a stream we have reset.
+    return;
+  }
+  stream_ptr s = it->second;
+  if (s->request_done)
+  {
+    write_rst_stream(id, error_code::stream_closed);
+    streams_.erase(it);
+    return;
+  }
+
+  s->recv_window -= length;
+  if (s->recv_window < 0 || !strip_padding(flags, payload, length))
+  {
+    write_rst_stream(id, s->recv_window < 0 ? error_code::flow_control_error : error_code::protocol_error);
+    streams_.erase(it);
+    return;
+  }
+
+  // Like the HTTP/1.1 connection, hand the body over without buffering it.
+  s->req.body_length += length;
+  if (s->req.body_length > max_body_size_ && !s->too_large)
+  {
+    s->too_large = true;
+    s->sink = request_handler::body_sink();
+    s->rep = reply::stock_reply(reply::payload_too_large);
+    s->data = static_cast<const char *>(s->rep.content_buffer().data());
+    s->data_length = s->rep.content_buffer().size();
+    s->source_done = true;
+    s->reply_ready = true;
+  }
+  if (s->sink && length > 0)
+  {
+    s->sink.write(reinterpret_cast<const char *>(payload), length);
+  }
+
+  if (flags & flag::end_stream)
+  {
+    end_request(s);
+  }
+  else if (s->recv_window <= 65535 - window_update_threshold && !s->window_update_pending)
+  {
+    if (!s->sink.wait)
+    {
+      write_window_update(id, static_cast<std::uint32_t>(65535 - s->recv_window));
+      s->recv_window = 65535;
+      return;
+    }
+
+    // Open the window again only once the sink has caught up, so that a sink
+    // relaying the body elsewhere holds at most one window of it.
+    s->window_update_pending = true;
+    std::weak_ptr<http2_session> weak_self(shared_from_this());
+    s->sink.wait([weak_self, s]() {
+      auto self = weak_self.lock();
+      if (!self)
+      {
+        return;
+      }
+
+      s->window_update_pending = false;
+      auto it = self->streams_.find(s->id);
+      if (self->closed_ || s->request_done || it == self->streams_.end() || it->second != s)
+      {
+        return;
+      }
+      self->write_window_update(s->id, static_cast<std::uint32_t>(65535 - s->recv_window));
+      s->recv_window = 65535;
+      if (!self->pumping_ && self->on_output_)
+      {
+        self->on_output_();
+      }
+    });
+  }
+}
+
+void http2_session::handle_headers(std::uint8_t flags, std::uint32_t id,
+                                   const std::uint8_t *payload, std::size_t length)
+{
+  if (id == 0 || (id & 1) == 0 || !strip_padding(flags, payload, length))
+  {
+    connection_error(error_code::protocol_error);
+    return;
+  }
+  if (flags & flag::priority)
+  {
+    if (length < 5)
+    {
+      connection_error(error_code::frame_size_error);
+      return;
+    }
+    payload += 5;
+    length -= 5;
+  }
+
+  stream_ptr s;
+  auto it = streams_.find(id);
+  if (it != streams_.end())
+  {
+    // Trailers, which must end the stream.
+    s = it->second;
+    if (s->request_done || !(flags & flag::end_stream))
+    {
+      connection_error(error_code::protocol_error);
+      return;
+    }
+  }
+  else if (id <= last_stream_id_)
+  {
+    // Trailers for a stream we have reset. The block must still be decoded
+    // to keep the compression state in step.
+    s = std::make_shared<stream>();
+    s->id = id;
+    s->refused = true;
+    s->request_done = true;
+  }
+  else
+  {
+    last_stream_id_ = id;
+    s = std::make_shared<stream>();
+    s->id = id;
+    s->send_window = initial_window_size_;
+    s->refused = goaway_received_ || streams_.size() >= max_concurrent_streams;
+    if (!s->refused)
+    {
+      streams_[id] = s;
+    }
+  }
+
+  s->header_block.assign(reinterpret_cast<const char *>(payload), length);
+  s->headers_end_stream = (flags & flag::end_stream) != 0;
+  if (flags & flag::end_headers)
+  {
+    end_headers(s);
+  }
+  else
+  {
+    continuation_id_ = id;
+    if (s->refused)
+    {
+      streams_[id] = s;
+    }
+  }
+}
+
+void http2_session::handle_continuation(std::uint8_t flags, std::uint32_t id,
+                                        const std::uint8_t *payload, std::size_t length)
+{
+  auto it = streams_.find(id);
+  if (continuation_id_ == 0 || it == streams_.end())
+  {
+    connection_error(error_code::protocol_error);
+    return;
+  }
+
+  stream_ptr s = it->second;
+  s->header_block.append(reinterpret_cast<const char *>(payload), length);
+  if (s->header_block.size() > 65536)
+  {
+    connection_error(error_code::protocol_error);
+    return;
+  }
+  if (flags & flag::end_headers)
+  {
+    continuation_id_ = 0;
+    if (s->refused)
+    {
+      streams_.erase(it);
+    }
+    end_headers(s);
+  }
+}
+
+void http2_session::handle_settings(std::uint8_t flags, std::uint32_t id,
+                                    const std::uint8_t *payload, std::size_t length)
+{
+  if (id != 0)
+  {
+    connection_error(error_code::protocol_error);
+  }
+  else if (flags & flag::ack)
+  {
+    if (length != 0)
+    {
+      connection_error(error_code::frame_size_error);
+    }
+  }
+  else if (length % 6 != 0)
+  {
+    connection_error(error_code::frame_size_error);
+  }
+  else if (apply_settings(payload, length))
+  {
+    write_frame(frame_type::settings, flag::ack, 0, nullptr, 0);
+  }
+}
+
+bool http2_session::apply_settings(const std::uint8_t *payload, std::size_t length)
+{
+  for (std::size_t i = 0; i + 6 <= length; i += 6)
+  {
+    std::uint16_t identifier = static_cast<std::uint16_t>((payload[i] << 8) | payload[i + 1]);
+    std::uint32_t value = read_u32(payload + i + 2);
+    switch (identifier)
+    {
+    case setting::header_table_size:
+      encoder_.max_table_size(value);
+      break;
+    case setting::initial_window_size:
+      if (value > max_window)
+      {
+        connection_error(error_code::flow_control_error);
+        return false;
+      }
+      // The change applies to the windows of all open streams.
+      for (auto &entry : streams_)
+      {
+        entry.second->send_window += static_cast<std::int64_t>(value) - initial_window_size_;
+      }
+      initial_window_size_ = value;
+      break;
+    case setting::max_frame_size:
+      if (value < 16384 || value > 16777215)
+      {
+        connection_error(error_code::protocol_error);
+        return false;
+      }
+      max_frame_size_ = value;
+      break;
+    default:
+      // Push is never used, and the remaining settings only limit what the
+      // client receives.
+      break;
+    }
+  }
+  return true;
+}
+
+void http2_session::handle_window_update(std::uint32_t id, const std::uint8_t *payload, std::size_t length)
+{
+  if (length != 4)
+  {
+    connection_error(error_code::frame_size_error);
+    return;
+  }
+
+  std::uint32_t increment = read_u32(payload) & 0x7fffffff;
+  if (id == 0)
+  {
+    send_window_ += increment;
+    if (increment == 0 || send_window_ > max_window)
+    {
+      connection_error(increment == 0 ? error_code::protocol_error : error_code::flow_control_error);
+    }
+    return;
+  }
+
+  auto it = streams_.find(id);
+  if (it != streams_.end())
+  {
+    it->second->send_window += increment;
+    if (increment == 0 || it->second->send_window > max_window)
+    {
+      write_rst_stream(id, increment == 0 ? error_code::protocol_error : error_code::flow_control_error);
+      streams_.erase(it);
+    }
+  }
+}
+
+void http2_session::end_headers(const stream_ptr &s)
+{
+  std::vector<header> fields;
+  if (!decoder_.decode(reinterpret_cast<const std::uint8_t *>(s->header_block.data()),
+                       s->header_block.size(), fields))
+  {
+    connection_error(error_code::compression_error);
+    return;
+  }
+  s->header_block.clear();
+  s->header_block.shrink_to_fit();
+
+  if (s->refused)
+  {
+    if (!s->request_done)
+    {
+      write_rst_stream(s->id, error_code::refused_stream);
+    }
+    return;
+  }
+
+  if (s->reply_ready || !s->req.method.empty())
+  {
+    // Trailers carry nothing this server uses.
+    end_request(s);
+    return;
+  }
+
+  if (!make_request(fields, s->req))
+  {
+    write_rst_stream(s->id, error_code::protocol_error);
+    streams_.erase(s->id);
+    return;
+  }
+
+  s->sink = request_handler_.open_body(s->req);
+  if (s->headers_end_stream)
+  {
+    end_request(s);
+  }
+}
+
+bool http2_session::make_request(const std::vector<header> &fields, request &req)
+{
+  req.http_version_major = 2;
+  req.http_version_minor = 0;
+
+  std::string authority;
+  bool regular_seen = false;
+  for (const header &h : fields)
+  {
+    for (char c : h.name)
+    {
+      if (std::isupper(static_cast<unsigned char>(c)))
+      {
+        return false;
+      }
+    }
+
+    if (!h.name.empty() && h.name[0] == ':')
+    {
+      // Pseudo-header fields must come before all regular fields.
+      if (regular_seen)
+      {
+        return false;
+      }
+      if (h.name == ":method")
+        req.method = h.value;
+      else if (h.name == ":path")
+        req.uri = h.value;
+      else if (h.name == ":authority")
+        authority = h.value;
+      else if (h.name != ":scheme")
+        return false;
+    }
+    else
+    {
+      regular_seen = true;
+      req.headers.push_back(h);
+      if (!req.index_last_header())
+      {
+        return false;
+      }
+    }
+  }
+
+  if (!authority.empty() && !req.find(known_header::host))
+  {
+    req.headers.push_back(header{"host", authority});
+    req.index_last_header();
+  }
+  return !req.method.empty() && !req.uri.empty();
+}
+
+void http2_session::end_request(const stream_ptr &s)
+{
+  s->request_done = true;
+  if (s->too_large)
+  {
+    return;
+  }
+
+  if (s->sink)
+  {
+    s->sink.write(nullptr, 0);
+    s->sink = request_handler::body_sink();
+  }
+  request_handler_.handle_request(s->req, s->rep);
+
+  if (s->rep.deferred)
+  {
+    // The handler completes the reply later, by which time the connection
+    // and this session may be gone.
+    reply::deferred_source deferred = std::move(s->rep.deferred);
+    s->rep.deferred = nullptr;
+    std::weak_ptr<http2_session> weak_self(shared_from_this());
+    deferred(s->rep, [weak_self, s]() {
+      auto self = weak_self.lock();
+      if (!self)
+      {
+        return;
+      }
+
+      self->start_reply(*s);
+      if (!self->pumping_ && self->on_output_)
+      {
+        self->on_output_();
+      }
+    });
+    return;
+  }
+  start_reply(*s);
+}
+
+void http2_session::start_reply(stream &s)
+{
+  s.reply_ready = true;
+  if (!s.rep.body)
+  {
+    s.data = static_cast<const char *>(s.rep.content_buffer().data());
+    s.data_length = s.rep.content_buffer().size();
+    s.source_done = true;
+  }
+}
+
+void http2_session::pump()
+{
+  // Hold back replies until the client has sent its connection preface. After
+  // an upgrade this keeps the 101 response and our SETTINGS apart from the
+  // reply to the upgraded request, which some clients cannot buffer.
+  if (!preface_.empty())
+  {
+    return;
+  }
+
+  pumping_ = true;
+
+  // Take turns writing one frame for each stream, so that a large reply does
+  // not hold up the small ones multiplexed with it.
+  bool progress = true;
+  while (progress && !closed_ && output_.size() < output_limit)
+  {
+    progress = false;
+    for (auto it = streams_.begin(); it != streams_.end();)
+    {
+      stream_ptr s = it->second;
+      if (s->reset)
+      {
+        write_rst_stream(s->id, s->reset_code);
+        it = streams_.erase(it);
+        continue;
+      }
+
+      if (s->reply_ready && !s->end_sent)
+      {
+        if (!s->headers_sent)
+        {
+          write_headers(*s);
+          progress = true;
+        }
+        else if (s->data_length > 0 || s->source_done)
+        {
+          progress = write_data(*s) || progress;
+        }
+        else if (!s->source_pending)
+        {
+          read_body(s);
+          progress = progress || s->data_length > 0 || s->source_done;
+        }
+      }
+
+      if (s->end_sent && !s->request_done)
+      {
+        // The reply went out before the client finished sending.
+        write_rst_stream(s->id, error_code::no_error);
+        it = streams_.erase(it);
+      }
+      else if (s->end_sent)
+      {
+        it = streams_.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+  if (goaway_received_ && streams_.empty() && !closed_)
+  {
+    closed_ = true;
+  }
+
+  pumping_ = false;
+}
+
+void http2_session::write_headers(stream &s)
+{
+  std::vector<header> fields;
+  fields.push_back(header{":status", std::to_string(static_cast<int>(s.rep.status))});
+  std::vector<header> raw_headers;
+  s.rep.parse_raw_headers(raw_headers);
+  for (const std::vector<header> *headers : {&s.rep.headers, &raw_headers})
+  {
+    for (const header &h : *headers)
+    {
+      header field{h.name, h.value};
+      std::transform(field.name.begin(), field.name.end(), field.name.begin(),
+                     [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+      if (!is_connection_specific(field.name))
+      {
+        fields.push_back(std::move(field));
+      }
+    }
+  }
+
+  std::string block;
+  encoder_.encode(fields, block);
+
+  bool end_stream = s.source_done && s.data_length == 0;
+  std::size_t offset = 0;
+  do
+  {
+    std::size_t length = std::min(block.size() - offset, max_frame_size_);
+    bool last = offset + length == block.size();
+    std::uint8_t flags = (last ? flag::end_headers : 0);
+    if (offset == 0)
+    {
+      flags |= end_stream ? flag::end_stream : 0;
+      write_frame(frame_type::headers, flags, s.id, block.data(), length);
+    }
+    else
+    {
+      write_frame(frame_type::continuation, flags, s.id, block.data() + offset, length);
+    }
+    offset += length;
+  } while (offset < block.size());
+
+  s.headers_sent = true;
+  s.end_sent = end_stream;
+}
+
+bool http2_session::write_data(stream &s)
+{
+  std::size_t length = s.data_length;
+  length = std::min(length, max_frame_size_);
+  length = static_cast<std::size_t>(std::min<std::int64_t>(length, send_window_));
+  length = static_cast<std::size_t>(std::min<std::int64_t>(length, s.send_window));
+  if (length == 0 && s.data_length > 0)
+  {
+    return false;
+  }
+
+  bool end_stream = s.source_done && length == s.data_length;
+  write_frame(frame_type::data, end_stream ? flag::end_stream : 0, s.id, s.data, length);
+  s.data += length;
+  s.data_length -= length;
+  send_window_ -= length;
+  s.send_window -= length;
+  s.end_sent = end_stream;
+  return true;
+}
+
+void http2_session::read_body(const stream_ptr &s)
+{
+  s->source_pending = true;
+  s->source_buffer.resize(max_frame_size_);
+
+  // The source may complete later, by which time the connection and this
+  // session may be gone.
+  std::weak_ptr<http2_session> weak_self(shared_from_this());
+  s->rep.body(boost::asio::buffer(s->source_buffer),
+              [weak_self, s](boost::system::error_code ec, std::size_t length) {
+                auto self = weak_self.lock();
+                if (!self)
+                {
+                  return;
+                }
+
+                s->source_pending = false;
+                if (ec)
+                {
+                  s->reset = true;
+                  s->reset_code = error_code::internal_error;
+                }
+                else if (length == 0)
+                {
+                  s->source_done = true;
+                }
+                else
+                {
+                  s->data = s->source_buffer.data();
+                  s->data_length = length;
+                }
+
+                if (!self->pumping_ && self->on_output_)
+                {
+                  self->on_output_();
+                }
+              });
+}
+
+void http2_session::write_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id,
+                                const void *payload, std::size_t length)
+{
+  output_.push_back(static_cast<char>(length >> 16));
+  output_.push_back(static_cast<char>(length >> 8));
+  output_.push_back(static_cast<char>(length));
+  output_.push_back(static_cast<char>(type));
+  output_.push_back(static_cast<char>(flags));
+  append_u32(output_, id);
+  output_.append(static_cast<const char *>(payload), length);
+}
+
+void http2_session::write_rst_stream(std::uint32_t id, std::uint32_t code)
+{
+  std::string payload;
+  append_u32(payload, code);
+  write_frame(frame_type::rst_stream, 0, id, payload.data(), payload.size());
+}
+
+void http2_session::write_window_update(std::uint32_t id, std::uint32_t increment)
+{
+  std::string payload;
+  append_u32(payload, increment);
+  write_frame(frame_type::window_update, 0, id, payload.data(), payload.size());
+}
+
+void http2_session::connection_error(std::uint32_t code)
+{
+  std::string payload;
+  append_u32(payload, last_stream_id_);
+  append_u32(payload, code);
+  write_frame(frame_type::goaway, 0, 0, payload.data(), payload.size());
+  streams_.clear();
+  closed_ = true;
+}
+
+} // namespace server
+} // namespace http
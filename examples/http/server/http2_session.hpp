@@ -0,0 +1,237 @@
+#ifndef HTTP_HTTP2_SESSION_HPP
+#define HTTP_HTTP2_SESSION_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "hpack.hpp"
+#include "options.hpp"
+#include "reply.hpp"
+#include "request.hpp"
+#include "request_handler.hpp"
+
+namespace http
+{
+namespace server
+{
+
+// The HTTP/2 protocol state of one connection. The session does no I/O of
+// its own: the connection passes it the bytes it reads and writes out the
+// bytes it produces, so many requests are multiplexed over one socket and
+// one read buffer.
+class http2_session
+    : public std::enable_shared_from_this<http2_session>
+{
+public:
+  http2_session(const http2_session &) = delete;
+  http2_session &operator=(const http2_session &) = delete;
+
+  // Construct a session serving requests with the given handler.
+  http2_session(request_handler &handler, const options &opts);
+
+  // Whether a request is the start of the HTTP/2 connection preface, i.e. the
+  // client assumes HTTP/2 with prior knowledge.
+  static bool is_preface(const request &req);
+
+  // Whether a request asks to upgrade to cleartext HTTP/2. If so, settings
+  // is set to the value of its HTTP2-Settings header.
+  static bool is_upgrade(const request &req, std::string &settings);
+
+  // Start a session whose client sent the connection preface directly. The
+  // "PRI * HTTP/2.0" request line has already been consumed.
+  void start_prior_knowledge();
+
+  // Start a session whose client chose HTTP/2 by ALPN, and has yet to send
+  // the connection preface.
+  void start_negotiated();
+
+  // Start a session upgraded from HTTP/1.1. The request that carried the
+  // upgrade becomes stream 1.
+  void start_upgrade(const request &req, const std::string &settings);
+
+  // Process data received from the client.
+  void consume(const char *data, std::size_t length);
+
+  // Move the output produced so far into buffer, which the connection then
+  // writes to the client. Returns false if there is none. Output is produced
+  // only while the previous buffer is being written, so a slow client
+  // throttles the replies.
+  bool take_output(std::string &buffer);
+
+  // Register a function called when output becomes available other than
+  // during consume(), e.g. when a streamed reply produces more content.
+  void on_output(std::function<void()> handler);
+
+  // Whether the session has ended. The connection is closed once the output
+  // taken from the session has been written.
+  bool closed() const;
+
+private:
+  // The state of one request and its reply.
+  struct stream
+  {
+    std::uint32_t id;
+
+    // The header block, until the last CONTINUATION frame arrives.
+    std::string header_block;
+
+    // Whether the frame carrying the header block ended the stream.
+    bool headers_end_stream = false;
+
+    // Whether the stream exceeded the concurrency limit and is refused once
+    // its header block has been decoded.
+    bool refused = false;
+
+    // The request being received.
+    request req;
+
+    // Receives the request body.
+    request_handler::body_sink sink;
+
+    // Whether the client has finished sending.
+    bool request_done = false;
+
+    // Whether the request body was refused for being too large.
+    bool too_large = false;
+
+    // The flow control window for the request body.
+    std::int64_t recv_window = 65535;
+
+    // Whether the window is opened again once the sink catches up.
+    bool window_update_pending = false;
+
+    // The reply, once the request has been handled.
+    reply rep;
+    bool reply_ready = false;
+    bool headers_sent = false;
+    bool end_sent = false;
+
+    // The flow control window for the reply body.
+    std::int64_t send_window;
+
+    // Reply content produced but not yet sent.
+    const char *data = nullptr;
+    std::size_t data_length = 0;
+
+    // The buffer filled by a streamed reply's body source.
+    std::vector<char> source_buffer;
+    bool source_pending = false;
+    bool source_done = false;
+
+    // Set when the stream must be reset with the given error code.
+    bool reset = false;
+    std::uint32_t reset_code = 0;
+  };
+
+  typedef std::shared_ptr<stream> stream_ptr;
+
+  // Handle one complete frame.
+  void handle_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id,
+                    const std::uint8_t *payload, std::size_t length);
+
+  void handle_data(std::uint8_t flags, std::uint32_t id, const std::uint8_t *payload, std::size_t length);
+  void handle_headers(std::uint8_t flags, std::uint32_t id, const std::uint8_t *payload, std::size_t length);
+  void handle_continuation(std::uint8_t flags, std::uint32_t id, const std::uint8_t *payload, std::size_t length);
+  void handle_settings(std::uint8_t flags, std::uint32_t id, const std::uint8_t *payload, std::size_t length);
+  void handle_window_update(std::uint32_t id, const std::uint8_t *payload, std::size_t length);
+
+  // Apply the parameters of a SETTINGS frame. Returns false on error.
+  bool apply_settings(const std::uint8_t *payload, std::size_t length);
+
+  // Decode a complete header block and start handling the request.
+  void end_headers(const stream_ptr &s);
+
+  // Turn a decoded header block into a request. Returns false if the block is
+  // malformed.
+  static bool make_request(const std::vector<header> &fields, request &req);
+
+  // The client has finished sending the request, so produce the reply.
+  void end_request(const stream_ptr &s);
+
+  // Queue a stream's reply once it is complete.
+  void start_reply(stream &s);
+
+  // Write reply frames for as many streams as flow control and the output
+  // limit allow.
+  void pump();
+
+  // Write the HEADERS frame of a reply.
+  void write_headers(stream &s);
+
+  // Write one DATA frame of a reply. Returns false if flow control prevents it.
+  bool write_data(stream &s);
+
+  // Ask a streamed reply's body source for more content.
+  void read_body(const stream_ptr &s);
+
+  // Queue a frame for output.
+  void write_frame(std::uint8_t type, std::uint8_t flags, std::uint32_t id,
+                   const void *payload, std::size_t length);
+
+  // Queue a RST_STREAM frame.
+  void write_rst_stream(std::uint32_t id, std::uint32_t code);
+
+  // Queue a WINDOW_UPDATE frame.
+  void write_window_update(std::uint32_t id, std::uint32_t increment);
+
+  // Abort the session with a GOAWAY frame.
+  void connection_error(std::uint32_t code);
+
+  // The handler for all incoming requests.
+  request_handler &request_handler_;
+
+  // The largest request body accepted.
+  std::size_t max_body_size_;
+
+  // The open streams, by id.
+  std::map<std::uint32_t, stream_ptr> streams_;
+
+  // The highest stream id opened by the client.
+  std::uint32_t last_stream_id_;
+
+  // The stream whose header block continues in CONTINUATION frames, or 0.
+  std::uint32_t continuation_id_;
+
+  // The part of the connection preface still expected.
+  std::string preface_;
+
+  // Input received but not yet forming a complete frame.
+  std::string input_;
+
+  // Output waiting to be taken by the connection.
+  std::string output_;
+
+  // Header compression state for each direction.
+  hpack::decoder decoder_;
+  hpack::encoder encoder_;
+
+  // Connection-level flow control windows.
+  std::int64_t send_window_;
+  std::int64_t recv_window_;
+
+  // Parameters from the client's SETTINGS.
+  std::int64_t initial_window_size_;
+  std::size_t max_frame_size_;
+
+  // Whether the client sent GOAWAY, after which no new streams are opened.
+  bool goaway_received_;
+
+  // Whether the session has ended.
+  bool closed_;
+
+  // Whether pump() is running, during which output notifications are
+  // unnecessary.
+  bool pumping_;
+
+  // Called when output becomes available outside of consume().
+  std::function<void()> on_output_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_HTTP2_SESSION_HPP
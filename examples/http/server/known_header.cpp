@@ -0,0 +1,138 @@
+#include "known_header.hpp"
+#include <cstdint>
+
+namespace http
+{
+namespace server
+{
+namespace known_header
+{
+
+namespace
+{
+
+// The names, in the order of the enum.
+constexpr const char *names[count] = {
+    "accept-encoding",
+    "connection",
+    "content-length",
+    "expect",
+    "host",
+    "http2-settings",
+    "if-none-match",
+    "range",
+    "transfer-encoding",
+    "upgrade"};
+
+constexpr std::size_t length_of(const char *s)
+{
+  std::size_t length = 0;
+  while (s[length])
+  {
+    ++length;
+  }
+  return length;
+}
+
+constexpr unsigned char to_lower(char c)
+{
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// The names are told apart by their length and first and last characters,
+// mixed by a multiplier chosen at compile time so that no two collide.
+const int hash_bits = 5;
+const std::size_t table_size = std::size_t(1) << hash_bits;
+
+constexpr std::size_t hash(std::uint32_t seed, const char *name, std::size_t length)
+{
+  std::uint32_t key = (std::uint32_t(to_lower(name[0])) << 16) |
+                      (std::uint32_t(to_lower(name[length - 1])) << 8) | std::uint32_t(length);
+  return std::uint32_t(key * seed) >> (32 - hash_bits);
+}
+
+constexpr bool is_perfect(std::uint32_t seed)
+{
+  bool used[table_size] = {};
+  for (const char *name : names)
+  {
+    std::size_t h = hash(seed, name, length_of(name));
+    if (used[h])
+    {
+      return false;
+    }
+    used[h] = true;
+  }
+  return true;
+}
+
+constexpr std::uint32_t find_seed()
+{
+  for (std::uint32_t seed = 0x9e3779b1; seed < 0x9e3779b1 + 2 * 100000; seed += 2)
+  {
+    if (is_perfect(seed))
+    {
+      return seed;
+    }
+  }
+  return 0;
+}
+
+constexpr std::uint32_t seed = find_seed();
+static_assert(seed != 0, "no perfect hash for the known header names");
+
+struct hash_table
+{
+  id slots[table_size];
+};
+
+constexpr hash_table make_table()
+{
+  hash_table table = {};
+  for (std::size_t i = 0; i < table_size; ++i)
+  {
+    table.slots[i] = unknown;
+  }
+  for (std::size_t i = 0; i < count; ++i)
+  {
+    table.slots[hash(seed, names[i], length_of(names[i]))] = static_cast<id>(i);
+  }
+  return table;
+}
+
+constexpr hash_table table = make_table();
+
+} // namespace
+
+id classify(const char *name, std::size_t length)
+{
+  if (length == 0)
+  {
+    return unknown;
+  }
+
+  // The hash picks the only candidate, which is then confirmed.
+  id candidate = table.slots[hash(seed, name, length)];
+  if (candidate == unknown)
+  {
+    return unknown;
+  }
+  const char *expected = names[candidate];
+  for (std::size_t i = 0; i < length; ++i)
+  {
+    if (!expected[i] || to_lower(name[i]) != static_cast<unsigned char>(expected[i]))
+    {
+      return unknown;
+    }
+  }
+  return expected[length] ? unknown : candidate;
+}
+
+bool is_singleton(id h)
+{
+  return h == content_length || h == host || h == http2_settings;
+}
+
+} // namespace known_header
+} // namespace server
+} // namespace http
@@ -0,0 +1,43 @@
+#ifndef HTTP_KNOWN_HEADER_HPP
+#define HTTP_KNOWN_HEADER_HPP
+
+#include <cstddef>
+
+namespace http
+{
+namespace server
+{
+
+// The request headers the server itself looks at. They are identified once,
+// as a request is parsed, so that finding one later is an array lookup.
+namespace known_header
+{
+
+enum id
+{
+  accept_encoding,
+  connection,
+  content_length,
+  expect,
+  host,
+  http2_settings,
+  if_none_match,
+  range,
+  transfer_encoding,
+  upgrade,
+  count,
+  unknown = count
+};
+
+// Identify a header name, ignoring case. Returns unknown for any other name.
+id classify(const char *name, std::size_t length);
+
+// Whether a request may carry the header at most once.
+bool is_singleton(id h);
+
+} // namespace known_header
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_KNOWN_HEADER_HPP
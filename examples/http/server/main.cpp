@@ -1,25 +1,146 @@
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <boost/asio.hpp>
 #include "server.hpp"
 
+namespace
+{
+
+// Return the value of a "--name=value" argument, or null if arg is not name.
+const char *option_value(const char *arg, const char *name)
+{
+  std::size_t length = std::strlen(name);
+  if (std::strncmp(arg, name, length) == 0 && arg[length] == '=')
+  {
+    return arg + length + 1;
+  }
+  return nullptr;
+}
+
+} // namespace
+
 int main(int argc, char* argv[])
 {
   try
   {
     // Check command line arguments.
-    if (argc != 4)
+    if (argc < 4)
     {
-      std::cerr << "Usage: http_server <address> <port> <doc_root>\n";
+      std::cerr << "Usage: http_server <address> <port> <doc_root> [options]\n";
       std::cerr << "  For IPv4, try:\n";
       std::cerr << "    http_server.out 0.0.0.0 80 .\n";
       std::cerr << "  For IPv6, try:\n";
       std::cerr << "    http_server.out 0::0 80 .\n";
-      return 1;      
+      std::cerr << "  Options:\n";
+      std::cerr << "    --warm-up                 resolve and preload doc_root before listening\n";
+      std::cerr << "    --warm-up-threads=<n>     threads used for warm-up\n";
+      std::cerr << "    --preload-budget=<MiB>    memory used for preloaded files\n";
+      std::cerr << "    --max-body-size=<KiB>     largest request body accepted\n";
+      std::cerr << "    --mmap                    serve files from shared memory mappings\n";
+      std::cerr << "    --archive=<file>          serve a packed doc_root, reloaded on SIGHUP\n";
+      std::cerr << "    --upload-dir=<dir>        store PUT request bodies in dir\n";
+      std::cerr << "    --status-prefix=<path>    serve <path>/health and <path>/metrics\n";
+      std::cerr << "    --proxy=<path>=<upstream>[,<upstream>...]\n";
+      std::cerr << "                              relay requests under path to host:port or unix:/path\n";
+      std::cerr << "    --proxy-connect-timeout=<s> seconds allowed to connect to an upstream\n";
+      std::cerr << "    --proxy-timeout=<s>       seconds an upstream may go without responding\n";
+      std::cerr << "    --rate-limit=<n>          requests per second allowed per client address\n";
+      std::cerr << "    --rate-burst=<n>          requests a client may make in a burst\n";
+      std::cerr << "    --trace                   record async operations, dumped on SIGUSR1\n";
+      std::cerr << "    --tls-cert=<file>         serve HTTPS with a PEM certificate chain\n";
+      std::cerr << "    --tls-key=<file>          PEM private key, if not in the certificate file\n";
+      std::cerr << "    --tls-ticket-rotation=<s> seconds between session ticket key rotations\n";
+      std::cerr << "    --no-http2                refuse HTTP/2\n";
+      return 1;
+    }
+
+    http::server::options opts;
+    for (int i = 4; i < argc; ++i)
+    {
+      const char *value = nullptr;
+      if (std::strcmp(argv[i], "--warm-up") == 0)
+      {
+        opts.warm_up = true;
+      }
+      else if (std::strcmp(argv[i], "--mmap") == 0)
+      {
+        opts.map_files = true;
+      }
+      else if (std::strcmp(argv[i], "--trace") == 0)
+      {
+        opts.trace = true;
+      }
+      else if (std::strcmp(argv[i], "--no-http2") == 0)
+      {
+        opts.http2 = false;
+      }
+      else if ((value = option_value(argv[i], "--warm-up-threads")))
+      {
+        opts.warm_up_threads = std::strtoul(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--preload-budget")))
+      {
+        opts.preload_budget = std::strtoul(value, nullptr, 10) * 1024 * 1024;
+      }
+      else if ((value = option_value(argv[i], "--max-body-size")))
+      {
+        opts.max_body_size = std::strtoul(value, nullptr, 10) * 1024;
+      }
+      else if ((value = option_value(argv[i], "--archive")))
+      {
+        opts.archive = value;
+      }
+      else if ((value = option_value(argv[i], "--status-prefix")))
+      {
+        opts.status_prefix = value;
+      }
+      else if ((value = option_value(argv[i], "--proxy")))
+      {
+        opts.proxies.push_back(value);
+      }
+      else if ((value = option_value(argv[i], "--proxy-connect-timeout")))
+      {
+        opts.proxy_connect_timeout = std::strtol(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--proxy-timeout")))
+      {
+        opts.proxy_timeout = std::strtol(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--rate-limit")))
+      {
+        opts.rate_limit = std::strtod(value, nullptr);
+      }
+      else if ((value = option_value(argv[i], "--rate-burst")))
+      {
+        opts.rate_burst = std::strtod(value, nullptr);
+      }
+      else if ((value = option_value(argv[i], "--tls-cert")))
+      {
+        opts.tls_certificate = value;
+      }
+      else if ((value = option_value(argv[i], "--tls-key")))
+      {
+        opts.tls_private_key = value;
+      }
+      else if ((value = option_value(argv[i], "--tls-ticket-rotation")))
+      {
+        opts.tls_ticket_rotation = std::strtol(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--upload-dir")))
+      {
+        opts.upload_dir = value;
+      }
+      else
+      {
+        std::cerr << "Unknown option: " << argv[i] << "\n";
+        return 1;
+      }
     }
 
     // Initialise the server.
-    http::server::server s(argv[1], argv[2], argv[3]);
+    http::server::server s(argv[1], argv[2], argv[3], opts);
 
     // Run the server until stopped.
     s.run();
@@ -30,4 +151,4 @@ int main(int argc, char* argv[])
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,107 @@
+#include "mapped_file.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace http
+{
+namespace server
+{
+
+mapped_file::mapped_file(int fd, std::size_t size, bool sequential)
+    : data_(MAP_FAILED), size_(size)
+{
+  if (size_ > 0)
+  {
+    data_ = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  if (data_ != MAP_FAILED && sequential)
+  {
+    // Replies are written front to back, so read ahead aggressively and let
+    // the kernel drop pages behind the reader.
+    ::madvise(data_, size_, MADV_SEQUENTIAL);
+    ::madvise(data_, size_, MADV_WILLNEED);
+  }
+}
+
+mapped_file::~mapped_file()
+{
+  if (data_ != MAP_FAILED)
+  {
+    ::munmap(data_, size_);
+  }
+}
+
+bool mapped_file::valid() const
+{
+  return data_ != MAP_FAILED;
+}
+
+const char *mapped_file::data() const
+{
+  return static_cast<const char *>(data_);
+}
+
+std::size_t mapped_file::size() const
+{
+  return size_;
+}
+
+mapped_files::mapped_files()
+    : purged_size_(0)
+{
+}
+
+std::shared_ptr<const mapped_file> mapped_files::open(const std::string &full_path)
+{
+  int fd = ::open(full_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return nullptr;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+  {
+    ::close(fd);
+    return nullptr;
+  }
+
+  // Share the existing mapping unless the file has been replaced since.
+  entry &e = entries_[full_path];
+  std::shared_ptr<const mapped_file> file = e.file.lock();
+  if (!file || e.size != static_cast<std::size_t>(st.st_size) || e.mtime != st.st_mtime)
+  {
+    file = std::make_shared<mapped_file>(fd, st.st_size);
+    e.file = file;
+    e.size = st.st_size;
+    e.mtime = st.st_mtime;
+  }
+  ::close(fd);
+
+  if (entries_.size() > 2 * purged_size_ + 64)
+  {
+    purge();
+  }
+  return file->valid() ? file : nullptr;
+}
+
+void mapped_files::purge()
+{
+  for (auto it = entries_.begin(); it != entries_.end();)
+  {
+    if (it->second.file.expired())
+    {
+      it = entries_.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+  purged_size_ = entries_.size();
+}
+
+} // namespace server
+} // namespace http
@@ -0,0 +1,79 @@
+#ifndef HTTP_MAPPED_FILE_HPP
+#define HTTP_MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace http
+{
+namespace server
+{
+
+// A read-only memory mapping of a whole file. The pages belong to the page
+// cache, so every reply that refers to the mapping shares one copy of the
+// file no matter how many clients are reading it.
+class mapped_file
+{
+public:
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  // Map size bytes of the open file descriptor fd. Unless the file will be
+  // read sequentially, the kernel is left to its default read-ahead.
+  mapped_file(int fd, std::size_t size, bool sequential = true);
+
+  // Unmap the file.
+  ~mapped_file();
+
+  // Whether the mapping succeeded.
+  bool valid() const;
+
+  // The mapped content.
+  const char *data() const;
+  std::size_t size() const;
+
+private:
+  void *data_;
+  std::size_t size_;
+};
+
+// The mappings of the files currently being served. A file is mapped by the
+// first request for it and unmapped once the last reply referring to it has
+// been written; a file that changes on disk is mapped afresh.
+class mapped_files
+{
+public:
+  mapped_files(const mapped_files &) = delete;
+  mapped_files &operator=(const mapped_files &) = delete;
+
+  // Construct an empty set of mappings.
+  mapped_files();
+
+  // Return the mapping of a regular file, or null if it cannot be mapped.
+  std::shared_ptr<const mapped_file> open(const std::string &full_path);
+
+private:
+  struct entry
+  {
+    std::weak_ptr<const mapped_file> file;
+    std::size_t size;
+    std::time_t mtime;
+  };
+
+  // Remove the entries whose mappings have been released.
+  void purge();
+
+  // Entries keyed by file path.
+  std::unordered_map<std::string, entry> entries_;
+
+  // The number of entries when they were last purged.
+  std::size_t purged_size_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_MAPPED_FILE_HPP
@@ -0,0 +1,79 @@
+#ifndef HTTP_OPTIONS_HPP
+#define HTTP_OPTIONS_HPP
+
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace http
+{
+namespace server
+{
+
+// Optional server behaviour, set from the command line.
+struct options
+{
+  // Walk doc_root and preload files before accepting connections.
+  bool warm_up = false;
+
+  // The number of threads used to walk doc_root.
+  std::size_t warm_up_threads = std::thread::hardware_concurrency();
+
+  // The maximum number of bytes of file content to preload.
+  std::size_t preload_budget = 64 * 1024 * 1024;
+
+  // The largest request body accepted.
+  std::size_t max_body_size = 64 * 1024 * 1024;
+
+  // Serve files from shared memory mappings instead of reading them.
+  bool map_files = false;
+
+  // A packed archive served instead of doc_root, reloaded on SIGHUP.
+  std::string archive;
+
+  // The directory in which PUT requests store files, empty to refuse them.
+  std::string upload_dir;
+
+  // The path under which health and metrics routes are served, empty to
+  // serve only files.
+  std::string status_prefix;
+
+  // Paths relayed to upstream servers, each given as
+  // "<prefix>=<upstream>[,<upstream>...]" where an upstream is "host:port"
+  // or "unix:/path".
+  std::vector<std::string> proxies;
+
+  // The seconds allowed for connecting to an upstream, and for each part of
+  // its response, before the client is answered with 504 Gateway Timeout.
+  long proxy_connect_timeout = 5;
+  long proxy_timeout = 60;
+
+  // The requests per second each client address may make, 0 for no limit.
+  double rate_limit = 0;
+
+  // The number of requests a client may make in a burst.
+  double rate_burst = 20;
+
+  // Record asynchronous operations, written out as a Chrome trace on
+  // SIGUSR1.
+  bool trace = false;
+
+  // The PEM certificate chain served over TLS, empty to serve cleartext.
+  std::string tls_certificate;
+
+  // The PEM private key of the certificate, if not in the same file.
+  std::string tls_private_key;
+
+  // The seconds between rotations of the session ticket key.
+  long tls_ticket_rotation = 60 * 60;
+
+  // Accept HTTP/2: over cleartext with prior knowledge or by upgrade, and
+  // over TLS when the client chooses it by ALPN.
+  bool http2 = true;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_OPTIONS_HPP
@@ -0,0 +1,936 @@
+#include "proxy.hpp"
+#include <sys/socket.h>
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+#include "reply.hpp"
+#include "request.hpp"
+#include "request_parser.hpp"
+
+namespace http
+{
+namespace server
+{
+
+namespace
+{
+
+// Headers describing one connection rather than the message, which are not
+// relayed.
+bool is_hop_by_hop(const std::string &name)
+{
+  static const char *const names[] = {"Connection", "Keep-Alive", "Proxy-Connection",
+                                      "TE", "Trailer", "Transfer-Encoding", "Upgrade",
+                                      "Expect", "HTTP2-Settings"};
+  for (const char *n : names)
+  {
+    if (boost::algorithm::iequals(name, n))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The largest response head accepted from an upstream.
+const std::size_t max_head_size = 64 * 1024;
+
+} // namespace
+
+// One request relayed to an upstream and its response. The exchange is kept
+// alive by its pending operations, and by handles given out to the request
+// handler; once the last handle is gone the exchange is abandoned and its
+// connection closed.
+class proxy::exchange
+    : public std::enable_shared_from_this<exchange>
+{
+public:
+  exchange(proxy &owner, upstream &u, const request &req);
+  ~exchange();
+
+  // Connect to the upstream, reusing an idle connection if there is one.
+  void start(std::weak_ptr<exchange> handle);
+
+  // Relay a piece of the request body, or end the request if there is no
+  // data.
+  void write_body(const char *data, std::size_t length);
+
+  // Call the handler once the request data written so far has been sent.
+  void wait(std::function<void()> ready);
+
+  // Fill in the reply once the response head arrives.
+  void get_reply(reply &rep, reply::ready_handler handler);
+
+  // Read the next piece of the response body into the buffer.
+  void read_body(boost::asio::mutable_buffer buffer, reply::body_handler handler);
+
+  // Close the connection, as nobody is waiting for the response any more.
+  void abandon();
+
+  // Close the connection and drop the handlers waiting on the exchange, as
+  // the server is stopping.
+  void stop();
+
+private:
+  void connect();
+  void connected();
+
+  // Write request data, sending as much as possible straight from the
+  // caller's buffer and queueing only the rest.
+  void send(const char *data, std::size_t length, const char *suffix, std::size_t suffix_length);
+  void do_write();
+
+  void do_read_head();
+  void parse_head();
+  bool parse_header_lines(std::size_t begin, std::size_t end);
+  void deliver();
+
+  // Remove the framing from body data in place, and pass on the content.
+  void handle_body(char *data, std::size_t length, boost::asio::mutable_buffer buffer,
+                   reply::body_handler handler);
+
+  // Give up on the exchange, retrying once on a new connection if a reused
+  // one turns out to have been closed.
+  void fail();
+
+  // Fail the exchange unless the upstream makes progress within timeout.
+  void arm(std::chrono::steady_clock::duration timeout);
+
+  // Stop counting the request against the upstream, keeping the connection
+  // for another request if it is in a fit state.
+  void release();
+
+  proxy &proxy_;
+  upstream &upstream_;
+  std::unique_ptr<socket_type> socket_;
+
+  // Counts connection attempts, so that completions for an abandoned
+  // attempt are ignored.
+  unsigned attempt_;
+  bool connected_;
+  bool reused_;
+  bool retried_;
+
+  // The handle given out to the request handler.
+  std::weak_ptr<exchange> handle_;
+
+  // The request line and headers, kept until the response starts in case
+  // the request must be sent again.
+  std::string head_;
+  bool has_length_;
+  bool head_queued_;
+  bool chunked_;
+  bool body_sent_;
+  bool request_done_;
+
+  // Request data queued for writing, and the data being written.
+  std::string output_;
+  std::string writing_buffer_;
+  bool writing_;
+  std::function<void()> drained_;
+
+  // The response head as it arrives, and any body data read with it.
+  std::string input_;
+  std::size_t body_begin_;
+  bool response_started_;
+  bool head_request_;
+  bool head_done_;
+  int status_;
+  std::string status_text_;
+
+  // The response headers, indexed for the body framing.
+  request response_;
+  request_parser body_parser_;
+  bool until_close_;
+  bool response_done_;
+  bool reusable_;
+
+  reply *reply_;
+  reply::ready_handler ready_;
+  bool failed_;
+  bool released_;
+
+  // The deadline for the upstream's next step, and whether it was missed.
+  boost::asio::steady_timer timer_;
+  bool timed_out_;
+};
+
+proxy::exchange::exchange(proxy &owner, upstream &u, const request &req)
+    : proxy_(owner), upstream_(u), attempt_(0), connected_(false), reused_(false),
+      retried_(false), has_length_(req.find(known_header::content_length) != nullptr),
+      head_queued_(false), chunked_(false), body_sent_(false), request_done_(false),
+      writing_(false), body_begin_(0), response_started_(false),
+      head_request_(req.method == "HEAD"), head_done_(false), status_(0), until_close_(false),
+      response_done_(false), reusable_(false), reply_(nullptr), failed_(false), released_(false),
+      timer_(owner.io_context_), timed_out_(false)
+{
+  ++upstream_.outstanding;
+  proxy_.exchanges_.insert(this);
+
+  head_ = req.method + " " + req.uri + " HTTP/1.1\r\n";
+  for (const header &h : req.headers)
+  {
+    if (!is_hop_by_hop(h.name))
+    {
+      head_ += h.name + ": " + h.value + "\r\n";
+    }
+  }
+  if (!req.find(known_header::host))
+  {
+    head_ += "Host: " + upstream_.name + "\r\n";
+  }
+}
+
+proxy::exchange::~exchange()
+{
+  release();
+  proxy_.exchanges_.erase(this);
+}
+
+void proxy::exchange::start(std::weak_ptr<exchange> handle)
+{
+  handle_ = handle;
+  socket_ = proxy_.take_idle(upstream_);
+  if (socket_)
+  {
+    reused_ = true;
+    connected();
+    return;
+  }
+  connect();
+}
+
+void proxy::exchange::connect()
+{
+  socket_.reset(new socket_type(proxy_.io_context_));
+  arm(proxy_.connect_timeout_);
+  auto self(shared_from_this());
+  unsigned attempt = attempt_;
+  socket_->async_connect(upstream_.endpoint, [this, self, attempt](boost::system::error_code ec) {
+    if (attempt != attempt_ || failed_)
+    {
+      return;
+    }
+    if (ec)
+    {
+      fail();
+      return;
+    }
+
+    boost::system::error_code ignored_ec;
+    socket_->non_blocking(true, ignored_ec);
+    if (upstream_.endpoint.protocol().family() != AF_UNIX)
+    {
+      socket_->set_option(boost::asio::ip::tcp::no_delay(true), ignored_ec);
+    }
+    connected();
+  });
+}
+
+void proxy::exchange::connected()
+{
+  connected_ = true;
+  arm(proxy_.response_timeout_);
+  do_write();
+  do_read_head();
+}
+
+void proxy::exchange::write_body(const char *data, std::size_t length)
+{
+  if (failed_ || request_done_)
+  {
+    return;
+  }
+
+  // A request body arriving slowly from the client does not count against
+  // the upstream.
+  if (connected_ && !head_done_)
+  {
+    arm(proxy_.response_timeout_);
+  }
+
+  // The head goes out with the first piece of the body, once it is known
+  // whether there is one. A body of unknown length is sent in chunks.
+  if (!head_queued_)
+  {
+    head_queued_ = true;
+    chunked_ = length > 0 && !has_length_;
+    if (chunked_)
+    {
+      head_ += "Transfer-Encoding: chunked\r\n";
+    }
+    head_ += "\r\n";
+    output_ += head_;
+  }
+
+  if (length == 0)
+  {
+    static const char last_chunk[] = "0\r\n\r\n";
+    request_done_ = true;
+    if (chunked_)
+    {
+      send(last_chunk, sizeof(last_chunk) - 1, nullptr, 0);
+    }
+    else
+    {
+      do_write();
+    }
+    return;
+  }
+
+  body_sent_ = true;
+  if (chunked_)
+  {
+    char size[20];
+    int n = std::snprintf(size, sizeof(size), "%zx\r\n", length);
+    output_.append(size, n);
+    send(data, length, "\r\n", 2);
+  }
+  else
+  {
+    send(data, length, nullptr, 0);
+  }
+}
+
+void proxy::exchange::send(const char *data, std::size_t length, const char *suffix,
+                           std::size_t suffix_length)
+{
+  if (connected_ && !writing_)
+  {
+    std::array<boost::asio::const_buffer, 3> buffers = {{boost::asio::buffer(output_),
+                                                         boost::asio::buffer(data, length),
+                                                         boost::asio::buffer(suffix, suffix_length)}};
+    boost::system::error_code ec;
+    std::size_t n = socket_->write_some(buffers, ec);
+    if (ec == boost::asio::error::would_block)
+    {
+      n = 0;
+    }
+    else if (ec)
+    {
+      fail();
+      return;
+    }
+
+    std::size_t m = std::min(n, output_.size());
+    output_.erase(0, m);
+    n -= m;
+    m = std::min(n, length);
+    data += m;
+    length -= m;
+    n -= m;
+    suffix += n;
+    suffix_length -= n;
+  }
+
+  output_.append(data, length);
+  output_.append(suffix, suffix_length);
+  do_write();
+}
+
+void proxy::exchange::do_write()
+{
+  if (!connected_ || writing_)
+  {
+    return;
+  }
+  if (output_.empty())
+  {
+    // Nothing was queued while connecting.
+    if (drained_)
+    {
+      boost::asio::post(proxy_.io_context_, std::move(drained_));
+      drained_ = nullptr;
+    }
+    return;
+  }
+
+  writing_ = true;
+  writing_buffer_.clear();
+  writing_buffer_.swap(output_);
+  auto self(shared_from_this());
+  unsigned attempt = attempt_;
+  boost::asio::async_write(*socket_, boost::asio::buffer(writing_buffer_),
+  [this, self, attempt](boost::system::error_code ec, std::size_t) {
+    if (attempt != attempt_ || failed_)
+    {
+      return;
+    }
+    writing_ = false;
+    if (ec)
+    {
+      fail();
+      return;
+    }
+    if (!output_.empty())
+    {
+      do_write();
+      return;
+    }
+    if (drained_)
+    {
+      std::function<void()> ready = std::move(drained_);
+      drained_ = nullptr;
+      ready();
+    }
+  });
+}
+
+void proxy::exchange::wait(std::function<void()> ready)
+{
+  if (failed_ || (connected_ && !writing_ && output_.empty()))
+  {
+    boost::asio::post(proxy_.io_context_, std::move(ready));
+    return;
+  }
+  drained_ = std::move(ready);
+}
+
+void proxy::exchange::do_read_head()
+{
+  std::size_t used = input_.size();
+  if (used >= max_head_size)
+  {
+    fail();
+    return;
+  }
+
+  enum
+  {
+    read_size = 4096
+  };
+  input_.resize(used + read_size);
+  auto self(shared_from_this());
+  unsigned attempt = attempt_;
+  socket_->async_read_some(boost::asio::buffer(&input_[used], read_size),
+  [this, self, attempt, used](boost::system::error_code ec, std::size_t bytes_transferred) {
+    if (attempt != attempt_ || failed_)
+    {
+      return;
+    }
+    input_.resize(used + (ec ? 0 : bytes_transferred));
+    if (ec)
+    {
+      fail();
+      return;
+    }
+    response_started_ = true;
+    parse_head();
+  });
+}
+
+void proxy::exchange::parse_head()
+{
+  for (;;)
+  {
+    std::size_t end = input_.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+      do_read_head();
+      return;
+    }
+
+    // "HTTP/1.x NNN reason"
+    std::size_t line_end = input_.find("\r\n");
+    if (line_end < 12 || input_.compare(0, 7, "HTTP/1.") != 0 || input_[8] != ' ' ||
+        !std::isdigit(static_cast<unsigned char>(input_[9])) ||
+        !std::isdigit(static_cast<unsigned char>(input_[10])) ||
+        !std::isdigit(static_cast<unsigned char>(input_[11])))
+    {
+      fail();
+      return;
+    }
+    int status = (input_[9] - '0') * 100 + (input_[10] - '0') * 10 + (input_[11] - '0');
+
+    // Interim responses are not relayed, and the real one follows.
+    if (status >= 100 && status < 200 && status != 101)
+    {
+      input_.erase(0, end + 4);
+      continue;
+    }
+
+    response_.http_version_major = 1;
+    response_.http_version_minor = input_[7] - '0';
+    if (status < 200 || !parse_header_lines(line_end + 2, end + 2))
+    {
+      fail();
+      return;
+    }
+    status_ = status;
+    status_text_ = input_.substr(9, line_end - 9) + "\r\n";
+
+    // Keep only the body data that came with the head.
+    input_.erase(0, end + 4);
+    break;
+  }
+
+  const header *connection = response_.find(known_header::connection);
+  reusable_ = response_.http_version_minor >= 1 &&
+              !(connection && boost::algorithm::icontains(connection->value, "close"));
+
+  if (head_request_ || status_ == reply::no_content || status_ == reply::not_modified)
+  {
+    response_done_ = true;
+    reusable_ = reusable_ && input_.empty();
+  }
+  else
+  {
+    request_parser::result_type result = body_parser_.begin_body(response_);
+    if (result == request_parser::bad)
+    {
+      fail();
+      return;
+    }
+    if (result == request_parser::good)
+    {
+      // Without a length or chunks, the body runs until the upstream closes.
+      until_close_ = !response_.find(known_header::content_length);
+      response_done_ = !until_close_;
+      reusable_ = reusable_ && !until_close_;
+    }
+  }
+
+  // The rest of the response is read only as the client takes it.
+  head_done_ = true;
+  timer_.cancel();
+  std::string().swap(head_);
+  if (ready_)
+  {
+    deliver();
+  }
+}
+
+bool proxy::exchange::parse_header_lines(std::size_t begin, std::size_t end)
+{
+  while (begin < end)
+  {
+    std::size_t line_end = input_.find("\r\n", begin);
+    std::size_t colon = input_.find(':', begin);
+    if (colon == begin || colon >= line_end || input_[begin] == ' ' || input_[begin] == '\t')
+    {
+      return false;
+    }
+    header h{input_.substr(begin, colon - begin), input_.substr(colon + 1, line_end - colon - 1)};
+    boost::algorithm::trim(h.value);
+    response_.headers.push_back(std::move(h));
+    if (!response_.index_last_header())
+    {
+      return false;
+    }
+    begin = line_end + 2;
+  }
+  return true;
+}
+
+void proxy::exchange::get_reply(reply &rep, reply::ready_handler handler)
+{
+  reply_ = &rep;
+  ready_ = std::move(handler);
+  if (head_done_ || failed_)
+  {
+    auto self(shared_from_this());
+    boost::asio::post(proxy_.io_context_, [this, self]() {
+      deliver();
+    });
+  }
+}
+
+void proxy::exchange::deliver()
+{
+  reply::ready_handler ready = std::move(ready_);
+  ready_ = nullptr;
+  if (!ready)
+  {
+    return;
+  }
+
+  if (!head_done_)
+  {
+    *reply_ = reply::stock_reply(timed_out_ ? reply::gateway_timeout : reply::bad_gateway);
+    ready();
+    return;
+  }
+
+  reply_->status = static_cast<reply::status_type>(status_);
+  reply_->status_text = std::move(status_text_);
+  for (header &h : response_.headers)
+  {
+    if (is_hop_by_hop(h.name))
+    {
+      continue;
+    }
+    if (boost::algorithm::iequals(h.name, "Content-Length"))
+    {
+      h.name = "Content-Length";
+    }
+    reply_->headers.push_back(std::move(h));
+  }
+
+  // The reply holds on to the exchange until its body has been sent.
+  if (!response_done_)
+  {
+    std::shared_ptr<exchange> handle = handle_.lock();
+    reply_->body = [handle](boost::asio::mutable_buffer buffer, reply::body_handler handler) {
+      handle->read_body(buffer, std::move(handler));
+    };
+  }
+  else
+  {
+    release();
+  }
+  ready();
+}
+
+void proxy::exchange::read_body(boost::asio::mutable_buffer buffer, reply::body_handler handler)
+{
+  if (response_done_ || failed_)
+  {
+    release();
+    handler(failed_ ? boost::asio::error::connection_aborted : boost::system::error_code(), 0);
+    return;
+  }
+
+  // Body data that arrived with the head is copied out once. After that the
+  // upstream's data is read straight into the client's buffer.
+  char *data = static_cast<char *>(buffer.data());
+  if (body_begin_ < input_.size())
+  {
+    std::size_t length = std::min(buffer.size(), input_.size() - body_begin_);
+    std::memcpy(data, input_.data() + body_begin_, length);
+    body_begin_ += length;
+    if (body_begin_ == input_.size())
+    {
+      std::string().swap(input_);
+      body_begin_ = 0;
+    }
+    handle_body(data, length, buffer, std::move(handler));
+    return;
+  }
+
+  arm(proxy_.response_timeout_);
+  auto self(shared_from_this());
+  socket_->async_read_some(buffer,
+  [this, self, data, buffer, handler](boost::system::error_code ec, std::size_t bytes_transferred) {
+    timer_.cancel();
+    if (ec == boost::asio::error::eof && until_close_)
+    {
+      response_done_ = true;
+      release();
+      handler(boost::system::error_code(), 0);
+      return;
+    }
+    if (ec)
+    {
+      failed_ = true;
+      release();
+      handler(ec, 0);
+      return;
+    }
+    handle_body(data, bytes_transferred, buffer, handler);
+  });
+}
+
+void proxy::exchange::handle_body(char *data, std::size_t length, boost::asio::mutable_buffer buffer,
+                                  reply::body_handler handler)
+{
+  if (until_close_)
+  {
+    handler(boost::system::error_code(), length);
+    return;
+  }
+
+  // Content is moved down over the chunk framing; content that needs no
+  // moving, which is all of it for a body with a length, is not touched.
+  char *out = data;
+  request_parser::result_type result;
+  const char *end;
+  std::tie(result, end) = body_parser_.parse_body(
+      data, data + length, [&out](const char *content, std::size_t content_length) {
+        if (content != out)
+        {
+          std::memmove(out, content, content_length);
+        }
+        out += content_length;
+      });
+  if (result == request_parser::bad)
+  {
+    failed_ = true;
+    release();
+    handler(boost::system::errc::make_error_code(boost::system::errc::protocol_error), 0);
+    return;
+  }
+  if (result == request_parser::good)
+  {
+    // Anything after the body is not a response to anything we sent.
+    response_done_ = true;
+    reusable_ = reusable_ && end == data + length && input_.empty();
+  }
+
+  std::size_t content_length = out - data;
+  if (content_length == 0 && !response_done_)
+  {
+    read_body(buffer, std::move(handler));
+    return;
+  }
+  if (content_length == 0)
+  {
+    release();
+  }
+  handler(boost::system::error_code(), content_length);
+}
+
+void proxy::exchange::fail()
+{
+  if (failed_)
+  {
+    return;
+  }
+
+  boost::system::error_code ignored_ec;
+  if (reused_ && !retried_ && !body_sent_ && !response_started_ && !timed_out_)
+  {
+    // The upstream closed the idle connection as it was being reused. None of
+    // the request has been acted on, so send it again on a new connection.
+    retried_ = true;
+    reused_ = false;
+    ++attempt_;
+    socket_->close(ignored_ec);
+    connected_ = false;
+    writing_ = false;
+    output_ = head_queued_ ? head_ : std::string();
+    input_.clear();
+    connect();
+    return;
+  }
+
+  failed_ = true;
+  release();
+  if (ready_)
+  {
+    deliver();
+  }
+  if (drained_)
+  {
+    boost::asio::post(proxy_.io_context_, std::move(drained_));
+    drained_ = nullptr;
+  }
+}
+
+void proxy::exchange::arm(std::chrono::steady_clock::duration timeout)
+{
+  timer_.expires_after(timeout);
+  auto self(shared_from_this());
+  timer_.async_wait([this, self](boost::system::error_code /*ec*/) {
+    // The deadline may have been moved, or the exchange finished, after this
+    // completion was queued.
+    if (failed_ || released_ || timer_.expiry() > std::chrono::steady_clock::now())
+    {
+      return;
+    }
+    timed_out_ = true;
+    fail();
+  });
+}
+
+void proxy::exchange::abandon()
+{
+  if (!released_)
+  {
+    failed_ = true;
+    release();
+  }
+}
+
+void proxy::exchange::stop()
+{
+  // The handlers may hold the last handles to the exchange.
+  auto self(shared_from_this());
+  failed_ = true;
+  release();
+  ready_ = nullptr;
+  drained_ = nullptr;
+}
+
+void proxy::exchange::release()
+{
+  if (released_)
+  {
+    return;
+  }
+  released_ = true;
+  --upstream_.outstanding;
+  timer_.cancel();
+
+  if (socket_ && !failed_ && reusable_ && response_done_ && request_done_ && !writing_ &&
+      output_.empty())
+  {
+    proxy_.put_idle(upstream_, std::move(socket_));
+  }
+  else if (socket_)
+  {
+    boost::system::error_code ignored_ec;
+    socket_->close(ignored_ec);
+  }
+}
+
+proxy::proxy(boost::asio::io_context &io_context, const std::vector<std::string> &upstreams,
+             std::chrono::steady_clock::duration connect_timeout,
+             std::chrono::steady_clock::duration response_timeout)
+    : io_context_(io_context), connect_timeout_(connect_timeout), response_timeout_(response_timeout),
+      upstreams_(upstreams.size()), next_(0)
+{
+  for (std::size_t i = 0; i < upstreams.size(); ++i)
+  {
+    const std::string &name = upstreams[i];
+    upstream &u = upstreams_[i];
+    u.name = name;
+    if (name.compare(0, 5, "unix:") == 0)
+    {
+      u.endpoint = boost::asio::local::stream_protocol::endpoint(name.substr(5));
+    }
+    else
+    {
+      std::size_t colon = name.rfind(':');
+      if (colon == std::string::npos)
+      {
+        throw std::runtime_error("upstream " + name + " has no port");
+      }
+      std::string host = name.substr(0, colon);
+      if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+      {
+        host = host.substr(1, host.size() - 2);
+      }
+      boost::asio::ip::tcp::resolver resolver(io_context);
+      boost::system::error_code ec;
+      auto results = resolver.resolve(host, name.substr(colon + 1), ec);
+      if (ec || results.empty())
+      {
+        throw std::runtime_error("cannot resolve upstream " + name);
+      }
+      u.endpoint = results.begin()->endpoint();
+    }
+  }
+
+  if (upstreams_.empty())
+  {
+    throw std::runtime_error("proxy has no upstreams");
+  }
+}
+
+request_handler::body_sink proxy::open_body(request &req)
+{
+  std::shared_ptr<exchange> ex = start(req);
+  req.handler_state = ex;
+
+  request_handler::body_sink sink;
+  sink.write = [ex](const char *data, std::size_t length) {
+    ex->write_body(data, length);
+  };
+  sink.wait = [ex](std::function<void()> ready) {
+    ex->wait(std::move(ready));
+  };
+  return sink;
+}
+
+void proxy::handle_request(const request &req, reply &rep)
+{
+  std::shared_ptr<exchange> ex = std::static_pointer_cast<exchange>(req.handler_state);
+  if (!ex)
+  {
+    // Without a body, the request is only sent now.
+    ex = start(req);
+    ex->write_body(nullptr, 0);
+  }
+
+  rep.deferred = [ex](reply &r, reply::ready_handler handler) {
+    ex->get_reply(r, [ex, handler]() {
+      handler();
+    });
+  };
+}
+
+void proxy::write_metrics(std::ostream &os) const
+{
+  for (const upstream &u : upstreams_)
+  {
+    os << "http_upstream_connections{upstream=\"" << u.name << "\",state=\"busy\"} "
+       << u.outstanding << "\n";
+    os << "http_upstream_connections{upstream=\"" << u.name << "\",state=\"idle\"} "
+       << u.idle.size() << "\n";
+  }
+}
+
+void proxy::stop()
+{
+  // Stopping an exchange may destroy it, and so remove it from the set.
+  std::vector<exchange *> live(exchanges_.begin(), exchanges_.end());
+  for (exchange *ex : live)
+  {
+    ex->stop();
+  }
+  for (upstream &u : upstreams_)
+  {
+    u.idle.clear();
+  }
+}
+
+std::shared_ptr<proxy::exchange> proxy::start(const request &req)
+{
+  // Least outstanding requests, with ties going to each upstream in turn.
+  std::size_t best = next_ % upstreams_.size();
+  for (std::size_t i = 1; i < upstreams_.size(); ++i)
+  {
+    std::size_t k = (next_ + i) % upstreams_.size();
+    if (upstreams_[k].outstanding < upstreams_[best].outstanding)
+    {
+      best = k;
+    }
+  }
+  next_ = best + 1;
+
+  // The handle given out shares ownership of the exchange, and abandons it
+  // once the request handler lets go of it.
+  auto ex = std::make_shared<exchange>(*this, upstreams_[best], req);
+  std::shared_ptr<exchange> handle(ex.get(), [ex](exchange *) {
+    ex->abandon();
+  });
+  ex->start(handle);
+  return handle;
+}
+
+std::unique_ptr<proxy::socket_type> proxy::take_idle(upstream &u)
+{
+  while (!u.idle.empty())
+  {
+    std::unique_ptr<socket_type> socket = std::move(u.idle.back());
+    u.idle.pop_back();
+
+    // An upstream may close an idle connection at any time. There should be
+    // nothing to read from one still open, so check without waiting.
+    char byte;
+    ssize_t n = ::recv(socket->native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return socket;
+    }
+  }
+  return nullptr;
+}
+
+void proxy::put_idle(upstream &u, std::unique_ptr<socket_type> socket)
+{
+  if (u.idle.size() < max_idle)
+  {
+    u.idle.push_back(std::move(socket));
+  }
+}
+
+} // namespace server
+} // namespace http
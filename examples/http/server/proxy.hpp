@@ -0,0 +1,108 @@
+#ifndef HTTP_PROXY_HPP
+#define HTTP_PROXY_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <boost/asio.hpp>
+#include "request_handler.hpp"
+
+namespace http
+{
+namespace server
+{
+
+struct reply;
+struct request;
+
+// Relays requests to a group of upstream servers, reached over TCP or a Unix
+// domain socket. Connections to each upstream are kept open between requests
+// and reused, and each request goes to the upstream with the fewest requests
+// in flight. Request and reply bodies are relayed piece by piece as they
+// arrive, so neither is ever held whole in memory. An upstream that takes too
+// long to accept a connection is answered for with 504 Gateway Timeout, as is
+// one that goes too long without sending any of its response.
+class proxy
+{
+public:
+  proxy(const proxy &) = delete;
+  proxy &operator=(const proxy &) = delete;
+
+  // Construct for upstreams given as "host:port" or "unix:/path". Throws
+  // std::runtime_error if an upstream cannot be resolved.
+  proxy(boost::asio::io_context &io_context, const std::vector<std::string> &upstreams,
+        std::chrono::steady_clock::duration connect_timeout,
+        std::chrono::steady_clock::duration response_timeout);
+
+  // Start relaying a request whose body is about to arrive, and return the
+  // sink that passes the body on.
+  request_handler::body_sink open_body(request &req);
+
+  // Relay a request, deferring the reply until the upstream responds. The
+  // request is sent unchanged apart from its hop-by-hop headers.
+  void handle_request(const request &req, reply &rep);
+
+  // Write the number of requests in flight and idle connections for each
+  // upstream in the Prometheus text format.
+  void write_metrics(std::ostream &os) const;
+
+  // Abandon every exchange still in flight and close the idle connections,
+  // as the server is stopping.
+  void stop();
+
+private:
+  typedef boost::asio::generic::stream_protocol::socket socket_type;
+
+  struct upstream
+  {
+    // The upstream as it was configured.
+    std::string name;
+
+    boost::asio::generic::stream_protocol::endpoint endpoint;
+
+    // The number of requests sent to the upstream and not yet answered.
+    std::size_t outstanding = 0;
+
+    // Connections left open by earlier requests, most recently used last.
+    std::vector<std::unique_ptr<socket_type>> idle;
+  };
+
+  class exchange;
+
+  // Start an exchange with the least busy upstream.
+  std::shared_ptr<exchange> start(const request &req);
+
+  // Take an idle connection to an upstream that is still open, or null.
+  std::unique_ptr<socket_type> take_idle(upstream &u);
+
+  // Keep a connection for a later request.
+  void put_idle(upstream &u, std::unique_ptr<socket_type> socket);
+
+  // The most idle connections kept for each upstream.
+  static const std::size_t max_idle = 64;
+
+  boost::asio::io_context &io_context_;
+
+  // The longest wait for a connection to an upstream, and for each part of
+  // its response.
+  std::chrono::steady_clock::duration connect_timeout_;
+  std::chrono::steady_clock::duration response_timeout_;
+
+  std::vector<upstream> upstreams_;
+
+  // The exchanges in flight.
+  std::unordered_set<exchange *> exchanges_;
+
+  // Where the search for the least busy upstream starts, so that ties are
+  // shared out in turn.
+  std::size_t next_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_PROXY_HPP
@@ -0,0 +1,123 @@
+#include "rate_limiter.hpp"
+#include <time.h>
+#include <algorithm>
+#include <cstring>
+
+namespace http
+{
+namespace server
+{
+
+namespace
+{
+
+// The current time in nanoseconds. Millisecond resolution is plenty for
+// rates a client is limited to, and the coarse clock costs a fraction of the
+// precise one.
+std::int64_t now_ns()
+{
+#if defined(CLOCK_MONOTONIC_COARSE)
+  timespec ts;
+  ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return std::int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+} // namespace
+
+rate_limiter::rate_limiter(double rate, double burst, std::size_t capacity)
+    : mask_(0), interval_(0), burst_window_(0), refused_(0)
+{
+  if (rate <= 0)
+  {
+    return;
+  }
+
+  std::size_t size = probe_length;
+  while (size < capacity)
+  {
+    size *= 2;
+  }
+  slots_.assign(size, slot());
+  mask_ = size - 1;
+  interval_ = static_cast<std::int64_t>(1e9 / rate);
+  burst_window_ = static_cast<std::int64_t>(std::max(burst - 1, 0.0) * interval_);
+}
+
+bool rate_limiter::enabled() const
+{
+  return interval_ != 0;
+}
+
+bool rate_limiter::allow(const boost::asio::ip::address &client)
+{
+  if (interval_ == 0)
+  {
+    return true;
+  }
+
+  // IPv4 addresses are keyed in their IPv4-mapped IPv6 form, so that a
+  // client has one bucket whichever family the listener accepted it on.
+  boost::asio::ip::address_v6 v6 = client.is_v4()
+                                       ? boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, client.to_v4())
+                                       : client.to_v6();
+  boost::asio::ip::address_v6::bytes_type bytes = v6.to_bytes();
+  std::uint64_t key_high;
+  std::uint64_t key_low;
+  std::memcpy(&key_high, bytes.data(), 8);
+  std::memcpy(&key_low, bytes.data() + 8, 8);
+
+  std::uint64_t hash = (key_high ^ (key_low * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+  std::size_t start = static_cast<std::size_t>(hash >> 32);
+
+  std::int64_t now = now_ns();
+
+  // Find the client's slot, or else the one idle for longest. An empty slot
+  // or one whose bucket has refilled holds no information and is reused
+  // first.
+  slot *victim = nullptr;
+  slot *s = nullptr;
+  for (std::size_t i = 0; i < probe_length; ++i)
+  {
+    slot &candidate = slots_[(start + i) & mask_];
+    if (candidate.full_at != 0 && candidate.key_high == key_high && candidate.key_low == key_low)
+    {
+      s = &candidate;
+      break;
+    }
+    if (!victim || candidate.full_at < victim->full_at)
+    {
+      victim = &candidate;
+    }
+  }
+  if (!s)
+  {
+    s = victim;
+    s->key_high = key_high;
+    s->key_low = key_low;
+    s->full_at = now;
+  }
+
+  // A token is available unless taking it would push the refill time more
+  // than the burst window into the future.
+  std::int64_t full_at = std::max(s->full_at, now);
+  if (full_at - now > burst_window_)
+  {
+    ++refused_;
+    return false;
+  }
+  s->full_at = full_at + interval_;
+  return true;
+}
+
+std::size_t rate_limiter::refused() const
+{
+  return refused_;
+}
+
+} // namespace server
+} // namespace http
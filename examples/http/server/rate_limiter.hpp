@@ -0,0 +1,68 @@
+#ifndef HTTP_RATE_LIMITER_HPP
+#define HTTP_RATE_LIMITER_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/address_v6.hpp>
+
+namespace http
+{
+namespace server
+{
+
+// Per-client token buckets. Each client address may make rate requests per
+// second on average, in bursts of up to burst requests. Buckets are kept as
+// the generic cell rate algorithm's single timestamp in a fixed-size open
+// addressing table; when a client's probe window is full the entry idle for
+// longest is evicted, so the table never grows and a check never allocates.
+class rate_limiter
+{
+public:
+  rate_limiter(const rate_limiter &) = delete;
+  rate_limiter &operator=(const rate_limiter &) = delete;
+
+  // Construct a limiter tracking up to capacity clients, rounded up to a
+  // power of two. A rate of zero disables limiting.
+  rate_limiter(double rate, double burst, std::size_t capacity = 65536);
+
+  // Whether limiting is enabled.
+  bool enabled() const;
+
+  // Take one token from the client's bucket. Returns false if the bucket is
+  // empty and the request should be refused.
+  bool allow(const boost::asio::ip::address &client);
+
+  // The number of requests refused so far.
+  std::size_t refused() const;
+
+private:
+  struct slot
+  {
+    std::uint64_t key_high;
+    std::uint64_t key_low;
+
+    // The time, in nanoseconds on the monotonic clock, at which the bucket will
+    // be full again. Zero marks an empty slot.
+    std::int64_t full_at;
+  };
+
+  // The number of slots examined for each client.
+  static const std::size_t probe_length = 8;
+
+  std::vector<slot> slots_;
+  std::size_t mask_;
+
+  // Nanoseconds per token, and the largest credit a bucket may hold.
+  std::int64_t interval_;
+  std::int64_t burst_window_;
+
+  std::size_t refused_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_RATE_LIMITER_HPP
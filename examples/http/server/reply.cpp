@@ -1,4 +1,5 @@
 #include "reply.hpp"
+#include <algorithm>
 #include <string>
 
 namespace http
@@ -10,37 +11,43 @@ namespace status_strings
 {
 
 const std::string ok =
-    "HTTP/1.0 200 OK\r\n";
+    "200 OK\r\n";
 const std::string created =
-    "HTTP/1.0 201 Created\r\n";
+    "201 Created\r\n";
 const std::string accepted =
-    "HTTP/1.0 202 Accepted\r\n";
+    "202 Accepted\r\n";
 const std::string no_content =
-    "HTTP/1.0 204 No Content\r\n";
+    "204 No Content\r\n";
 const std::string multiple_choices =
-    "HTTP/1.0 300 Multiple Choices\r\n";
+    "300 Multiple Choices\r\n";
 const std::string moved_permanently =
-    "HTTP/1.0 301 Moved Permanently\r\n";
+    "301 Moved Permanently\r\n";
 const std::string moved_temporarily =
-    "HTTP/1.0 302 Moved Temporarily\r\n";
+    "302 Moved Temporarily\r\n";
 const std::string not_modified =
-    "HTTP/1.0 304 Not Modified\r\n";
+    "304 Not Modified\r\n";
 const std::string bad_request =
-    "HTTP/1.0 400 Bad Request\r\n";
+    "400 Bad Request\r\n";
 const std::string unauthorized =
-    "HTTP/1.0 401 Unauthorized\r\n";
+    "401 Unauthorized\r\n";
 const std::string forbidden =
-    "HTTP/1.0 403 Forbidden\r\n";
+    "403 Forbidden\r\n";
 const std::string not_found =
-    "HTTP/1.0 404 Not Found\r\n";
+    "404 Not Found\r\n";
+const std::string payload_too_large =
+    "413 Payload Too Large\r\n";
+const std::string too_many_requests =
+    "429 Too Many Requests\r\n";
 const std::string internal_server_error =
-    "HTTP/1.0 500 Internal Server Error\r\n";
+    "500 Internal Server Error\r\n";
 const std::string not_implemented =
-    "HTTP/1.0 501 Not Implemented\r\n";
+    "501 Not Implemented\r\n";
 const std::string bad_gateway =
-    "HTTP/1.0 502 Bad Gateway\r\n";
+    "502 Bad Gateway\r\n";
 const std::string service_unavailable =
-    "HTTP/1.0 503 Service Unavailable\r\n";
+    "503 Service Unavailable\r\n";
+const std::string gateway_timeout =
+    "504 Gateway Timeout\r\n";
 
 boost::asio::const_buffer to_buffer(reply::status_type status)
 {
@@ -70,6 +77,10 @@ boost::asio::const_buffer to_buffer(reply::status_type status)
     return boost::asio::buffer(forbidden);
   case reply::not_found:
     return boost::asio::buffer(not_found);
+  case reply::payload_too_large:
+    return boost::asio::buffer(payload_too_large);
+  case reply::too_many_requests:
+    return boost::asio::buffer(too_many_requests);
   case reply::internal_server_error:
     return boost::asio::buffer(internal_server_error);
   case reply::not_implemented:
@@ -78,6 +89,8 @@ boost::asio::const_buffer to_buffer(reply::status_type status)
     return boost::asio::buffer(bad_gateway);
   case reply::service_unavailable:
     return boost::asio::buffer(service_unavailable);
+  case reply::gateway_timeout:
+    return boost::asio::buffer(gateway_timeout);
   default:
     return boost::asio::buffer(internal_server_error);
   }
@@ -88,6 +101,8 @@ boost::asio::const_buffer to_buffer(reply::status_type status)
 namespace misc_strings
 {
 
+const char http_1_0[] = {'H', 'T', 'T', 'P', '/', '1', '.', '0', ' '};
+const char http_1_1[] = {'H', 'T', 'T', 'P', '/', '1', '.', '1', ' '};
 const char name_value_separator[] = {':', ' '};
 const char crlf[] = {'\r', '\n'};
 
@@ -96,7 +111,22 @@ const char crlf[] = {'\r', '\n'};
 std::vector<boost::asio::const_buffer> reply::to_buffers()
 {
   std::vector<boost::asio::const_buffer> buffers;
-  buffers.push_back(status_strings::to_buffer(status));
+  if (http_version_minor == 0)
+  {
+    buffers.push_back(boost::asio::buffer(misc_strings::http_1_0));
+  }
+  else
+  {
+    buffers.push_back(boost::asio::buffer(misc_strings::http_1_1));
+  }
+  if (status_text.empty())
+  {
+    buffers.push_back(status_strings::to_buffer(status));
+  }
+  else
+  {
+    buffers.push_back(boost::asio::buffer(status_text));
+  }
   for (std::size_t i = 0; i < headers.size(); ++i)
   {
     header &h = headers[i];
@@ -105,11 +135,73 @@ std::vector<boost::asio::const_buffer> reply::to_buffers()
     buffers.push_back(boost::asio::buffer(h.value));
     buffers.push_back(boost::asio::buffer(misc_strings::crlf));
   }
+  if (raw_headers.size() > 0)
+  {
+    buffers.push_back(raw_headers);
+  }
   buffers.push_back(boost::asio::buffer(misc_strings::crlf));
-  buffers.push_back(boost::asio::buffer(content));
+  if (!body)
+  {
+    buffers.push_back(content_buffer());
+  }
   return buffers;
 }
 
+bool reply::has_header(const std::string &name) const
+{
+  for (const header &h : headers)
+  {
+    if (h.name == name)
+    {
+      return true;
+    }
+  }
+
+  const char *begin = static_cast<const char *>(raw_headers.data());
+  const char *end = begin + raw_headers.size();
+  while (begin != end)
+  {
+    const char *line_end = std::search(begin, end, "\r\n", "\r\n" + 2);
+    if (static_cast<std::size_t>(line_end - begin) > name.size() && begin[name.size()] == ':' &&
+        std::equal(name.begin(), name.end(), begin))
+    {
+      return true;
+    }
+    begin = line_end == end ? end : line_end + 2;
+  }
+  return false;
+}
+
+void reply::parse_raw_headers(std::vector<header> &out) const
+{
+  const char *begin = static_cast<const char *>(raw_headers.data());
+  const char *end = begin + raw_headers.size();
+  while (begin != end)
+  {
+    const char *line_end = std::search(begin, end, "\r\n", "\r\n" + 2);
+    const char *colon = std::find(begin, line_end, ':');
+    if (colon != line_end)
+    {
+      const char *value = colon + 1;
+      while (value != line_end && *value == ' ')
+      {
+        ++value;
+      }
+      out.push_back(header{std::string(begin, colon), std::string(value, line_end)});
+    }
+    begin = line_end == end ? end : line_end + 2;
+  }
+}
+
+boost::asio::const_buffer reply::content_buffer() const
+{
+  if (shared_content_owner)
+  {
+    return shared_content;
+  }
+  return boost::asio::buffer(content);
+}
+
 namespace stock_replies
 {
 
@@ -169,6 +261,16 @@ const char not_found[] =
     "<head><title>Not Found</title></head>"
     "<body><h1>404 Not Found</h1></body>"
     "</html>";
+const char payload_too_large[] =
+    "<html>"
+    "<head><title>Payload Too Large</title></head>"
+    "<body><h1>413 Payload Too Large</h1></body>"
+    "</html>";
+const char too_many_requests[] =
+    "<html>"
+    "<head><title>Too Many Requests</title></head>"
+    "<body><h1>429 Too Many Requests</h1></body>"
+    "</html>";
 const char internal_server_error[] =
     "<html>"
     "<head><title>Internal Server Error</title></head>"
@@ -189,6 +291,11 @@ const char service_unavailable[] =
     "<head><title>Service Unavailable</title></head>"
     "<body><h1>503 Service Unavailable</h1></body>"
     "</html>";
+const char gateway_timeout[] =
+    "<html>"
+    "<head><title>Gateway Timeout</title></head>"
+    "<body><h1>504 Gateway Timeout</h1></body>"
+    "</html>";
 
 std::string to_string(reply::status_type status)
 {
@@ -218,6 +325,10 @@ std::string to_string(reply::status_type status)
     return forbidden;
   case reply::not_found:
     return not_found;
+  case reply::payload_too_large:
+    return payload_too_large;
+  case reply::too_many_requests:
+    return too_many_requests;
   case reply::internal_server_error:
     return internal_server_error;
   case reply::not_implemented:
@@ -226,6 +337,8 @@ std::string to_string(reply::status_type status)
     return bad_gateway;
   case reply::service_unavailable:
     return service_unavailable;
+  case reply::gateway_timeout:
+    return gateway_timeout;
   default:
     return internal_server_error;
   }
@@ -1,6 +1,8 @@
 #ifndef HTTP_REPLY_HPP
 #define HTTP_REPLY_HPP
 
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 #include <boost/asio.hpp>
@@ -15,7 +17,7 @@ namespace server
 struct reply
 {
   /// The status of the reply.
-  enum status_type
+  enum status_type : int
   {
     ok = 200,
     created = 201,
@@ -29,21 +31,73 @@ struct reply
     unauthorized = 401,
     forbidden = 403,
     not_found = 404,
+    payload_too_large = 413,
+    too_many_requests = 429,
     internal_server_error = 500,
     not_implemented = 501,
     bad_gateway = 502,
-    service_unavailable = 503
+    service_unavailable = 503,
+    gateway_timeout = 504
   } status;
 
+  // The status line for a status without stock text, such as one relayed
+  // from an upstream server, e.g. "418 I'm a teapot\r\n".
+  std::string status_text;
+
   // The headers to be included in the reply.
   std::vector<header> headers;
 
+  // A block of pre-rendered "Name: value\r\n" lines sent after headers, such
+  // as one stored in an archive. Like shared_content it is sent without being
+  // copied, and shared_content_owner keeps it alive.
+  boost::asio::const_buffer raw_headers;
+
+  // Whether the reply has a header of the given name, in headers or in
+  // raw_headers.
+  bool has_header(const std::string &name) const;
+
+  // Append the headers in raw_headers, for a protocol that cannot send the
+  // block as it is.
+  void parse_raw_headers(std::vector<header> &out) const;
+
   // The content to be sent in the reply.
   std::string content;
 
+  // Content held elsewhere, such as a mapped file, sent in place of content
+  // without being copied. The owner keeps the memory alive until the reply
+  // has been written.
+  boost::asio::const_buffer shared_content;
+  std::shared_ptr<const void> shared_content_owner;
+
+  // The content to be sent, whichever member holds it.
+  boost::asio::const_buffer content_buffer() const;
+
+  // Produces the content of a streamed reply piece by piece. It is called with
+  // a buffer to fill once the previous piece has been written, and must call
+  // the handler with the number of bytes it filled in, or 0 once the content
+  // is complete. Replies without a Content-Length header are sent with chunked
+  // transfer encoding to HTTP/1.1 clients and end the connection otherwise.
+  typedef std::function<void(boost::system::error_code, std::size_t)> body_handler;
+  typedef std::function<void(boost::asio::mutable_buffer, body_handler)> body_source;
+  body_source body;
+
+  // Completes a reply whose status and headers are not known when the
+  // request handler returns, such as one relayed from an upstream server. It
+  // is called with the reply once the request has been received, and must
+  // fill it in and then call the handler. It never calls the handler before
+  // returning.
+  typedef std::function<void()> ready_handler;
+  typedef std::function<void(reply &rep, ready_handler handler)> deferred_source;
+  deferred_source deferred;
+
+  // The minor version of the status line, 0 unless a feature of HTTP/1.1 is
+  // used in the reply.
+  int http_version_minor = 0;
+
   // Convert the reply into a vector of buffers. The buffers do not own the
   // underlying memory blocks, therefore the reply object must remain valid and
-  // not be changed until the write operation has completed.
+  // not be changed until the write operation has completed. The content of a
+  // streamed reply is not included.
   std::vector<boost::asio::const_buffer> to_buffers();
 
   // Get a stock reply.
@@ -1,9 +1,14 @@
 #ifndef HTTP_REQUEST_HPP
 #define HTTP_REQUEST_HPP
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 #include "header.hpp"
+#include "known_header.hpp"
 
 namespace http
 {
@@ -18,9 +23,45 @@ struct request
   int http_version_major;
   int http_version_minor;
   std::vector<header> headers;
+
+  // The position in headers of each known header plus one, or 0 if the
+  // request does not carry it. Where a header is repeated, the first one.
+  std::array<std::uint32_t, known_header::count> known_headers = {};
+
+  // The number of body bytes received.
+  std::size_t body_length = 0;
+
+  // State kept by the request handler from the time the body starts to
+  // arrive until the request is handled, such as an exchange with an
+  // upstream server the body is relayed to.
+  std::shared_ptr<void> handler_state;
+
+  // Find a known header, or null if the request does not carry it.
+  const header *find(known_header::id h) const
+  {
+    return known_headers[h] ? &headers[known_headers[h] - 1] : nullptr;
+  }
+
+  // Identify the name of the last header added. Returns false if it repeats a
+  // header that may appear only once.
+  bool index_last_header()
+  {
+    const std::string &name = headers.back().name;
+    known_header::id h = known_header::classify(name.data(), name.size());
+    if (h == known_header::unknown)
+    {
+      return true;
+    }
+    if (known_headers[h])
+    {
+      return !known_header::is_singleton(h);
+    }
+    known_headers[h] = static_cast<std::uint32_t>(headers.size());
+    return true;
+  }
 };
 
 } // namespace server
 } // namespace http
 
-#endif // HTTP_REQUEST_HPP
\ No newline at end of file
+#endif // HTTP_REQUEST_HPP
@@ -1,8 +1,21 @@
 #include "request_handler.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/trim.hpp>
 #include "mime_types.hpp"
+#include "proxy.hpp"
+#include "rate_limiter.hpp"
 #include "reply.hpp"
 #include "request.hpp"
 
@@ -11,25 +24,361 @@ namespace http
 namespace server
 {
 
-request_handler::request_handler(const std::string &doc_root)
-    : doc_root_(doc_root)
+namespace
 {
+
+// Whether the client accepts gzip content encoding: it names gzip, or else
+// "*", with a q-value above 0.
+bool accepts_gzip(const request &req)
+{
+  const header *h = req.find(known_header::accept_encoding);
+  if (!h)
+  {
+    return false;
+  }
+
+  std::vector<std::string> codings;
+  boost::algorithm::split(codings, h->value, [](char c) { return c == ','; });
+  int gzip = -1;
+  int any = -1;
+  for (std::string &coding : codings)
+  {
+    std::vector<std::string> params;
+    boost::algorithm::split(params, coding, [](char c) { return c == ';'; });
+    std::string name = boost::algorithm::trim_copy(params[0]);
+    bool accepted = true;
+    for (std::size_t i = 1; i < params.size(); ++i)
+    {
+      boost::algorithm::trim(params[i]);
+      if (params[i].size() > 2 && (params[i][0] == 'q' || params[i][0] == 'Q') && params[i][1] == '=')
+      {
+        accepted = std::strtod(params[i].c_str() + 2, nullptr) > 0;
+      }
+    }
+    if (boost::algorithm::iequals(name, "gzip") || boost::algorithm::iequals(name, "x-gzip"))
+    {
+      gzip = accepted;
+    }
+    else if (name == "*")
+    {
+      any = accepted;
+    }
+  }
+  return gzip >= 0 ? gzip == 1 : any == 1;
+}
+
+// Whether the client's cached copy, named in If-None-Match, is the current
+// version of the file with the given entity tag.
+bool is_cached(const request &req, std::string_view etag)
+{
+  const header *h = req.find(known_header::if_none_match);
+  if (!h || etag.empty())
+  {
+    return false;
+  }
+
+  std::vector<std::string> tags;
+  boost::algorithm::split(tags, h->value, [](char c) { return c == ','; });
+  for (std::string &tag : tags)
+  {
+    boost::algorithm::trim(tag);
+    if (boost::algorithm::starts_with(tag, "W/"))
+    {
+      tag.erase(0, 2);
+    }
+    if (tag == "*" || tag == etag)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Return the value of a reply header, or an empty string.
+std::string reply_header(const std::vector<header> &headers, const char *name)
+{
+  for (const header &h : headers)
+  {
+    if (h.name == name)
+    {
+      return h.value;
+    }
+  }
+  return std::string();
+}
+
+// A PUT body written into a temporary file of its own, next to the target,
+// which is only renamed into place once the whole body has arrived intact.
+// Readers never see a partial upload, and concurrent uploads to the same path
+// never mix; the last to finish wins. An upload abandoned part way through is
+// removed when it is destroyed.
+class upload
+{
+public:
+  explicit upload(const std::string &full_path)
+      : full_path_(full_path), part_path_(full_path + ".part-XXXXXX"), fd_(::mkstemp(&part_path_[0])),
+        ok_(fd_ >= 0), stored_(false)
+  {
+    if (ok_)
+    {
+      ::fchmod(fd_, 0644);
+    }
+  }
+
+  upload(const upload &) = delete;
+  upload &operator=(const upload &) = delete;
+
+  ~upload()
+  {
+    if (fd_ >= 0)
+    {
+      ::close(fd_);
+    }
+    if (ok_ && !stored_)
+    {
+      std::error_code ec;
+      std::filesystem::remove(part_path_, ec);
+    }
+  }
+
+  void write(const char *data, std::size_t length)
+  {
+    while (ok_ && length > 0)
+    {
+      ssize_t n = ::write(fd_, data, length);
+      if (n == 0 || (n < 0 && errno != EINTR))
+      {
+        ok_ = false;
+      }
+      else if (n > 0)
+      {
+        data += n;
+        length -= n;
+      }
+    }
+  }
+
+  // Move the file into place if every byte was written.
+  void finish()
+  {
+    if (fd_ >= 0 && ::close(fd_) != 0)
+    {
+      ok_ = false;
+    }
+    fd_ = -1;
+    if (ok_)
+    {
+      std::error_code ec;
+      std::filesystem::rename(part_path_, full_path_, ec);
+      stored_ = !ec;
+    }
+  }
+
+  // Whether the whole body is now in place.
+  bool stored() const
+  {
+    return stored_;
+  }
+
+private:
+  std::string full_path_;
+  std::string part_path_;
+  int fd_;
+  bool ok_;
+  bool stored_;
+};
+
+// Fill in the headers of a file read from disk: those worked out for it by
+// warm-up, ETag included, unless it has changed size since, or else just its
+// Content-Length and Content-Type.
+void file_headers(reply &rep, const file_entry *entry, std::size_t size, const std::string &extension)
+{
+  if (entry && entry->size == size)
+  {
+    rep.headers = entry->headers;
+    return;
+  }
+  rep.headers.resize(2);
+  rep.headers[0].name = "Content-Length";
+  rep.headers[0].value = std::to_string(size);
+  rep.headers[1].name = "Content-Type";
+  rep.headers[1].value = mime_types::extension_to_type(extension);
+}
+
+// Fill in a 304 reply telling the client to use its cached copy.
+void not_modified(reply &rep, std::string_view etag)
+{
+  rep.status = reply::not_modified;
+  rep.headers.clear();
+  rep.headers.push_back(header{"ETag", std::string(etag)});
+}
+
+} // namespace
+
+request_handler::request_handler(const std::string &doc_root,
+                                 const std::string &upload_dir,
+                                 bool map_files)
+    : doc_root_(doc_root), upload_dir_(upload_dir), map_files_(map_files), status_counts_(),
+      start_time_(std::chrono::steady_clock::now())
+{
+}
+
+void request_handler::warm_up(std::size_t threads, std::size_t preload_budget)
+{
+  file_cache_.warm_up(doc_root_, threads, preload_budget);
+}
+
+void request_handler::load_archive(const std::string &path)
+{
+  archive_ = std::make_shared<const archive>(path);
+}
+
+request_handler::body_sink request_handler::open_body(request &req)
+{
+  if (proxy *p = find_proxy(req.uri))
+  {
+    return p->open_body(req);
+  }
+
+  std::string request_path;
+  if (req.method != "PUT" || upload_dir_.empty() || !decode_path(req.uri, request_path))
+  {
+    return body_sink();
+  }
+
+  // The upload is kept with the request, for handle_upload to learn whether
+  // it was stored.
+  auto up = std::make_shared<upload>(upload_dir_ + request_path);
+  req.handler_state = up;
+  body_sink sink;
+  sink.write = [up](const char *data, std::size_t length) {
+    if (length > 0)
+    {
+      up->write(data, length);
+      return;
+    }
+    up->finish();
+  };
+  return sink;
 }
 
 void request_handler::handle_request(const request &req, reply &rep)
+{
+  if (proxy *p = find_proxy(req.uri))
+  {
+    p->handle_request(req, rep);
+  }
+  else if (!router_.dispatch(req, rep))
+  {
+    handle_file(req, rep);
+  }
+
+  if (rep.deferred)
+  {
+    // Count a relayed reply once its status is known.
+    reply::deferred_source deferred = std::move(rep.deferred);
+    rep.deferred = [this, deferred](reply &r, reply::ready_handler handler) {
+      deferred(r, [this, &r, handler]() {
+        count_reply(r);
+        handler();
+      });
+    };
+    return;
+  }
+  count_reply(rep);
+}
+
+void request_handler::count_reply(const reply &rep)
+{
+  std::size_t status_class = rep.status / 100;
+  if (status_class < status_counts_.size())
+  {
+    ++status_counts_[status_class];
+  }
+}
+
+router &request_handler::routes()
+{
+  return router_;
+}
+
+void request_handler::add_status_routes(const std::string &prefix, const rate_limiter &limiter)
+{
+  router_.add("GET", prefix + "/health", [](const request &, const route_params &, reply &rep) {
+    rep.status = reply::ok;
+    rep.content = "ok\n";
+    rep.headers.push_back(header{"Content-Length", std::to_string(rep.content.size())});
+    rep.headers.push_back(header{"Content-Type", "text/plain"});
+  });
+
+  // Counters in the Prometheus text format.
+  router_.add("GET", prefix + "/metrics", [this, &limiter](const request &, const route_params &, reply &rep) {
+    std::ostringstream os;
+    os << "# TYPE http_replies_total counter\n";
+    for (std::size_t i = 1; i < status_counts_.size(); ++i)
+    {
+      os << "http_replies_total{code=\"" << i << "xx\"} " << status_counts_[i] << "\n";
+    }
+    os << "# TYPE http_uptime_seconds gauge\n";
+    os << "http_uptime_seconds "
+       << std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time_).count() << "\n";
+    os << "# TYPE http_archive_files gauge\n";
+    os << "http_archive_files " << (archive_ ? archive_->size() : 0) << "\n";
+    if (limiter.enabled())
+    {
+      os << "# TYPE http_rate_limited_total counter\n";
+      os << "http_rate_limited_total " << limiter.refused() << "\n";
+    }
+    if (!proxies_.empty())
+    {
+      os << "# TYPE http_upstream_connections gauge\n";
+    }
+    for (const auto &entry : proxies_)
+    {
+      entry.second->write_metrics(os);
+    }
+
+    rep.status = reply::ok;
+    rep.content = os.str();
+    rep.headers.push_back(header{"Content-Length", std::to_string(rep.content.size())});
+    rep.headers.push_back(header{"Content-Type", "text/plain; version=0.0.4"});
+  });
+}
+
+void request_handler::add_proxy(const std::string &prefix, std::shared_ptr<proxy> p)
+{
+  proxies_.emplace_back(prefix, std::move(p));
+}
+
+proxy *request_handler::find_proxy(const std::string &uri) const
+{
+  // A prefix matches whole path segments, so "/api" does not take "/apiary".
+  for (const auto &entry : proxies_)
+  {
+    const std::string &prefix = entry.first;
+    if (uri.compare(0, prefix.size(), prefix) == 0 &&
+        (uri.size() == prefix.size() || prefix.back() == '/' || uri[prefix.size()] == '/' ||
+         uri[prefix.size()] == '?'))
+    {
+      return entry.second.get();
+    }
+  }
+  return nullptr;
+}
+
+void request_handler::handle_file(const request &req, reply &rep)
 {
   // Decode url to path.
   std::string request_path;
-  if (!url_decode(req.uri, request_path))
+  if (!decode_path(req.uri, request_path))
   {
     rep = reply::stock_reply(reply::bad_request);
     return;
   }
 
-  // Request path must be absolute and not contain "..".
-  if (request_path.empty() || request_path[0] != '/' || request_path.find("..") != std::string::npos)
+  if (req.method == "PUT")
   {
-    rep = reply::stock_reply(reply::bad_request);
+    handle_upload(req, request_path, rep);
     return;
   }
 
@@ -39,6 +388,48 @@ void request_handler::handle_request(const request &req, reply &rep)
     request_path += "index.html";
   }
 
+  // An archive replaces doc_root entirely, so the filesystem is never touched.
+  if (archive_)
+  {
+    archive::file f;
+    if (!archive_->find(request_path, accepts_gzip(req), f))
+    {
+      rep = reply::stock_reply(reply::not_found);
+      return;
+    }
+    if (is_cached(req, f.etag))
+    {
+      not_modified(rep, f.etag);
+      return;
+    }
+    rep.status = reply::ok;
+    rep.raw_headers = boost::asio::buffer(f.headers.data(), f.headers.size());
+    rep.shared_content = boost::asio::buffer(f.data, f.size);
+    rep.shared_content_owner = archive_;
+    return;
+  }
+
+  // Serve from the warm-up cache when possible. A file that did not fit in
+  // the preload budget is read from disk, but keeps its ETag.
+  const file_entry *entry = file_cache_.find(request_path);
+  if (entry)
+  {
+    std::string etag = reply_header(entry->headers, "ETag");
+    if (is_cached(req, etag))
+    {
+      not_modified(rep, etag);
+      return;
+    }
+    if (entry->content)
+    {
+      rep.status = reply::ok;
+      rep.shared_content = boost::asio::buffer(*entry->content);
+      rep.shared_content_owner = entry->content;
+      rep.headers = entry->headers;
+      return;
+    }
+  }
+
   // Determine the file extension.
   std::size_t last_slash_pos = request_path.find_last_of("/");
   std::size_t last_dot_pos = request_path.find_last_of(".");
@@ -50,25 +441,103 @@ void request_handler::handle_request(const request &req, reply &rep)
 
   // Open the file to send back.
   std::string full_path = doc_root_ + request_path;
-  std::ifstream is(full_path.c_str(), std::ios::in | std::ios::binary);
-  if (!is)
+  if (map_files_)
+  {
+    if (std::shared_ptr<const mapped_file> file = mapped_files_.open(full_path))
+    {
+      rep.status = reply::ok;
+      file_headers(rep, entry, file->size(), extension);
+      rep.shared_content = boost::asio::buffer(file->data(), file->size());
+      rep.shared_content_owner = file;
+      return;
+    }
+  }
+  std::error_code ec;
+  if (!std::filesystem::is_regular_file(full_path, ec))
+  {
+    rep = reply::stock_reply(reply::not_found);
+    return;
+  }
+  auto is = std::make_shared<std::ifstream>(full_path.c_str(), std::ios::in | std::ios::binary);
+  std::streamoff end = -1;
+  if (*is && is->seekg(0, std::ios::end))
+  {
+    end = is->tellg();
+  }
+  if (end < 0 || !is->seekg(0, std::ios::beg))
   {
     rep = reply::stock_reply(reply::not_found);
     return;
   }
+  std::size_t size = static_cast<std::size_t>(end);
 
   // Fill out the reply to be sent to the client.
   rep.status = reply::ok;
+  file_headers(rep, entry, size, extension);
+
+  // Large files are read from disk as the client consumes them, so that
+  // neither the first byte nor memory use waits on the whole file.
+  if (size > stream_threshold)
+  {
+    rep.body = [is, size](boost::asio::mutable_buffer buffer, reply::body_handler handler) mutable {
+      if (size == 0)
+      {
+        handler(boost::system::error_code(), 0);
+        return;
+      }
+      std::size_t length = std::min(buffer.size(), size);
+      if (!is->read(static_cast<char *>(buffer.data()), length))
+      {
+        // The file was truncated after the headers went out.
+        handler(boost::system::errc::make_error_code(boost::system::errc::io_error), 0);
+        return;
+      }
+      size -= length;
+      handler(boost::system::error_code(), length);
+    };
+    return;
+  }
+
   char buf[512];
-  while (is.read(buf, sizeof(buf)).gcount() > 0)
+  while (is->read(buf, sizeof(buf)).gcount() > 0)
+  {
+    rep.content.append(buf, is->gcount());
+  }
+}
+
+void request_handler::handle_upload(const request &req, const std::string &request_path, reply &rep)
+{
+  if (upload_dir_.empty())
+  {
+    rep = reply::stock_reply(reply::not_implemented);
+    return;
+  }
+
+  // A request without a body never opened a sink, and stores an empty file.
+  std::shared_ptr<upload> up = std::static_pointer_cast<upload>(req.handler_state);
+  if (!up)
+  {
+    up = std::make_shared<upload>(upload_dir_ + request_path);
+    up->finish();
+  }
+  if (!up->stored())
+  {
+    rep = reply::stock_reply(reply::internal_server_error);
+    return;
+  }
+
+  rep = reply::stock_reply(reply::created);
+}
+
+bool request_handler::decode_path(const std::string &uri, std::string &path)
+{
+  if (!url_decode(uri, path))
   {
-    rep.content.append(buf, is.gcount());
-    rep.headers.resize(2);
-    rep.headers[0].name = "Content-Length";
-    rep.headers[0].value = std::to_string(rep.content.size());
-    rep.headers[1].name = "Content-Type";
-    rep.headers[1].value = mime_types::extension_to_type(extension);
+    return false;
   }
+
+  // Request path must be absolute and not contain "..".
+  return !path.empty() && path[0] == '/' && path.find("..") == std::string::npos;
 }
 
 bool request_handler::url_decode(const std::string &in, std::string &out)
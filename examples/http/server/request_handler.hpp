@@ -1,12 +1,25 @@
 #ifndef HTTP_REQUEST_HANDLER_HPP
 #define HTTP_REQUEST_HANDLER_HPP
 
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
+#include "archive.hpp"
+#include "file_cache.hpp"
+#include "mapped_file.hpp"
+#include "router.hpp"
+
 namespace http
 {
 namespace server
 {
 
+class proxy;
+class rate_limiter;
 struct reply;
 struct request;
 
@@ -16,16 +29,110 @@ public:
   request_handler(const request_handler &) = delete;
   request_handler &operator=(const request_handler &) = delete;
 
-  // Construct with a directory containing files to be served.
-  explicit request_handler(const std::string &doc_root);
+  // Construct with a directory containing files to be served, and optionally
+  // a directory in which PUT requests store their bodies. If map_files is set
+  // files are served from shared memory mappings instead of being read.
+  explicit request_handler(const std::string &doc_root,
+                           const std::string &upload_dir = std::string(),
+                           bool map_files = false);
+
+  // Resolve and preload the files under doc_root before serving them.
+  void warm_up(std::size_t threads, std::size_t preload_budget);
+
+  // Serve files from a packed archive instead of doc_root. Replies already in
+  // flight keep the previous archive until they finish. Throws
+  // std::runtime_error if the archive is not valid.
+  void load_archive(const std::string &path);
+
+  // Receives the body of a request piece by piece as it arrives.
+  struct body_sink
+  {
+    // Called with each piece of the body, and with no data at its end.
+    std::function<void(const char *data, std::size_t length)> write;
+
+    // If set, called after pieces have been written with a handler to call
+    // once the sink is ready for more, so that a sink relaying the body
+    // elsewhere can slow down the client. No more of the body is read until
+    // then. The handler is never called before wait returns.
+    std::function<void(std::function<void()> ready)> wait;
+
+    explicit operator bool() const
+    {
+      return static_cast<bool>(write);
+    }
+  };
+
+  // Return the sink for the body of a request, called before any of the body
+  // is read. An empty sink discards the body.
+  body_sink open_body(request &req);
 
-  // Handle a request and produce a reply.
+  // Handle a request and produce a reply. For a request with a body this is
+  // called once the whole body has been passed to its sink. Requests for a
+  // proxied path are relayed upstream, those matching a route go to its
+  // handler, and all others to the files under doc_root.
   void handle_request(const request &req, reply &rep);
 
+  // The dynamic routes served in front of the files.
+  router &routes();
+
+  // Add health and metrics routes under the given path prefix. The metrics
+  // include the requests the limiter has refused, if it is enabled.
+  void add_status_routes(const std::string &prefix, const rate_limiter &limiter);
+
+  // Relay requests for paths under the given prefix to a proxy's upstream
+  // servers, ahead of the routes and files.
+  void add_proxy(const std::string &prefix, std::shared_ptr<proxy> p);
+
 private:
+  // Count a reply in the metrics by its status.
+  void count_reply(const reply &rep);
+
+  // Find the proxy relaying requests for a URI, if any.
+  proxy *find_proxy(const std::string &uri) const;
+
+  // Serve a request from the files under doc_root, or the archive.
+  void handle_file(const request &req, reply &rep);
+
+  // Files larger than this are streamed instead of read into the reply.
+  static const std::size_t stream_threshold = 64 * 1024;
+
   // The directory containing the files to be served.
   std::string doc_root_;
 
+  // The directory in which uploaded files are stored, empty if disabled.
+  std::string upload_dir_;
+
+  // Files resolved during warm-up.
+  file_cache file_cache_;
+
+  // The archive files are served from, if any.
+  std::shared_ptr<const archive> archive_;
+
+  // Whether files are served from memory mappings.
+  bool map_files_;
+
+  // The mappings shared by the replies in flight.
+  mapped_files mapped_files_;
+
+  // The dynamic routes.
+  router router_;
+
+  // The proxies, by path prefix.
+  std::vector<std::pair<std::string, std::shared_ptr<proxy>>> proxies_;
+
+  // The number of replies sent, by the hundreds digit of their status.
+  std::array<std::size_t, 6> status_counts_;
+
+  // When the handler was created.
+  std::chrono::steady_clock::time_point start_time_;
+
+  // Store an uploaded file once its body has been received.
+  void handle_upload(const request &req, const std::string &request_path, reply &rep);
+
+  // Decode a request URI into an absolute path without "..". Returns false if
+  // the URI is not acceptable.
+  static bool decode_path(const std::string &uri, std::string &path);
+
   // Perform URL-decoding on a string. Returns false if the encoding was
   // invalid.
   static bool url_decode(const std::string &in, std::string &out);
@@ -1,19 +1,266 @@
 #include "request.hpp"
 #include "request_parser.hpp"
+#include <algorithm>
+#include <cctype>
+#include <limits>
 
 namespace http
 {
 namespace server
 {
 
-request_parser::request_parser()
-    : state_(method_start)
+request_parser::request_parser(std::size_t max_body_size)
+    : state_(method_start),
+      body_state_(no_body),
+      max_body_size_(max_body_size),
+      body_received_(0),
+      body_remaining_(0)
 {
 }
 
 void request_parser::reset()
 {
   state_ = method_start;
+  body_state_ = no_body;
+  body_received_ = 0;
+  body_remaining_ = 0;
+}
+
+request_parser::result_type request_parser::begin_body(const request &req)
+{
+  const header *content_length = req.find(known_header::content_length);
+  const header *transfer_encoding = req.find(known_header::transfer_encoding);
+
+  if (transfer_encoding)
+  {
+    // A request carrying both framings is a classic smuggling vector, and
+    // codings other than chunked are not supported.
+    if (content_length || !iequals(transfer_encoding->value, "chunked"))
+    {
+      return bad;
+    }
+    body_state_ = chunk_size_start;
+    return indeterminate;
+  }
+
+  if (!content_length)
+  {
+    return good;
+  }
+
+  std::size_t length = 0;
+  if (content_length->value.empty())
+  {
+    return bad;
+  }
+  for (char c : content_length->value)
+  {
+    if (!is_digit(c))
+    {
+      return bad;
+    }
+    if (length > (std::numeric_limits<std::size_t>::max() - 9) / 10)
+    {
+      return too_large;
+    }
+    length = length * 10 + (c - '0');
+  }
+
+  if (length > max_body_size_)
+  {
+    return too_large;
+  }
+  else if (length == 0)
+  {
+    return good;
+  }
+  body_state_ = identity;
+  body_remaining_ = length;
+  return indeterminate;
+}
+
+bool request_parser::expects_continue(const request &req)
+{
+  if (req.http_version_major != 1 || req.http_version_minor < 1)
+  {
+    return false;
+  }
+  const header *expect = req.find(known_header::expect);
+  return expect && iequals(expect->value, "100-continue");
+}
+
+std::tuple<request_parser::result_type, const char *> request_parser::parse_body(
+    const char *begin, const char *end, const body_handler &handler)
+{
+  while (begin != end)
+  {
+    if (body_state_ == identity || body_state_ == chunk_data)
+    {
+      // Hand over as much content as is available in one piece.
+      std::size_t length = std::min<std::size_t>(end - begin, body_remaining_);
+      handler(begin, length);
+      begin += length;
+      body_remaining_ -= length;
+      if (body_remaining_ == 0)
+      {
+        if (body_state_ == identity)
+        {
+          body_state_ = no_body;
+          return std::make_tuple(good, begin);
+        }
+        body_state_ = chunk_data_cr;
+      }
+      continue;
+    }
+
+    result_type result = consume_chunked(*begin++);
+    if (result != indeterminate)
+    {
+      return std::make_tuple(result, begin);
+    }
+  }
+  return std::make_tuple(indeterminate, begin);
+}
+
+request_parser::result_type request_parser::consume_chunked(char input)
+{
+  switch (body_state_)
+  {
+  case chunk_size_start:
+    if (hex_value(input) >= 0)
+    {
+      body_remaining_ = hex_value(input);
+      body_state_ = chunk_size;
+      return indeterminate;
+    }
+    else
+    {
+      return bad;
+    }
+  case chunk_size:
+    if (hex_value(input) >= 0)
+    {
+      if (body_remaining_ > (std::numeric_limits<std::size_t>::max() - 15) / 16)
+      {
+        return too_large;
+      }
+      body_remaining_ = body_remaining_ * 16 + hex_value(input);
+      return indeterminate;
+    }
+    else if (input == ';' || input == ' ' || input == '\t')
+    {
+      body_state_ = chunk_extension;
+      return indeterminate;
+    }
+    else if (input == '\r')
+    {
+      body_state_ = chunk_size_newline;
+      return indeterminate;
+    }
+    else
+    {
+      return bad;
+    }
+  case chunk_extension:
+    if (input == '\r')
+    {
+      body_state_ = chunk_size_newline;
+      return indeterminate;
+    }
+    else if (is_ctl(input) && input != '\t')
+    {
+      return bad;
+    }
+    else
+    {
+      return indeterminate;
+    }
+  case chunk_size_newline:
+    if (input != '\n')
+    {
+      return bad;
+    }
+    else if (body_remaining_ == 0)
+    {
+      body_state_ = trailer_line_start;
+      return indeterminate;
+    }
+    else if (body_remaining_ > max_body_size_ - body_received_)
+    {
+      return too_large;
+    }
+    else
+    {
+      body_received_ += body_remaining_;
+      body_state_ = chunk_data;
+      return indeterminate;
+    }
+  case chunk_data_cr:
+    if (input == '\r')
+    {
+      body_state_ = chunk_data_lf;
+      return indeterminate;
+    }
+    else
+    {
+      return bad;
+    }
+  case chunk_data_lf:
+    if (input == '\n')
+    {
+      body_state_ = chunk_size_start;
+      return indeterminate;
+    }
+    else
+    {
+      return bad;
+    }
+  case trailer_line_start:
+    if (input == '\r')
+    {
+      body_state_ = final_newline;
+      return indeterminate;
+    }
+    // Trailer fields are accepted but not recorded.
+    body_state_ = trailer_line;
+    // Fall through.
+  case trailer_line:
+    if (input == '\r')
+    {
+      body_state_ = trailer_newline;
+      return indeterminate;
+    }
+    else if (is_ctl(input) && input != '\t')
+    {
+      return bad;
+    }
+    else
+    {
+      return indeterminate;
+    }
+  case trailer_newline:
+    if (input == '\n')
+    {
+      body_state_ = trailer_line_start;
+      return indeterminate;
+    }
+    else
+    {
+      return bad;
+    }
+  case final_newline:
+    if (input == '\n')
+    {
+      body_state_ = no_body;
+      return good;
+    }
+    else
+    {
+      return bad;
+    }
+  default:
+    return bad;
+  }
 }
 
 request_parser::result_type request_parser::consume(request &req, char input)
@@ -220,6 +467,11 @@ request_parser::result_type request_parser::consume(request &req, char input)
   case header_name:
     if (input == ':')
     {
+      // Repeating a header that must be unique is ambiguous, so refuse it.
+      if (!req.index_last_header())
+      {
+        return bad;
+      }
       state_ = space_before_header_value;
       return indeterminate;
     }
@@ -318,5 +570,35 @@ bool request_parser::is_digit(int c)
   return c >= '0' && c <= '9';
 }
 
+int request_parser::hex_value(int c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  else if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+  else if (c >= 'A' && c <= 'F')
+  {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+bool request_parser::iequals(const std::string &a, const char *b)
+{
+  std::size_t i = 0;
+  for (; i < a.size() && b[i]; ++i)
+  {
+    if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i])))
+    {
+      return false;
+    }
+  }
+  return i == a.size() && !b[i];
+}
+
 } // namespace server
 } // namespace http
\ No newline at end of file
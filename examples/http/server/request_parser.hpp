@@ -1,6 +1,9 @@
 #ifndef HTTP_REQUEST_PARSER_HPP
 #define HTTP_REQUEST_PARSER_HPP
 
+#include <cstddef>
+#include <functional>
+#include <string>
 #include <tuple>
 
 namespace http
@@ -14,8 +17,9 @@ struct request;
 class request_parser
 {
 public:
-  // Construct ready to parse the request method.
-  request_parser();
+  // Construct ready to parse the request method. Request bodies larger than
+  // max_body_size are refused.
+  explicit request_parser(std::size_t max_body_size = static_cast<std::size_t>(-1));
 
   // Rest to initial parser state.
   void reset();
@@ -25,7 +29,8 @@ public:
   {
     good,
     bad,
-    indeterminate
+    indeterminate,
+    too_large
   };
 
   // Parse some data. The enum return value is good when a complete request has
@@ -46,7 +51,32 @@ public:
     return std::make_tuple(indeterminate, begin);
   }
 
+  // Prepare to parse the body of a request whose headers have been parsed.
+  // The return value is good if the request has no body, bad if its framing
+  // headers are invalid, too_large if it declares a body larger than the
+  // limit, and indeterminate when a body follows.
+  result_type begin_body(const request &req);
+
+  // Whether the client waits for a 100 Continue response before sending the
+  // body of the request.
+  static bool expects_continue(const request &req);
+
+  // Receives the body of a request piece by piece. The data is only valid for
+  // the duration of the call.
+  typedef std::function<void(const char *data, std::size_t length)> body_handler;
+
+  // Parse some body data, passing its content to the handler without copying
+  // it. The return value is good when the whole body has been parsed, bad if
+  // the chunked encoding is invalid, too_large when the body exceeds the
+  // limit, and indeterminate when more data is required. The pointer return
+  // value indicates how much of the input has been consumed.
+  std::tuple<result_type, const char *> parse_body(const char *begin, const char *end,
+                                                   const body_handler &handler);
+
 private:
+  // Handle the next character of chunked framing.
+  result_type consume_chunked(char input);
+
   // Handle the next character of input.
   result_type consume(request &req, char input);
 
@@ -62,6 +92,12 @@ private:
   // Check if a byte is a digit.
   static bool is_digit(int c);
 
+  // Return the value of a hex digit, or -1 if the byte is not one.
+  static int hex_value(int c);
+
+  // Compare two header names or values ignoring case.
+  static bool iequals(const std::string &a, const char *b);
+
   // The current state of the parser.
   enum state
   {
@@ -86,6 +122,33 @@ private:
     expecting_newline_2,
     expecting_newline_3
   } state_;
+
+  // The current state of the body parser.
+  enum body_state
+  {
+    no_body,
+    identity,
+    chunk_size_start,
+    chunk_size,
+    chunk_extension,
+    chunk_size_newline,
+    chunk_data,
+    chunk_data_cr,
+    chunk_data_lf,
+    trailer_line_start,
+    trailer_line,
+    trailer_newline,
+    final_newline
+  } body_state_;
+
+  // The largest body accepted.
+  std::size_t max_body_size_;
+
+  // The number of body bytes received so far.
+  std::size_t body_received_;
+
+  // Content bytes left in the body or the current chunk.
+  std::size_t body_remaining_;
 };
 
 } // namespace server
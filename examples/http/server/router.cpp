@@ -0,0 +1,162 @@
+#include "router.hpp"
+#include "reply.hpp"
+#include "request.hpp"
+
+namespace http
+{
+namespace server
+{
+
+namespace
+{
+
+// Return the segment of path starting at pos, which follows a '/'.
+std::string segment_at(const std::string &path, std::size_t pos, std::size_t &next)
+{
+  std::size_t end = path.find('/', pos);
+  if (end == std::string::npos)
+  {
+    end = path.size();
+  }
+  next = end;
+  return path.substr(pos, end - pos);
+}
+
+// Add or replace the handler for a method.
+void set_handler(std::vector<std::pair<std::string, router::handler>> &handlers,
+                 const std::string &method, router::handler h)
+{
+  for (auto &entry : handlers)
+  {
+    if (entry.first == method)
+    {
+      entry.second = std::move(h);
+      return;
+    }
+  }
+  handlers.emplace_back(method, std::move(h));
+}
+
+} // namespace
+
+router::router()
+    : size_(0)
+{
+}
+
+void router::add(const std::string &method, const std::string &pattern, handler h)
+{
+  node *n = &root_;
+  std::size_t pos = pattern.empty() || pattern[0] != '/' ? 0 : 1;
+  while (pos < pattern.size())
+  {
+    std::size_t next;
+    std::string segment = segment_at(pattern, pos, next);
+    if (!segment.empty() && segment[0] == '*')
+    {
+      n->rest_name = segment.substr(1);
+      set_handler(n->rest_handlers, method, std::move(h));
+      ++size_;
+      return;
+    }
+    else if (!segment.empty() && segment[0] == ':')
+    {
+      if (!n->param)
+      {
+        n->param.reset(new node);
+        n->param_name = segment.substr(1);
+      }
+      n = n->param.get();
+    }
+    else
+    {
+      std::unique_ptr<node> &child = n->literals[segment];
+      if (!child)
+      {
+        child.reset(new node);
+      }
+      n = child.get();
+    }
+    pos = next + 1;
+  }
+  set_handler(n->handlers, method, std::move(h));
+  ++size_;
+}
+
+bool router::dispatch(const request &req, reply &rep) const
+{
+  if (size_ == 0 || req.uri.empty() || req.uri[0] != '/')
+  {
+    return false;
+  }
+
+  std::string path = req.uri.substr(0, req.uri.find('?'));
+  route_params params;
+  const handler *h = match(root_, req.method, path, 1, params);
+  if (!h)
+  {
+    return false;
+  }
+  (*h)(req, params, rep);
+  return true;
+}
+
+bool router::empty() const
+{
+  return size_ == 0;
+}
+
+const router::handler *router::match(const node &n, const std::string &method,
+                                     const std::string &path, std::size_t pos,
+                                     route_params &params) const
+{
+  if (pos >= path.size())
+  {
+    return find(n.handlers, method);
+  }
+
+  std::size_t next;
+  std::string segment = segment_at(path, pos, next);
+
+  auto literal = n.literals.find(segment);
+  if (literal != n.literals.end())
+  {
+    if (const handler *h = match(*literal->second, method, path, next + 1, params))
+    {
+      return h;
+    }
+  }
+
+  if (n.param && !segment.empty())
+  {
+    params.emplace_back(n.param_name, segment);
+    if (const handler *h = match(*n.param, method, path, next + 1, params))
+    {
+      return h;
+    }
+    params.pop_back();
+  }
+
+  if (const handler *h = find(n.rest_handlers, method))
+  {
+    params.emplace_back(n.rest_name, path.substr(pos));
+    return h;
+  }
+  return nullptr;
+}
+
+const router::handler *router::find(const std::vector<std::pair<std::string, handler>> &handlers,
+                                    const std::string &method)
+{
+  for (const auto &entry : handlers)
+  {
+    if (entry.first == method)
+    {
+      return &entry.second;
+    }
+  }
+  return nullptr;
+}
+
+} // namespace server
+} // namespace http
@@ -0,0 +1,88 @@
+#ifndef HTTP_ROUTER_HPP
+#define HTTP_ROUTER_HPP
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace http
+{
+namespace server
+{
+
+struct reply;
+struct request;
+
+// The parameters captured by a route, in the order they appear in its
+// pattern. Values are as they appear in the URI, without decoding.
+typedef std::vector<std::pair<std::string, std::string>> route_params;
+
+// Maps a request method and path to an in-process handler. Patterns are made
+// of "/"-separated segments, each either literal text, ":name" to capture one
+// segment, or a final "*name" to capture the rest of the path. Routes are
+// kept in a trie of segments, so dispatching costs one hash lookup per path
+// segment however many routes there are.
+class router
+{
+public:
+  router(const router &) = delete;
+  router &operator=(const router &) = delete;
+
+  // Produces the reply for a request that matched a route.
+  typedef std::function<void(const request &req, const route_params &params, reply &rep)> handler;
+
+  // Construct a router without routes.
+  router();
+
+  // Add a route. A later route for the same method and pattern replaces the
+  // earlier one.
+  void add(const std::string &method, const std::string &pattern, handler h);
+
+  // Dispatch a request to the route matching its method and path, ignoring
+  // any query string. Returns false if no route matches.
+  bool dispatch(const request &req, reply &rep) const;
+
+  // Whether any routes have been added.
+  bool empty() const;
+
+private:
+  struct node
+  {
+    // Children for literal segments.
+    std::unordered_map<std::string, std::unique_ptr<node>> literals;
+
+    // The child for a ":name" segment.
+    std::unique_ptr<node> param;
+    std::string param_name;
+
+    // The handler for a final "*name" segment.
+    std::string rest_name;
+    std::vector<std::pair<std::string, handler>> rest_handlers;
+
+    // Handlers for routes ending at this node, by method.
+    std::vector<std::pair<std::string, handler>> handlers;
+  };
+
+  // Match the segments of path from pos onwards below n, preferring literal
+  // segments to parameters.
+  const handler *match(const node &n, const std::string &method, const std::string &path,
+                       std::size_t pos, route_params &params) const;
+
+  // Find the handler for a method.
+  static const handler *find(const std::vector<std::pair<std::string, handler>> &handlers,
+                             const std::string &method);
+
+  // The root of the trie, matching "/".
+  node root_;
+
+  // The number of routes.
+  std::size_t size_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_ROUTER_HPP
@@ -1,14 +1,23 @@
 #include "server.hpp"
 #include <signal.h>
+#include <iostream>
+#include <stdexcept>
 #include <utility>
+#include <vector>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include "proxy.hpp"
 
 namespace http
 {
 namespace server
 {
 
-server::server(const std::string &address, const std::string &port, const std::string &doc_root)
-    : io_context_(1), signals_(io_context_), acceptor_(io_context_), connection_manager_(), request_handler_(doc_root)
+server::server(const std::string &address, const std::string &port, const std::string &doc_root,
+               const options &opts)
+    : io_context_(1), signals_(io_context_), reload_signals_(io_context_), acceptor_(io_context_), connection_manager_(),
+      request_handler_(doc_root, opts.upload_dir, opts.map_files), options_(opts),
+      rate_limiter_(opts.rate_limit, opts.rate_burst), ticket_timer_(io_context_)
 {
   // Register to handle the signals that indicate when the server should exit.
   // It is safe to register for the same signal multiple times in a program,
@@ -21,6 +30,59 @@ server::server(const std::string &address, const std::string &port, const std::s
 
   do_wait_stop();
 
+  if (opts.trace)
+  {
+    trace::enable();
+    trace_dumper_.reset(new trace::signal_dumper(io_context_));
+  }
+
+  if (!opts.tls_certificate.empty())
+  {
+    tls_context_.reset(new tls_context(
+        opts.tls_certificate, opts.tls_private_key.empty() ? opts.tls_certificate : opts.tls_private_key,
+        opts.http2));
+    if (opts.tls_ticket_rotation > 0)
+    {
+      do_rotate_ticket_keys();
+    }
+  }
+
+  if (!opts.status_prefix.empty())
+  {
+    request_handler_.add_status_routes(opts.status_prefix, rate_limiter_);
+  }
+
+  for (const std::string &spec : opts.proxies)
+  {
+    std::size_t equals = spec.find('=');
+    if (equals == std::string::npos)
+    {
+      throw std::runtime_error("proxy " + spec + " has no upstreams");
+    }
+    std::vector<std::string> upstreams;
+    boost::algorithm::split(upstreams, spec.substr(equals + 1), boost::algorithm::is_any_of(","));
+    proxies_.push_back(std::make_shared<proxy>(io_context_, upstreams,
+                                               std::chrono::seconds(opts.proxy_connect_timeout),
+                                               std::chrono::seconds(opts.proxy_timeout)));
+    request_handler_.add_proxy(spec.substr(0, equals), proxies_.back());
+  }
+
+  // Replace doc_root with an archive. Deploying a new release is then a
+  // matter of renaming the new archive into place and sending SIGHUP.
+  if (!opts.archive.empty())
+  {
+    request_handler_.load_archive(opts.archive);
+    reload_signals_.add(SIGHUP);
+    do_wait_reload();
+  }
+
+  // Warm up before opening the port, so that a load balancer probing the port
+  // only sees the server once it can serve at full speed.
+  if (opts.warm_up)
+  {
+    request_handler_.warm_up(opts.warm_up_threads, opts.preload_budget);
+  }
+
   // Open the acceptor with the option to reuse the address (i.e. SO_REUESADDR).
   boost::asio::ip::tcp::resolver resolver(io_context_);
   boost::asio::ip::tcp::endpoint endpoint = *resolver.resolve(address, port).begin();
@@ -29,6 +91,11 @@ server::server(const std::string &address, const std::string &port, const std::s
   acceptor_.bind(endpoint);
   acceptor_.listen();
 
+  if (opts.warm_up)
+  {
+    std::cerr << "ready on " << acceptor_.local_endpoint() << "\n";
+  }
+
   do_accept();
 }
 
@@ -44,7 +111,7 @@ void server::run()
 void server::do_accept()
 {
   acceptor_.async_accept(
-      [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
+      trace::traced("accept", "http", this, [this](boost::system::error_code ec, boost::asio::ip::tcp::socket socket) {
         // Check whether the server was stopped by a signal before this
         // completion handler had a chance to run
         if (!acceptor_.is_open())
@@ -52,14 +119,45 @@ void server::do_accept()
           return;
         }
 
+        if (!ec && rate_limiter_.enabled())
+        {
+          boost::system::error_code endpoint_ec;
+          boost::asio::ip::tcp::endpoint client = socket.remote_endpoint(endpoint_ec);
+          if (!endpoint_ec && !rate_limiter_.allow(client.address()))
+          {
+            do_reject(std::move(socket));
+            do_accept();
+            return;
+          }
+        }
+
         if (!ec)
         {
           connection_manager_.start(std::make_shared<connection>(
-              std::move(socket), connection_manager_, request_handler_));
+              std::move(socket), connection_manager_, request_handler_, options_, rate_limiter_,
+              tls_context_ ? &tls_context_->context() : nullptr));
         }
 
         do_accept();
-      });
+      }));
+}
+
+void server::do_reject(boost::asio::ip::tcp::socket socket)
+{
+  static const char service_unavailable[] =
+      "HTTP/1.0 503 Service Unavailable\r\n"
+      "Content-Length: 0\r\n"
+      "Retry-After: 1\r\n"
+      "\r\n";
+
+  // The reply is written without reading the request, and the socket closes
+  // when the write completes.
+  auto s = std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket));
+  boost::asio::async_write(*s, boost::asio::buffer(service_unavailable, sizeof(service_unavailable) - 1),
+                           [s](boost::system::error_code, std::size_t) {
+                             boost::system::error_code ignored_ec;
+                             s->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+                           });
 }
 
 void server::do_wait_stop()
@@ -70,7 +168,56 @@ void server::do_wait_stop()
         // operations. Once all operations have finished the io_context::run()
         // clal will exit.
         acceptor_.close();
+        reload_signals_.cancel();
+        ticket_timer_.cancel();
+        if (trace_dumper_)
+        {
+          trace_dumper_->cancel();
+        }
         connection_manager_.stop_all();
+        for (const std::shared_ptr<proxy> &p : proxies_)
+        {
+          p->stop();
+        }
+      });
+}
+
+void server::do_wait_reload()
+{
+  reload_signals_.async_wait(
+      [this](boost::system::error_code ec, int /*signo*/) {
+        if (ec)
+        {
+          return;
+        }
+
+        // Keep serving the old archive if the new one is unusable.
+        try
+        {
+          request_handler_.load_archive(options_.archive);
+          std::cerr << "reloaded " << options_.archive << "\n";
+        }
+        catch (std::exception &e)
+        {
+          std::cerr << "reload failed: " << e.what() << "\n";
+        }
+
+        do_wait_reload();
+      });
+}
+
+void server::do_rotate_ticket_keys()
+{
+  ticket_timer_.expires_after(std::chrono::seconds(options_.tls_ticket_rotation));
+  ticket_timer_.async_wait(
+      [this](boost::system::error_code ec) {
+        if (ec)
+        {
+          return;
+        }
+
+        tls_context_->rotate_ticket_keys();
+        do_rotate_ticket_keys();
       });
 }
 } // namespace server
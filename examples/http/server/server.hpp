@@ -2,16 +2,24 @@
 #define HTTP_SERVER_HPP
 
 #include <boost/asio.hpp>
+#include <memory>
 #include <string>
+#include <vector>
+#include "../../trace/trace.hpp"
 #include "connection.hpp"
 #include "connection_manager.hpp"
+#include "options.hpp"
+#include "rate_limiter.hpp"
 #include "request_handler.hpp"
+#include "tls_context.hpp"
 
 namespace http
 {
 namespace server
 {
 
+class proxy;
+
 // The top-level class of the HTTP server.
 class server
 {
@@ -20,8 +28,10 @@ public:
   server &operator=(const server &) = delete;
 
   // Construct the server to listen on the specified TCP address and port, and
-  // serve up files from the given directory.
-  explicit server(const std::string &address, const std::string &port, const std::string &doc_root);
+  // serve up files from the given directory. When warm-up is enabled the
+  // directory is walked first and the port is only opened once it is done.
+  explicit server(const std::string &address, const std::string &port, const std::string &doc_root,
+                  const options &opts = options());
 
   // Run the server's io_context loop.
   void run();
@@ -30,15 +40,27 @@ private:
   // Perform an asynchronous accept operation.
   void do_accept();
 
+  // Turn away a client that is over its rate limit.
+  void do_reject(boost::asio::ip::tcp::socket socket);
+
   // Wait for a request to stop the server.
   void do_wait_stop();
 
+  // Wait for a request to reload the archive.
+  void do_wait_reload();
+
+  // Rotate the session ticket key periodically.
+  void do_rotate_ticket_keys();
+
   // The io_context used to perform asynchronous operations.
   boost::asio::io_context io_context_;
 
   // The signal_set is used to register for process termination notifications.
   boost::asio::signal_set signals_;
 
+  // The signal_set used to request that the archive be reloaded.
+  boost::asio::signal_set reload_signals_;
+
   // Acceptor used to listen for incoming connections.
   boost::asio::ip::tcp::acceptor acceptor_;
 
@@ -47,6 +69,25 @@ private:
 
   // The handler for all incoming requests.
   request_handler request_handler_;
+
+  // Optional server behaviour.
+  options options_;
+
+  // Limits the rate of connections and requests from each client.
+  rate_limiter rate_limiter_;
+
+  // The proxies relaying requests to upstream servers, stopped with the
+  // server.
+  std::vector<std::shared_ptr<proxy>> proxies_;
+
+  // The TLS settings, if the server speaks HTTPS.
+  std::unique_ptr<tls_context> tls_context_;
+
+  // Times the rotation of the session ticket key.
+  boost::asio::steady_timer ticket_timer_;
+
+  // Writes out the recorded trace on SIGUSR1, if tracing is enabled.
+  std::unique_ptr<trace::signal_dumper> trace_dumper_;
 };
 } // namespace server
 } // namespace http
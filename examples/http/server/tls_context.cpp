@@ -0,0 +1,177 @@
+#include "tls_context.hpp"
+#include <cstring>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+namespace http
+{
+namespace server
+{
+
+namespace
+{
+
+// Identifies this server's sessions, which are only resumed with it.
+const unsigned char session_id_context[] = "http_server";
+
+} // namespace
+
+tls_context::tls_context(const std::string &certificate_chain, const std::string &private_key,
+                         bool http2)
+    : context_(boost::asio::ssl::context::tls_server)
+{
+  context_.set_options(boost::asio::ssl::context::default_workarounds |
+                       boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::no_sslv3 |
+                       boost::asio::ssl::context::no_tlsv1 | boost::asio::ssl::context::no_tlsv1_1 |
+                       boost::asio::ssl::context::single_dh_use);
+  context_.use_certificate_chain_file(certificate_chain);
+  context_.use_private_key_file(private_key, boost::asio::ssl::context::pem);
+
+  SSL_CTX *ctx = context_.native_handle();
+  SSL_CTX_set_ex_data(ctx, ex_data_index(), this);
+
+  // Idle connections give their record buffers back.
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+  // Sessions of TLS 1.2 clients without ticket support are kept in the cache.
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context(ctx, session_id_context, sizeof(session_id_context) - 1);
+  SSL_CTX_sess_set_cache_size(ctx, 20000);
+  SSL_CTX_set_timeout(ctx, 2 * 60 * 60);
+
+  // A client only needs one ticket to resume, and each costs an encryption.
+  SSL_CTX_set_num_tickets(ctx, 1);
+
+  generate(ticket_keys_[0]);
+  generate(ticket_keys_[1]);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &tls_context::ticket_key_callback);
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb(ctx, &tls_context::ticket_key_callback);
+#endif
+
+  if (http2)
+  {
+    alpn_protocols_.append("\x02h2", 3);
+  }
+  alpn_protocols_.append("\x08http/1.1", 9);
+  SSL_CTX_set_alpn_select_cb(ctx, &tls_context::alpn_select_callback, this);
+}
+
+boost::asio::ssl::context &tls_context::context()
+{
+  return context_;
+}
+
+void tls_context::rotate_ticket_keys()
+{
+  ticket_keys_[1] = ticket_keys_[0];
+  generate(ticket_keys_[0]);
+}
+
+bool tls_context::negotiated_http2(SSL *ssl)
+{
+  const unsigned char *protocol = nullptr;
+  unsigned int length = 0;
+  SSL_get0_alpn_selected(ssl, &protocol, &length);
+  return length == 2 && std::memcmp(protocol, "h2", 2) == 0;
+}
+
+void tls_context::generate(ticket_key &key)
+{
+  RAND_bytes(key.name, sizeof(key.name));
+  RAND_bytes(key.aes_key, sizeof(key.aes_key));
+  RAND_bytes(key.hmac_key, sizeof(key.hmac_key));
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int tls_context::ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                     EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int encrypt)
+#else
+int tls_context::ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                     EVP_CIPHER_CTX *cipher, HMAC_CTX *mac, int encrypt)
+#endif
+{
+  tls_context *self = static_cast<tls_context *>(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_data_index()));
+
+  // Issue a ticket under the current key, or find the key a ticket was
+  // issued under. A ticket under an unknown key means a full handshake.
+  const ticket_key *key = nullptr;
+  int result = 1;
+  if (encrypt)
+  {
+    key = &self->ticket_keys_[0];
+    std::memcpy(key_name, key->name, sizeof(key->name));
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0 ||
+        !EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key->aes_key, iv))
+    {
+      return -1;
+    }
+  }
+  else
+  {
+    for (std::size_t i = 0; i < self->ticket_keys_.size() && !key; ++i)
+    {
+      if (std::memcmp(key_name, self->ticket_keys_[i].name, sizeof(ticket_key::name)) == 0)
+      {
+        key = &self->ticket_keys_[i];
+        result = i == 0 ? 1 : 2;
+      }
+    }
+    if (!key)
+    {
+      return 0;
+    }
+    if (!EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key->aes_key, iv))
+    {
+      return -1;
+    }
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char *>(key->hmac_key),
+                                        sizeof(key->hmac_key)),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0),
+      OSSL_PARAM_construct_end()};
+  if (!EVP_MAC_CTX_set_params(mac, params))
+  {
+    return -1;
+  }
+#else
+  if (!HMAC_Init_ex(mac, key->hmac_key, sizeof(key->hmac_key), EVP_sha256(), nullptr))
+  {
+    return -1;
+  }
+#endif
+  return result;
+}
+
+int tls_context::alpn_select_callback(SSL * /*ssl*/, const unsigned char **out,
+                                      unsigned char *out_length, const unsigned char *in,
+                                      unsigned int in_length, void *arg)
+{
+  tls_context *self = static_cast<tls_context *>(arg);
+  unsigned char *selected = nullptr;
+  if (SSL_select_next_proto(&selected, out_length,
+                            reinterpret_cast<const unsigned char *>(self->alpn_protocols_.data()),
+                            static_cast<unsigned int>(self->alpn_protocols_.size()), in,
+                            in_length) != OPENSSL_NPN_NEGOTIATED)
+  {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_context::ex_data_index()
+{
+  static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+} // namespace server
+} // namespace http
@@ -0,0 +1,75 @@
+#ifndef HTTP_TLS_CONTEXT_HPP
+#define HTTP_TLS_CONTEXT_HPP
+
+#include <array>
+#include <string>
+#include <boost/asio/ssl.hpp>
+
+namespace http
+{
+namespace server
+{
+
+// The TLS settings shared by every connection. A returning client resumes
+// its earlier session with an abbreviated handshake, skipping the public key
+// operations, either from the server's session cache or from a session
+// ticket the server can decrypt without keeping any state. Ticket keys are
+// rotated so that a stolen key only exposes recent sessions.
+class tls_context
+{
+public:
+  tls_context(const tls_context &) = delete;
+  tls_context &operator=(const tls_context &) = delete;
+
+  // Load a PEM certificate chain and private key. Clients offering HTTP/2
+  // by ALPN are given it if http2 is set. Throws boost::system::system_error
+  // if the files cannot be used.
+  tls_context(const std::string &certificate_chain, const std::string &private_key, bool http2);
+
+  boost::asio::ssl::context &context();
+
+  // Start issuing tickets under a new key. Tickets issued under the previous
+  // key are still accepted, and replaced; older ones are not.
+  void rotate_ticket_keys();
+
+  // Whether the client chose HTTP/2 by ALPN during the handshake.
+  static bool negotiated_http2(SSL *ssl);
+
+private:
+  struct ticket_key
+  {
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+  };
+
+  // Fill a key with random bytes.
+  static void generate(ticket_key &key);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  static int ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                 EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int encrypt);
+#else
+  static int ticket_key_callback(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                                 EVP_CIPHER_CTX *cipher, HMAC_CTX *mac, int encrypt);
+#endif
+
+  static int alpn_select_callback(SSL *ssl, const unsigned char **out, unsigned char *out_length,
+                                  const unsigned char *in, unsigned int in_length, void *arg);
+
+  // The OpenSSL context, found again from an SSL object by its ex_data.
+  static int ex_data_index();
+
+  boost::asio::ssl::context context_;
+
+  // The protocols offered by ALPN, in preference order and wire format.
+  std::string alpn_protocols_;
+
+  // The key tickets are issued under, then the previous one.
+  std::array<ticket_key, 2> ticket_keys_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_TLS_CONTEXT_HPP
@@ -0,0 +1,510 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+
+using boost::asio::ip::tcp;
+
+// What one connection loop has measured.
+struct tally
+{
+  std::size_t handshakes = 0;
+  std::size_t resumed = 0;
+  std::size_t failures = 0;
+  std::vector<std::chrono::steady_clock::duration> handshake_times;
+  std::size_t downloads = 0;
+  std::uint64_t bytes = 0;
+  std::chrono::steady_clock::duration first_byte_time{};
+
+  // The cipher and server key of the first handshake.
+  std::string cipher;
+  std::string server_key;
+};
+
+// Describe the key the server authenticated with, such as "RSA 2048".
+std::string describe_server_key(SSL *ssl)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  X509 *certificate = SSL_get1_peer_certificate(ssl);
+#else
+  X509 *certificate = SSL_get_peer_certificate(ssl);
+#endif
+  EVP_PKEY *key = certificate ? X509_get0_pubkey(certificate) : nullptr;
+  std::string description = "unknown";
+  if (key)
+  {
+    switch (EVP_PKEY_base_id(key))
+    {
+    case EVP_PKEY_RSA:
+      description = "RSA";
+      break;
+    case EVP_PKEY_EC:
+      description = "ECDSA";
+      break;
+    case EVP_PKEY_ED25519:
+      description = "Ed25519";
+      break;
+    default:
+      description = OBJ_nid2sn(EVP_PKEY_base_id(key));
+      break;
+    }
+    description += " " + std::to_string(EVP_PKEY_bits(key));
+  }
+  X509_free(certificate);
+  return description;
+}
+
+// Opens one TLS connection after another until the deadline. Each connection
+// sends the request and waits for the first bytes of the response, by which
+// time a TLS 1.3 server has also sent its session ticket. When resuming, the
+// session of each connection is offered to the server by the next one. When
+// downloading, the whole response is read, until the server closes.
+class connection_loop
+{
+public:
+  connection_loop(const connection_loop &) = delete;
+  connection_loop &operator=(const connection_loop &) = delete;
+
+  connection_loop(boost::asio::io_context &io_context, boost::asio::ssl::context &context,
+                  const tcp::resolver::results_type &endpoints, const std::string &request,
+                  bool resume, bool download, std::chrono::steady_clock::time_point deadline)
+      : io_context_(io_context), context_(context), endpoints_(endpoints), request_(request),
+        resume_(resume), download_(download), deadline_(deadline), session_(nullptr)
+  {
+  }
+
+  ~connection_loop()
+  {
+    if (session_)
+    {
+      SSL_SESSION_free(session_);
+    }
+  }
+
+  void start()
+  {
+    do_connect();
+  }
+
+  const tally &result() const
+  {
+    return tally_;
+  }
+
+private:
+  void do_connect()
+  {
+    stream_.reset();
+    if (std::chrono::steady_clock::now() >= deadline_)
+    {
+      return;
+    }
+
+    stream_.reset(new boost::asio::ssl::stream<tcp::socket>(io_context_, context_));
+    if (session_)
+    {
+      SSL_set_session(stream_->native_handle(), session_);
+    }
+    boost::asio::async_connect(stream_->lowest_layer(), endpoints_,
+                               [this](const boost::system::error_code &error,
+                                      const tcp::endpoint & /*endpoint*/) {
+                                 if (error)
+                                 {
+                                   fail(error);
+                                   return;
+                                 }
+                                 boost::system::error_code ignored_ec;
+                                 stream_->lowest_layer().set_option(tcp::no_delay(true), ignored_ec);
+                                 do_handshake();
+                               });
+  }
+
+  void do_handshake()
+  {
+    handshake_start_ = std::chrono::steady_clock::now();
+    stream_->async_handshake(boost::asio::ssl::stream_base::client,
+                             [this](const boost::system::error_code &error) {
+                               if (error)
+                               {
+                                 fail(error);
+                                 return;
+                               }
+                               tally_.handshake_times.push_back(std::chrono::steady_clock::now() - handshake_start_);
+                               ++tally_.handshakes;
+                               if (tally_.cipher.empty())
+                               {
+                                 tally_.cipher = SSL_get_cipher_name(stream_->native_handle());
+                                 tally_.server_key = describe_server_key(stream_->native_handle());
+                               }
+                               if (SSL_session_reused(stream_->native_handle()))
+                               {
+                                 ++tally_.resumed;
+                               }
+                               do_request();
+                             });
+  }
+
+  void do_request()
+  {
+    request_start_ = std::chrono::steady_clock::now();
+    if (request_.empty())
+    {
+      do_read_response();
+      return;
+    }
+    boost::asio::async_write(*stream_, boost::asio::buffer(request_),
+                             [this](const boost::system::error_code &error, std::size_t /*length*/) {
+                               if (error)
+                               {
+                                 fail(error);
+                                 return;
+                               }
+                               do_read_response();
+                             });
+  }
+
+  void do_read_response()
+  {
+    stream_->async_read_some(boost::asio::buffer(response_),
+                             [this](const boost::system::error_code &error, std::size_t length) {
+                               if (error)
+                               {
+                                 fail(error);
+                                 return;
+                               }
+                               if (download_)
+                               {
+                                 tally_.first_byte_time += std::chrono::steady_clock::now() - request_start_;
+                                 tally_.bytes += length;
+                                 do_read_body();
+                                 return;
+                               }
+                               // The connection is closed without a TLS shutdown,
+                               // after which OpenSSL would not resume its session.
+                               SSL_set_shutdown(stream_->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+                               if (resume_)
+                               {
+                                 if (session_)
+                                 {
+                                   SSL_SESSION_free(session_);
+                                 }
+                                 session_ = SSL_get1_session(stream_->native_handle());
+                               }
+                               next();
+                             });
+  }
+
+  // Read the rest of the response. The server may close without a TLS
+  // shutdown, which ends the response as well.
+  void do_read_body()
+  {
+    stream_->async_read_some(boost::asio::buffer(response_),
+                             [this](const boost::system::error_code &error, std::size_t length) {
+                               tally_.bytes += length;
+                               if (error == boost::asio::error::eof ||
+                                   error == boost::asio::ssl::error::stream_truncated)
+                               {
+                                 SSL_set_shutdown(stream_->native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+                                 ++tally_.downloads;
+                                 next();
+                               }
+                               else if (error)
+                               {
+                                 fail(error);
+                               }
+                               else
+                               {
+                                 do_read_body();
+                               }
+                             });
+  }
+
+  void fail(const boost::system::error_code &error)
+  {
+    if (tally_.failures++ == 0)
+    {
+      std::cerr << "Connection failed: " << error.message() << "\n";
+    }
+    next();
+  }
+
+  // Close the connection, without a TLS shutdown, once the handler that
+  // used it has returned.
+  void next()
+  {
+    boost::asio::post(io_context_, [this]() {
+      do_connect();
+    });
+  }
+
+  boost::asio::io_context &io_context_;
+  boost::asio::ssl::context &context_;
+  const tcp::resolver::results_type &endpoints_;
+  const std::string &request_;
+  bool resume_;
+  bool download_;
+  std::chrono::steady_clock::time_point deadline_;
+  std::unique_ptr<boost::asio::ssl::stream<tcp::socket>> stream_;
+  SSL_SESSION *session_;
+  std::chrono::steady_clock::time_point handshake_start_;
+  std::chrono::steady_clock::time_point request_start_;
+  char response_[16384];
+  tally tally_;
+};
+
+// Return the handshake time below which the given fraction of them fall, in
+// milliseconds. The times must be sorted.
+double percentile_ms(const std::vector<std::chrono::steady_clock::duration> &times, double fraction)
+{
+  if (times.empty())
+  {
+    return 0;
+  }
+  std::size_t index = std::min(times.size() - 1, static_cast<std::size_t>(fraction * times.size()));
+  return std::chrono::duration<double, std::milli>(times[index]).count();
+}
+
+// Run the connection loops for the given time on each thread, and print what
+// they measured. The first phase of a cipher suite also prints the cipher
+// and server key that were negotiated.
+void run_phase(const char *name, boost::asio::ssl::context &context,
+               const tcp::resolver::results_type &endpoints, const std::string &request,
+               bool resume, bool download, bool describe, int threads, int connections, int seconds)
+{
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::seconds(seconds);
+
+  std::vector<std::unique_ptr<boost::asio::io_context>> io_contexts;
+  std::vector<std::unique_ptr<connection_loop>> loops;
+  for (int t = 0; t < threads; ++t)
+  {
+    io_contexts.emplace_back(new boost::asio::io_context(1));
+    for (int c = t; c < connections; c += threads)
+    {
+      loops.emplace_back(new connection_loop(*io_contexts.back(), context, endpoints, request, resume, download, deadline));
+      loops.back()->start();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  for (auto &io_context : io_contexts)
+  {
+    workers.emplace_back([&io_context]() { io_context->run(); });
+  }
+  for (std::thread &worker : workers)
+  {
+    worker.join();
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  tally total;
+  for (const auto &loop : loops)
+  {
+    total.handshakes += loop->result().handshakes;
+    total.resumed += loop->result().resumed;
+    total.failures += loop->result().failures;
+    total.handshake_times.insert(total.handshake_times.end(), loop->result().handshake_times.begin(),
+                                 loop->result().handshake_times.end());
+    total.downloads += loop->result().downloads;
+    total.bytes += loop->result().bytes;
+    total.first_byte_time += loop->result().first_byte_time;
+    if (total.cipher.empty())
+    {
+      total.cipher = loop->result().cipher;
+      total.server_key = loop->result().server_key;
+    }
+  }
+  std::sort(total.handshake_times.begin(), total.handshake_times.end());
+
+  if (describe)
+  {
+    std::cout << (total.cipher.empty() ? "no handshakes" : total.cipher + ", server key " + total.server_key)
+              << "\n";
+  }
+
+  if (download)
+  {
+    double first_byte_ms = total.handshakes == 0 ? 0
+                                                 : std::chrono::duration<double, std::milli>(total.first_byte_time).count() /
+                                                       total.handshakes;
+    std::cout << std::fixed << std::setprecision(1) << std::left << std::setw(9) << name << std::right
+              << std::setw(9) << total.downloads << " downloads" << std::setw(10)
+              << total.bytes / elapsed.count() / (1024 * 1024) << " MB/s" << std::setprecision(3)
+              << std::setw(9) << first_byte_ms << " ms to first byte" << std::setw(7) << total.failures
+              << " failed\n";
+    return;
+  }
+
+  std::cout << std::fixed << std::setprecision(1) << std::left << std::setw(9) << name << std::right
+            << std::setw(9) << total.handshakes << " handshakes" << std::setw(10)
+            << total.handshakes / elapsed.count() << "/s" << std::setw(9) << total.resumed << " resumed"
+            << std::setprecision(3) << "  p50 " << percentile_ms(total.handshake_times, 0.5) << " p90 "
+            << percentile_ms(total.handshake_times, 0.9) << " p99 " << percentile_ms(total.handshake_times, 0.99)
+            << " ms" << std::setw(7) << total.failures << " failed\n";
+}
+
+// Create the client context for one cipher suite, or for OpenSSL's defaults
+// if suite is empty. TLS 1.3 suites are named "TLS_..."; any other name is a
+// TLS 1.2 cipher, such as "ECDHE-RSA-AES128-GCM-SHA256".
+std::unique_ptr<boost::asio::ssl::context> make_context(const std::string &suite, bool tls12, bool no_tickets)
+{
+  std::unique_ptr<boost::asio::ssl::context> context(
+      new boost::asio::ssl::context(boost::asio::ssl::context::tls_client));
+  SSL_CTX *native = context->native_handle();
+  if (tls12)
+  {
+    SSL_CTX_set_max_proto_version(native, TLS1_2_VERSION);
+  }
+  if (suite.compare(0, 4, "TLS_") == 0)
+  {
+    SSL_CTX_set_min_proto_version(native, TLS1_3_VERSION);
+    if (SSL_CTX_set_ciphersuites(native, suite.c_str()) != 1)
+    {
+      throw std::runtime_error("unknown cipher suite " + suite);
+    }
+  }
+  else if (!suite.empty())
+  {
+    SSL_CTX_set_max_proto_version(native, TLS1_2_VERSION);
+    if (SSL_CTX_set_cipher_list(native, suite.c_str()) != 1)
+    {
+      throw std::runtime_error("unknown cipher suite " + suite);
+    }
+  }
+  if (no_tickets)
+  {
+    context->set_options(SSL_OP_NO_TICKET);
+  }
+
+  // Only performance is measured, so the server is not authenticated.
+  context->set_verify_mode(boost::asio::ssl::verify_none);
+  return context;
+}
+
+// Return the value of a "--name=value" argument, or null if arg is not name.
+const char *option_value(const char *arg, const char *name)
+{
+  std::size_t length = std::strlen(name);
+  if (std::strncmp(arg, name, length) == 0 && arg[length] == '=')
+  {
+    return arg + length + 1;
+  }
+  return nullptr;
+}
+
+int main(int argc, char *argv[])
+{
+  try
+  {
+    if (argc < 3)
+    {
+      std::cerr << "Usage: benchmark <host> <port> [options]\n";
+      std::cerr << "  Measures full and resumed TLS handshakes per second and their latency,\n";
+      std::cerr << "  for each cipher suite given.\n";
+      std::cerr << "  Options:\n";
+      std::cerr << "    --connections=<n>   connections open at once (default 16)\n";
+      std::cerr << "    --threads=<n>       client threads (default 1)\n";
+      std::cerr << "    --seconds=<n>       length of each phase (default 5)\n";
+      std::cerr << "    --request=<text>    sent on each connection (default an HTTP/1.0 GET),\n";
+      std::cerr << "                        or nothing if empty\n";
+      std::cerr << "    --tls1.2            stop at TLS 1.2\n";
+      std::cerr << "    --no-tickets        resume from the server's session cache\n";
+      std::cerr << "    --ciphers=<a:b>     suites to measure in turn, such as TLS_AES_128_GCM_SHA256\n";
+      std::cerr << "                        or ECDHE-RSA-AES128-GCM-SHA256 (default negotiated)\n";
+      std::cerr << "    --download          also read whole responses, for MB/s and the time to\n";
+      std::cerr << "                        their first byte\n";
+      return 1;
+    }
+
+    int connections = 16;
+    int threads = 1;
+    int seconds = 5;
+    bool download = false;
+    bool tls12 = false;
+    bool no_tickets = false;
+    std::vector<std::string> suites;
+    std::string request = "GET / HTTP/1.0\r\n\r\n";
+    for (int i = 3; i < argc; ++i)
+    {
+      const char *value = nullptr;
+      if (std::strcmp(argv[i], "--tls1.2") == 0)
+      {
+        tls12 = true;
+      }
+      else if (std::strcmp(argv[i], "--download") == 0)
+      {
+        download = true;
+      }
+      else if (std::strcmp(argv[i], "--no-tickets") == 0)
+      {
+        no_tickets = true;
+      }
+      else if ((value = option_value(argv[i], "--ciphers")))
+      {
+        std::string list = value;
+        for (std::size_t start = 0, end = 0; start < list.size(); start = end + 1)
+        {
+          end = std::min(list.find(':', start), list.size());
+          suites.push_back(list.substr(start, end - start));
+        }
+      }
+      else if ((value = option_value(argv[i], "--connections")))
+      {
+        connections = std::atoi(value);
+      }
+      else if ((value = option_value(argv[i], "--threads")))
+      {
+        threads = std::atoi(value);
+      }
+      else if ((value = option_value(argv[i], "--seconds")))
+      {
+        seconds = std::atoi(value);
+      }
+      else if ((value = option_value(argv[i], "--request")))
+      {
+        request = value;
+      }
+      else
+      {
+        std::cerr << "Unknown option: " << argv[i] << "\n";
+        return 1;
+      }
+    }
+
+    if (suites.empty())
+    {
+      suites.push_back("");
+    }
+
+    boost::asio::io_context io_context;
+    tcp::resolver resolver(io_context);
+    auto endpoints = resolver.resolve(argv[1], argv[2]);
+
+    for (const std::string &suite : suites)
+    {
+      auto context = make_context(suite, tls12, no_tickets);
+      run_phase("full", *context, endpoints, request, false, false, true, threads, connections, seconds);
+      run_phase("resumed", *context, endpoints, request, true, false, false, threads, connections, seconds);
+      if (download)
+      {
+        run_phase("download", *context, endpoints, request, true, true, false, threads, connections, seconds);
+      }
+    }
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+  }
+
+  return 0;
+}
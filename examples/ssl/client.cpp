@@ -1,115 +1,404 @@
+#include <sys/socket.h>
+#include <cerrno>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 
 using boost::asio::ip::tcp;
-using std::placeholders::_1;
-using std::placeholders::_2;
 
 enum
 {
   max_length = 1024
 };
 
-class client
+struct pool_options
+{
+  // The idle connections kept for each endpoint.
+  std::size_t max_idle = 4;
+
+  // How long an idle connection is kept before it is closed instead of
+  // reused, since servers drop idle connections of their own accord.
+  std::chrono::seconds idle_timeout{30};
+};
+
+// What the pool has saved.
+struct pool_stats
+{
+  std::size_t connections = 0;
+  std::size_t resumed = 0;
+  std::size_t reused = 0;
+  std::size_t verifications = 0;
+  std::size_t verify_cache_hits = 0;
+};
+
+// Hands out TLS connections by host and port, and keeps what makes the next
+// connection cheaper: idle connections to reuse as they are, the last
+// session of each endpoint to resume, and the certificate chains that have
+// already been verified.
+class connection_pool
 {
 public:
-  client(boost::asio::io_context &io_context,
-         boost::asio::ssl::context &context,
-         const tcp::resolver::results_type &endpoints)
-      : socket_(io_context, context)
+  typedef boost::asio::ssl::stream<tcp::socket> stream_type;
+  typedef std::function<void(const boost::system::error_code &, std::shared_ptr<stream_type>)> acquire_handler;
+
+  connection_pool(const connection_pool &) = delete;
+  connection_pool &operator=(const connection_pool &) = delete;
+
+  connection_pool(boost::asio::io_context &io_context, boost::asio::ssl::context &context,
+                  const pool_options &opts)
+      : io_context_(io_context), context_(context), resolver_(io_context), options_(opts)
   {
-    socket_.set_verify_mode(boost::asio::ssl::verify_peer);
-    socket_.set_verify_callback(
-        std::bind(&client::verify_certificate, this, _1, _2));
+    SSL_CTX *native = context_.native_handle();
 
-    connect(endpoints);
+    // Sessions are kept by endpoint here rather than in OpenSSL's cache,
+    // which the client side does not look up. They are saved once they
+    // arrive, which in TLS 1.3 is after the handshake.
+    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(native, &connection_pool::save_session);
+
+    context_.set_verify_mode(boost::asio::ssl::verify_peer);
+    SSL_CTX_set_cert_verify_callback(native, &connection_pool::verify_chain, this);
   }
 
-private:
-  bool verify_certificate(bool preverified,
-                          boost::asio::ssl::verify_context &ctx)
+  ~connection_pool()
   {
-    // The verify callback can be used to check whether the certificate that is
-    // being presented is valid for the peer. For example, RFC 2818 describes
-    // the steps involved in doing this for HTTPS. Consult the OpenSSL
-    // documentation for more details. Note that the callback is called once
-    // for each certificate in the certificate chain, starting from the root
-    // certificate authority.
+    for (auto &entry : endpoints_)
+    {
+      for (idle_connection &idle : entry.second.idle)
+      {
+        close(*idle.stream);
+      }
+      if (entry.second.session)
+      {
+        SSL_SESSION_free(entry.second.session);
+      }
+    }
+  }
 
-    // In this example we will simply print the certificate's subject name.
-    char subject_name[256];
-    X509 *cert = X509_STORE_CTX_get_current_cert(ctx.native_handle());
-    X509_NAME_oneline(X509_get_subject_name(cert), subject_name, 256);
-    std::cout << "Verifying " << subject_name << "\n";
+  // Hand handler a connection to host and port: the most recently used idle
+  // one that is still open, or else a new one that offers the endpoint's
+  // last session.
+  void acquire(const std::string &host, const std::string &port, acquire_handler handler)
+  {
+    endpoint_state &endpoint = endpoints_[host + ":" + port];
+    auto now = std::chrono::steady_clock::now();
+    while (!endpoint.idle.empty())
+    {
+      idle_connection idle = endpoint.idle.back();
+      endpoint.idle.pop_back();
+      if (now - idle.since < options_.idle_timeout && alive(*idle.stream))
+      {
+        ++stats_.reused;
+        boost::asio::post(io_context_, [handler, idle]() {
+          handler(boost::system::error_code(), idle.stream);
+        });
+        return;
+      }
+      close(*idle.stream);
+    }
+
+    if (!endpoint.addresses.empty())
+    {
+      connect(endpoint, handler);
+      return;
+    }
 
-    return preverified;
+    // The addresses are resolved once per endpoint.
+    endpoint.host = host;
+    resolver_.async_resolve(host, port,
+                            [this, &endpoint, handler](const boost::system::error_code &error,
+                                                       const tcp::resolver::results_type &results) {
+                              if (error)
+                              {
+                                handler(error, nullptr);
+                                return;
+                              }
+                              endpoint.addresses = results;
+                              connect(endpoint, handler);
+                            });
   }
 
-  void connect(const tcp::resolver::results_type &endpoints)
+  // Open n connections to host and port at once, ahead of their use, and
+  // keep them idle. Only the first to arrive verifies the server's chain.
+  void warm(const std::string &host, const std::string &port, std::size_t n)
   {
-    boost::asio::async_connect(socket_.lowest_layer(), endpoints,
-                               [this](const boost::system::error_code &error,
-                                      const tcp::endpoint & /*endpoint*/) {
-                                 if (!error)
-                                 {
-                                   handshake();
-                                 }
-                                 else
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      acquire(host, port,
+              [this, host, port](const boost::system::error_code &error, std::shared_ptr<stream_type> stream) {
+                if (!error)
+                {
+                  release(host, port, stream);
+                }
+              });
+    }
+  }
+
+  // Take back a connection whose exchange is complete, to be reused.
+  void release(const std::string &host, const std::string &port, std::shared_ptr<stream_type> stream)
+  {
+    endpoint_state &endpoint = endpoints_[host + ":" + port];
+    if (endpoint.idle.size() >= options_.max_idle)
+    {
+      close(*stream);
+      return;
+    }
+    endpoint.idle.push_back(idle_connection{stream, std::chrono::steady_clock::now()});
+  }
+
+  const pool_stats &stats() const
+  {
+    return stats_;
+  }
+
+private:
+  struct idle_connection
+  {
+    std::shared_ptr<stream_type> stream;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  // What is kept for one host and port.
+  struct endpoint_state
+  {
+    std::string host;
+    tcp::resolver::results_type addresses;
+    SSL_SESSION *session = nullptr;
+    std::vector<idle_connection> idle;
+  };
+
+  void connect(endpoint_state &endpoint, acquire_handler handler)
+  {
+    auto stream = std::make_shared<stream_type>(io_context_, context_);
+    SSL *ssl = stream->native_handle();
+    SSL_set_tlsext_host_name(ssl, endpoint.host.c_str());
+    SSL_set_ex_data(ssl, endpoint_index(), &endpoint);
+    if (endpoint.session)
+    {
+      SSL_set_session(ssl, endpoint.session);
+    }
+
+    boost::asio::async_connect(stream->lowest_layer(), endpoint.addresses,
+                               [this, stream, handler](const boost::system::error_code &error,
+                                                       const tcp::endpoint & /*endpoint*/) {
+                                 if (error)
                                  {
-                                   std::cout << "Connect failed: " << error.message() << "\n";
+                                   handler(error, nullptr);
+                                   return;
                                  }
+                                 handshake(stream, handler);
                                });
   }
 
-  void handshake()
+  void handshake(std::shared_ptr<stream_type> stream, acquire_handler handler)
   {
-    socket_.async_handshake(boost::asio::ssl::stream_base::client,
-                            [this](const boost::system::error_code &error) {
-                              if (!error)
+    stream->async_handshake(boost::asio::ssl::stream_base::client,
+                            [this, stream, handler](const boost::system::error_code &error) {
+                              if (error)
                               {
-                                send_request();
+                                handler(error, nullptr);
+                                return;
                               }
-                              else
+                              ++stats_.connections;
+                              if (SSL_session_reused(stream->native_handle()))
                               {
-                                std::cout << "Handshake failed: " << error.message() << "\n";
+                                ++stats_.resumed;
                               }
+                              handler(error, stream);
                             });
   }
 
+  // Whether the server has kept an idle connection open. Bytes waiting on
+  // it are session tickets or alerts for OpenSSL, so only a closed socket
+  // counts as dead.
+  static bool alive(stream_type &stream)
+  {
+    char byte;
+    ssize_t n = ::recv(stream.lowest_layer().native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+  }
+
+  // Close a connection without a TLS shutdown, marked as though it had one,
+  // since OpenSSL would otherwise stop the endpoint's session resuming.
+  static void close(stream_type &stream)
+  {
+    SSL_set_shutdown(stream.native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    boost::system::error_code ignored_ec;
+    stream.lowest_layer().close(ignored_ec);
+  }
+
+  static int endpoint_index()
+  {
+    static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+  }
+
+  // Keep the newest session the server has issued for the endpoint.
+  static int save_session(SSL *ssl, SSL_SESSION *session)
+  {
+    auto *endpoint = static_cast<endpoint_state *>(SSL_get_ex_data(ssl, endpoint_index()));
+    if (!endpoint)
+    {
+      return 0;
+    }
+    if (endpoint->session)
+    {
+      SSL_SESSION_free(endpoint->session);
+    }
+    endpoint->session = session;
+    return 1;
+  }
+
+  static int verify_chain(X509_STORE_CTX *store, void *arg)
+  {
+    return static_cast<connection_pool *>(arg)->verify_chain(store);
+  }
+
+  // Verify the chain the server presented, unless the same chain has been
+  // verified before and its certificate has not expired since. Each chain is
+  // built, checked and reported once.
+  int verify_chain(X509_STORE_CTX *store)
+  {
+    X509 *certificate = X509_STORE_CTX_get0_cert(store);
+    std::string fingerprint = chain_fingerprint(store);
+    if (!fingerprint.empty() && verified_.count(fingerprint) &&
+        X509_cmp_current_time(X509_get0_notAfter(certificate)) > 0)
+    {
+      ++stats_.verify_cache_hits;
+      X509_STORE_CTX_set_error(store, X509_V_OK);
+      return 1;
+    }
+
+    ++stats_.verifications;
+    int result = X509_verify_cert(store);
+    char subject_name[256];
+    X509_NAME_oneline(X509_get_subject_name(certificate), subject_name, sizeof(subject_name));
+    if (result == 1)
+    {
+      std::cout << "Verified " << subject_name << "\n";
+      if (!fingerprint.empty())
+      {
+        verified_.insert(fingerprint);
+      }
+    }
+    else
+    {
+      std::cout << "Verifying " << subject_name
+                << " failed: " << X509_verify_cert_error_string(X509_STORE_CTX_get_error(store)) << "\n";
+    }
+    return result;
+  }
+
+  // The SHA-256 digests of the server's certificate and of the intermediates
+  // sent with it, or empty if one cannot be computed.
+  static std::string chain_fingerprint(X509_STORE_CTX *store)
+  {
+    std::string fingerprint;
+    auto append = [&fingerprint](X509 *certificate) {
+      unsigned char digest[EVP_MAX_MD_SIZE];
+      unsigned int length = 0;
+      if (!X509_digest(certificate, EVP_sha256(), digest, &length))
+      {
+        return false;
+      }
+      fingerprint.append(reinterpret_cast<char *>(digest), length);
+      return true;
+    };
+
+    if (!append(X509_STORE_CTX_get0_cert(store)))
+    {
+      return std::string();
+    }
+    STACK_OF(X509) *untrusted = X509_STORE_CTX_get0_untrusted(store);
+    for (int i = 0; untrusted && i < sk_X509_num(untrusted); ++i)
+    {
+      if (!append(sk_X509_value(untrusted, i)))
+      {
+        return std::string();
+      }
+    }
+    return fingerprint;
+  }
+
+  boost::asio::io_context &io_context_;
+  boost::asio::ssl::context &context_;
+  tcp::resolver resolver_;
+  pool_options options_;
+  std::map<std::string, endpoint_state> endpoints_;
+  std::set<std::string> verified_;
+  pool_stats stats_;
+};
+
+// Sends each line typed to the echo server on a connection from the pool,
+// and prints the reply.
+class client
+{
+public:
+  client(connection_pool &pool, const std::string &host, const std::string &port)
+      : pool_(pool), host_(host), port_(port)
+  {
+    send_request();
+  }
+
+private:
   void send_request()
   {
     std::cout << "Enter message: ";
-    std::cin.getline(request_, max_length);
+    if (!std::cin.getline(request_, max_length))
+    {
+      return;
+    }
     size_t request_length = std::strlen(request_);
+    if (request_length == 0)
+    {
+      send_request();
+      return;
+    }
 
-    boost::asio::async_write(socket_,
-                             boost::asio::buffer(request_, request_length),
-                             [this](const boost::system::error_code &error, std::size_t length) {
-                               if (!error)
-                               {
-                                 receive_response(length);
-                               }
-                               else
-                               {
-                                 std::cout << "Write failed: " << error.message() << "\n";
-                               }
-                             });
+    pool_.acquire(host_, port_,
+                  [this, request_length](const boost::system::error_code &error,
+                                         std::shared_ptr<connection_pool::stream_type> stream) {
+                    if (error)
+                    {
+                      std::cout << "Connect failed: " << error.message() << "\n";
+                      return;
+                    }
+                    boost::asio::async_write(*stream,
+                                             boost::asio::buffer(request_, request_length),
+                                             [this, stream](const boost::system::error_code &error, std::size_t length) {
+                                               if (!error)
+                                               {
+                                                 receive_response(stream, length);
+                                               }
+                                               else
+                                               {
+                                                 std::cout << "Write failed: " << error.message() << "\n";
+                                               }
+                                             });
+                  });
   }
 
-  void receive_response(std::size_t length)
+  void receive_response(std::shared_ptr<connection_pool::stream_type> stream, std::size_t length)
   {
-    boost::asio::async_read(socket_,
+    boost::asio::async_read(*stream,
                             boost::asio::buffer(reply_, length),
-                            [this](const boost::system::error_code &error, std::size_t length) {
+                            [this, stream](const boost::system::error_code &error, std::size_t length) {
                               if (!error)
                               {
                                 std::cout << "Reply: ";
                                 std::cout.write(reply_, length);
                                 std::cout << "\n";
+                                pool_.release(host_, port_, stream);
+                                send_request();
                               }
                               else
                               {
@@ -118,32 +407,89 @@ private:
                             });
   }
 
-  boost::asio::ssl::stream<tcp::socket> socket_;
+  connection_pool &pool_;
+  std::string host_;
+  std::string port_;
   char request_[max_length];
   char reply_[max_length];
 };
 
+// Return the value of a "--name=value" argument, or null if arg is not name.
+const char *option_value(const char *arg, const char *name)
+{
+  std::size_t length = std::strlen(name);
+  if (std::strncmp(arg, name, length) == 0 && arg[length] == '=')
+  {
+    return arg + length + 1;
+  }
+  return nullptr;
+}
+
 int main(int argc, char *argv[])
 {
   try
   {
-    if (argc != 3)
+    if (argc < 3)
     {
-      std::cerr << "Usage: client <host> <port>\n";
+      std::cerr << "Usage: client <host> <port> [options]\n";
+      std::cerr << "  Options:\n";
+      std::cerr << "    --max-idle=<n>       idle connections kept for reuse (default 4, 0 to\n";
+      std::cerr << "                         connect anew, resuming the session, every time)\n";
+      std::cerr << "    --idle-timeout=<s>   seconds an idle connection is kept (default 30)\n";
+      std::cerr << "    --warm=<n>           connections opened before the first message\n";
+      std::cerr << "    --verify-file=<pem>  certificates to trust (default certificate.pem)\n";
       return 1;
     }
 
-    boost::asio::io_context io_context;
+    pool_options opts;
+    std::string verify_file = "certificate.pem";
+    std::size_t warm = 0;
+    for (int i = 3; i < argc; ++i)
+    {
+      const char *value = nullptr;
+      if ((value = option_value(argv[i], "--max-idle")))
+      {
+        opts.max_idle = std::strtoul(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--idle-timeout")))
+      {
+        opts.idle_timeout = std::chrono::seconds(std::strtol(value, nullptr, 10));
+      }
+      else if ((value = option_value(argv[i], "--warm")))
+      {
+        warm = std::strtoul(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--verify-file")))
+      {
+        verify_file = value;
+      }
+      else
+      {
+        std::cerr << "Unknown option: " << argv[i] << "\n";
+        return 1;
+      }
+    }
 
-    tcp::resolver resolver(io_context);
-    auto endpoints = resolver.resolve(argv[1], argv[2]);
+    boost::asio::io_context io_context;
 
     boost::asio::ssl::context ctx(boost::asio::ssl::context::sslv23);
-    ctx.load_verify_file("certificate.pem");
+    ctx.load_verify_file(verify_file);
 
-    client c(io_context, ctx, endpoints);
+    connection_pool pool(io_context, ctx, opts);
+    if (warm > 0)
+    {
+      pool.warm(argv[1], argv[2], warm);
+      io_context.run();
+      io_context.restart();
+    }
+    client c(pool, argv[1], argv[2]);
 
     io_context.run();
+
+    const pool_stats &stats = pool.stats();
+    std::cout << "\nconnections " << stats.connections << " (resumed " << stats.resumed << "), reused "
+              << stats.reused << ", chains verified " << stats.verifications << ", verify cache hits "
+              << stats.verify_cache_hits << "\n";
   }
   catch (std::exception &e)
   {
@@ -151,4 +497,4 @@ int main(int argc, char *argv[])
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,917 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+
+using boost::asio::ip::tcp;
+
+// A TLS connection driven by OpenSSL directly on the socket, rather than
+// through boost::asio::ssl::stream, whose handshake cannot carry early data.
+class tls_connection
+{
+public:
+  typedef std::function<void(const boost::system::error_code &)> handler;
+
+  tls_connection(const tls_connection &) = delete;
+  tls_connection &operator=(const tls_connection &) = delete;
+
+  tls_connection(tcp::socket socket, SSL_CTX *context, boost::asio::ssl::stream_base::handshake_type type)
+      : socket_(std::move(socket)), ssl_(SSL_new(context))
+  {
+    boost::system::error_code ignored_ec;
+    socket_.non_blocking(true, ignored_ec);
+    socket_.set_option(tcp::no_delay(true), ignored_ec);
+    SSL_set_fd(ssl_, socket_.native_handle());
+    if (type == boost::asio::ssl::stream_base::client)
+    {
+      SSL_set_connect_state(ssl_);
+    }
+    else
+    {
+      SSL_set_accept_state(ssl_);
+    }
+  }
+
+  ~tls_connection()
+  {
+    SSL_free(ssl_);
+  }
+
+  SSL *native_handle()
+  {
+    return ssl_;
+  }
+
+  // Make an OpenSSL call until it succeeds, waiting for the socket whenever
+  // the call wants to read or write, then pass the outcome to done. The
+  // operation returns what the call returned.
+  void retry(std::function<int()> operation, handler done)
+  {
+    ERR_clear_error();
+    int result = operation();
+    if (result > 0)
+    {
+      done(boost::system::error_code());
+      return;
+    }
+
+    int error = SSL_get_error(ssl_, result);
+    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+    {
+      socket_.async_wait(error == SSL_ERROR_WANT_READ ? tcp::socket::wait_read : tcp::socket::wait_write,
+                         [this, operation, done](const boost::system::error_code &ec) {
+                           if (ec)
+                           {
+                             done(ec);
+                           }
+                           else
+                           {
+                             retry(operation, done);
+                           }
+                         });
+      return;
+    }
+    if (error == SSL_ERROR_ZERO_RETURN || (error == SSL_ERROR_SYSCALL && errno == 0))
+    {
+      done(boost::asio::error::eof);
+    }
+    else if (error == SSL_ERROR_SYSCALL)
+    {
+      done(boost::system::error_code(errno, boost::system::system_category()));
+    }
+    else
+    {
+      done(boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category()));
+    }
+  }
+
+private:
+  tcp::socket socket_;
+  SSL *ssl_;
+};
+
+// Remembers the ClientHello random of each connection whose early data was
+// accepted, so the same ClientHello replayed by an attacker has its early
+// data rejected. OpenSSL refuses early data whose ticket age is off by more
+// than ten seconds, so entries are needed only for that long. The cache
+// holds at most capacity entries and rejects early data when full, which
+// costs such clients a round trip but never admits a replay.
+class replay_cache
+{
+public:
+  replay_cache(std::size_t capacity, std::chrono::seconds window)
+      : capacity_(capacity), window_(window)
+  {
+  }
+
+  // Record key, returning false if it was seen within the window or there
+  // is no room for it.
+  bool insert(const std::string &key)
+  {
+    auto now = std::chrono::steady_clock::now();
+    while (!order_.empty() && now - order_.front().first > window_)
+    {
+      seen_.erase(order_.front().second);
+      order_.pop_front();
+    }
+    if (seen_.size() >= capacity_ || !seen_.insert(key).second)
+    {
+      return false;
+    }
+    order_.emplace_back(now, key);
+    return true;
+  }
+
+private:
+  std::size_t capacity_;
+  std::chrono::steady_clock::duration window_;
+  std::unordered_set<std::string> seen_;
+  std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> order_;
+};
+
+struct server_options
+{
+  std::string certificate = "server.pem";
+  std::string private_key = "server.pem";
+
+  // The routes whose requests are served from early data, before the
+  // handshake completes. Early data can be replayed, so only routes whose
+  // requests are safe to repeat belong here. Early data is refused if none.
+  std::set<std::string> early_routes;
+
+  // The most early data accepted on a connection.
+  std::uint32_t max_early_data = 16384;
+
+  // The ClientHellos remembered against replay.
+  std::size_t replay_cache_size = 100000;
+};
+
+// Answers each line "GET <route>" with "200 <route>". Requests arriving as
+// early data are answered at once if their route opted in, in the server's
+// first flight, or else once the handshake has confirmed the client.
+class server_session : public std::enable_shared_from_this<server_session>
+{
+public:
+  server_session(tcp::socket socket, SSL_CTX *context, const server_options &opts)
+      : connection_(std::move(socket), context, boost::asio::ssl::stream_base::server), options_(opts), served_early_(0), served_(0)
+  {
+  }
+
+  void start()
+  {
+    if (options_.early_routes.empty())
+    {
+      do_handshake();
+    }
+    else
+    {
+      do_read_early();
+    }
+  }
+
+private:
+  void do_read_early()
+  {
+    auto self(shared_from_this());
+    auto status = std::make_shared<int>(SSL_READ_EARLY_DATA_ERROR);
+    connection_.retry(
+        [this, status]() {
+          std::size_t length = 0;
+          *status = SSL_read_early_data(connection_.native_handle(), data_.data(), data_.size(), &length);
+          requests_.append(data_.data(), length);
+          return *status;
+        },
+        [this, self, status](const boost::system::error_code &ec) {
+          if (ec)
+          {
+            return;
+          }
+          if (*status == SSL_READ_EARLY_DATA_SUCCESS)
+          {
+            serve(true, [this]() { do_read_early(); });
+          }
+          else
+          {
+            do_handshake();
+          }
+        });
+  }
+
+  void do_handshake()
+  {
+    auto self(shared_from_this());
+    connection_.retry(
+        [this]() { return SSL_do_handshake(connection_.native_handle()); },
+        [this, self](const boost::system::error_code &ec) {
+          if (!ec)
+          {
+            serve(false, [this]() { do_read(); });
+          }
+        });
+  }
+
+  void do_read()
+  {
+    auto self(shared_from_this());
+    connection_.retry(
+        [this]() {
+          std::size_t length = 0;
+          int result = SSL_read_ex(connection_.native_handle(), data_.data(), data_.size(), &length);
+          requests_.append(data_.data(), length);
+          return result;
+        },
+        [this, self](const boost::system::error_code &ec) {
+          if (!ec)
+          {
+            serve(false, [this]() { do_read(); });
+          }
+          else if (ec == boost::asio::error::eof)
+          {
+            do_shutdown();
+          }
+        });
+  }
+
+  // Answer the complete requests received so far, then call next. In early
+  // data, a request for a route that has not opted in is left, with those
+  // after it, until the handshake completes.
+  void serve(bool early, std::function<void()> next)
+  {
+    std::size_t end = requests_.find('\n');
+    if (end == std::string::npos)
+    {
+      next();
+      return;
+    }
+    std::string request = requests_.substr(0, end);
+    std::string route = request.compare(0, 4, "GET ") == 0 ? request.substr(4) : request;
+    if (early && !options_.early_routes.count(route))
+    {
+      next();
+      return;
+    }
+    requests_.erase(0, end + 1);
+    ++(early ? served_early_ : served_);
+    response_ = "200 " + route + "\n";
+
+    auto self(shared_from_this());
+    connection_.retry(
+        [this, early]() {
+          std::size_t written = 0;
+          return early ? SSL_write_early_data(connection_.native_handle(), response_.data(), response_.size(), &written)
+                       : SSL_write_ex(connection_.native_handle(), response_.data(), response_.size(), &written);
+        },
+        [this, self, early, next](const boost::system::error_code &ec) {
+          if (!ec)
+          {
+            serve(early, next);
+          }
+        });
+  }
+
+  void do_shutdown()
+  {
+    static const char *status[] = {"not sent", "rejected", "accepted"};
+    std::cout << "Early data " << status[SSL_get_early_data_status(connection_.native_handle())] << ", "
+              << served_early_ << " served before the handshake completed, " << served_ << " after\n";
+
+    auto self(shared_from_this());
+    connection_.retry(
+        [this]() { return SSL_shutdown(connection_.native_handle()); },
+        [self](const boost::system::error_code & /*ec*/) {});
+  }
+
+  tls_connection connection_;
+  const server_options &options_;
+  std::array<char, 4096> data_;
+  std::string requests_;
+  std::string response_;
+  std::size_t served_early_;
+  std::size_t served_;
+};
+
+class server
+{
+public:
+  server(boost::asio::io_context &io_context, unsigned short port, const server_options &opts)
+      : context_(boost::asio::ssl::context::tls_server),
+        acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), options_(opts),
+        replay_cache_(opts.replay_cache_size, std::chrono::seconds(10))
+  {
+    context_.set_password_callback(std::bind(&server::get_password, this));
+    context_.use_certificate_chain_file(options_.certificate);
+    context_.use_private_key_file(options_.private_key, boost::asio::ssl::context::pem);
+
+    SSL_CTX *native = context_.native_handle();
+    SSL_CTX_set_min_proto_version(native, TLS1_3_VERSION);
+    if (!options_.early_routes.empty())
+    {
+      // Tickets issued from now on allow early data. OpenSSL's own defence
+      // against replay keeps every ticket in the session cache and allows it
+      // once; the replay cache instead keeps tickets stateless and reusable,
+      // in memory bounded by connection rate rather than tickets issued.
+      // Tickets promise max_early_data, and the server must then accept that
+      // much, beyond its default of 16384.
+      SSL_CTX_set_max_early_data(native, options_.max_early_data);
+      SSL_CTX_set_recv_max_early_data(native, options_.max_early_data);
+      SSL_CTX_set_options(native, SSL_OP_NO_ANTI_REPLAY);
+      SSL_CTX_set_allow_early_data_cb(native, &server::allow_early_data, &replay_cache_);
+    }
+
+    do_accept();
+  }
+
+private:
+  std::string get_password() const
+  {
+    return "test";
+  }
+
+  // Accept early data only from a ClientHello not seen before.
+  static int allow_early_data(SSL *ssl, void *arg)
+  {
+    unsigned char random[SSL3_RANDOM_SIZE];
+    std::size_t length = SSL_get_client_random(ssl, random, sizeof(random));
+    if (!static_cast<replay_cache *>(arg)->insert(std::string(reinterpret_cast<char *>(random), length)))
+    {
+      std::cout << "Early data refused: ClientHello replayed or replay cache full\n";
+      return 0;
+    }
+    return 1;
+  }
+
+  void do_accept()
+  {
+    acceptor_.async_accept(
+        [this](const boost::system::error_code &error, tcp::socket socket) {
+          if (!error)
+          {
+            std::make_shared<server_session>(std::move(socket), context_.native_handle(), options_)->start();
+          }
+
+          do_accept();
+        });
+  }
+
+  boost::asio::ssl::context context_;
+  tcp::acceptor acceptor_;
+  server_options options_;
+  replay_cache replay_cache_;
+};
+
+// What one run of the client has measured.
+struct client_tally
+{
+  std::size_t resumed = 0;
+  std::size_t early_accepted = 0;
+  std::size_t early_rejected = 0;
+  std::size_t failures = 0;
+  std::vector<std::chrono::steady_clock::duration> latencies;
+};
+
+// Makes one request on each of a series of connections, and measures the
+// time from connecting to the response. Each connection resumes the session
+// of the last, and with early data sends its request in the first flight,
+// sending it again after the handshake if the server rejected it.
+class client
+{
+public:
+  client(boost::asio::io_context &io_context, SSL_CTX *context, const tcp::resolver::results_type &endpoints,
+         const std::string &request, bool early, std::size_t connections)
+      : io_context_(io_context), context_(context), endpoints_(endpoints), request_(request),
+        early_(early), remaining_(connections), session_(nullptr), sent_early_(false)
+  {
+    // The newest session is kept here; TLS 1.3 sends it after the handshake.
+    SSL_CTX_set_session_cache_mode(context_, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(context_, &client::save_session);
+    SSL_CTX_set_ex_data(context_, client_index(), this);
+    do_connect();
+  }
+
+  ~client()
+  {
+    if (session_)
+    {
+      SSL_SESSION_free(session_);
+    }
+  }
+
+  const client_tally &result() const
+  {
+    return tally_;
+  }
+
+private:
+  // The context's app data belongs to boost::asio::ssl::context.
+  static int client_index()
+  {
+    static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+  }
+
+  static int save_session(SSL *ssl, SSL_SESSION *session)
+  {
+    auto *self = static_cast<client *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), client_index()));
+    if (self->session_)
+    {
+      SSL_SESSION_free(self->session_);
+    }
+    self->session_ = session;
+    return 1;
+  }
+
+  void do_connect()
+  {
+    connection_.reset();
+    if (remaining_ == 0)
+    {
+      return;
+    }
+    --remaining_;
+
+    start_ = std::chrono::steady_clock::now();
+    socket_.reset(new tcp::socket(io_context_));
+    boost::asio::async_connect(*socket_, endpoints_,
+                               [this](const boost::system::error_code &error, const tcp::endpoint & /*endpoint*/) {
+                                 if (error)
+                                 {
+                                   fail(error);
+                                   return;
+                                 }
+                                 connection_.reset(new tls_connection(std::move(*socket_), context_, boost::asio::ssl::stream_base::client));
+                                 response_.clear();
+                                 sent_early_ = false;
+                                 if (session_)
+                                 {
+                                   SSL_set_session(connection_->native_handle(), session_);
+                                 }
+                                 if (early_ && session_ && SSL_SESSION_get_max_early_data(session_) >= request_.size())
+                                 {
+                                   do_write_early();
+                                 }
+                                 else
+                                 {
+                                   do_handshake();
+                                 }
+                               });
+  }
+
+  void do_write_early()
+  {
+    connection_->retry(
+        [this]() {
+          std::size_t written = 0;
+          return SSL_write_early_data(connection_->native_handle(), request_.data(), request_.size(), &written);
+        },
+        [this](const boost::system::error_code &error) {
+          if (error)
+          {
+            fail(error);
+            return;
+          }
+          sent_early_ = true;
+          do_handshake();
+        });
+  }
+
+  void do_handshake()
+  {
+    connection_->retry(
+        [this]() { return SSL_do_handshake(connection_->native_handle()); },
+        [this](const boost::system::error_code &error) {
+          if (error)
+          {
+            fail(error);
+            return;
+          }
+          SSL *ssl = connection_->native_handle();
+          if (SSL_session_reused(ssl))
+          {
+            ++tally_.resumed;
+          }
+          if (sent_early_ && SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED)
+          {
+            ++tally_.early_accepted;
+            do_read();
+            return;
+          }
+          if (sent_early_)
+          {
+            ++tally_.early_rejected;
+          }
+          do_write();
+        });
+  }
+
+  void do_write()
+  {
+    connection_->retry(
+        [this]() {
+          std::size_t written = 0;
+          return SSL_write_ex(connection_->native_handle(), request_.data(), request_.size(), &written);
+        },
+        [this](const boost::system::error_code &error) {
+          if (error)
+          {
+            fail(error);
+            return;
+          }
+          do_read();
+        });
+  }
+
+  void do_read()
+  {
+    connection_->retry(
+        [this]() {
+          std::size_t length = 0;
+          int result = SSL_read_ex(connection_->native_handle(), data_.data(), data_.size(), &length);
+          response_.append(data_.data(), length);
+          return result;
+        },
+        [this](const boost::system::error_code &error) {
+          if (error)
+          {
+            fail(error);
+          }
+          else if (response_.find('\n') == std::string::npos)
+          {
+            do_read();
+          }
+          else
+          {
+            tally_.latencies.push_back(std::chrono::steady_clock::now() - start_);
+            do_shutdown();
+          }
+        });
+  }
+
+  // Close the connection in both directions, reading the session tickets
+  // that arrive before the server's close_notify.
+  void do_shutdown()
+  {
+    connection_->retry(
+        [this]() {
+          int result = SSL_shutdown(connection_->native_handle());
+          if (result == 0)
+          {
+            std::size_t length = 0;
+            return SSL_read_ex(connection_->native_handle(), data_.data(), data_.size(), &length);
+          }
+          return result;
+        },
+        [this](const boost::system::error_code & /*error*/) {
+          next();
+        });
+  }
+
+  void fail(const boost::system::error_code &error)
+  {
+    if (tally_.failures++ == 0)
+    {
+      std::cerr << "Connection failed: " << error.message() << "\n";
+    }
+    next();
+  }
+
+  // Start the next connection once the handler that used this one returns.
+  void next()
+  {
+    boost::asio::post(io_context_, [this]() {
+      do_connect();
+    });
+  }
+
+  boost::asio::io_context &io_context_;
+  SSL_CTX *context_;
+  const tcp::resolver::results_type &endpoints_;
+  const std::string &request_;
+  bool early_;
+  std::size_t remaining_;
+  SSL_SESSION *session_;
+  bool sent_early_;
+  std::unique_ptr<tcp::socket> socket_;
+  std::unique_ptr<tls_connection> connection_;
+  std::chrono::steady_clock::time_point start_;
+  std::array<char, 4096> data_;
+  std::string response_;
+  client_tally tally_;
+};
+
+// One direction of a relayed connection: what arrives on from is written to
+// to once delay has passed, while reading continues, as over a link with
+// that one-way latency.
+struct relay_direction
+{
+  relay_direction(tcp::socket &from_socket, tcp::socket &to_socket)
+      : from(from_socket), to(to_socket), timer(from_socket.get_executor()), writing(false), closed(false)
+  {
+  }
+
+  tcp::socket &from;
+  tcp::socket &to;
+  boost::asio::steady_timer timer;
+  std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> pending;
+  bool writing;
+  bool closed;
+  std::array<char, 16384> data;
+};
+
+// Relays a client's connection to the server with delay added each way.
+class relay_connection : public std::enable_shared_from_this<relay_connection>
+{
+public:
+  relay_connection(tcp::socket client, boost::asio::io_context &io_context, std::chrono::milliseconds delay)
+      : client_(std::move(client)), server_(io_context), delay_(delay), upstream_(client_, server_),
+        downstream_(server_, client_)
+  {
+  }
+
+  void start(const tcp::resolver::results_type &endpoints)
+  {
+    auto self(shared_from_this());
+    boost::asio::async_connect(server_, endpoints,
+                               [this, self](const boost::system::error_code &error, const tcp::endpoint & /*endpoint*/) {
+                                 if (error)
+                                 {
+                                   return;
+                                 }
+                                 boost::system::error_code ignored_ec;
+                                 client_.set_option(tcp::no_delay(true), ignored_ec);
+                                 server_.set_option(tcp::no_delay(true), ignored_ec);
+                                 do_read(upstream_);
+                                 do_read(downstream_);
+                               });
+  }
+
+private:
+  void do_read(relay_direction &direction)
+  {
+    auto self(shared_from_this());
+    direction.from.async_read_some(boost::asio::buffer(direction.data),
+                                   [this, self, &direction](const boost::system::error_code &error, std::size_t length) {
+                                     if (error)
+                                     {
+                                       direction.closed = true;
+                                     }
+                                     else
+                                     {
+                                       direction.pending.emplace_back(std::chrono::steady_clock::now() + delay_,
+                                                                      std::string(direction.data.data(), length));
+                                       do_read(direction);
+                                     }
+                                     if (!direction.writing)
+                                     {
+                                       do_write(direction);
+                                     }
+                                   });
+  }
+
+  void do_write(relay_direction &direction)
+  {
+    if (direction.pending.empty())
+    {
+      direction.writing = false;
+      if (direction.closed)
+      {
+        boost::system::error_code ignored_ec;
+        direction.to.shutdown(tcp::socket::shutdown_send, ignored_ec);
+      }
+      return;
+    }
+
+    direction.writing = true;
+    auto self(shared_from_this());
+    direction.timer.expires_at(direction.pending.front().first);
+    direction.timer.async_wait([this, self, &direction](const boost::system::error_code & /*error*/) {
+      boost::asio::async_write(direction.to, boost::asio::buffer(direction.pending.front().second),
+                               [this, self, &direction](const boost::system::error_code &error, std::size_t /*length*/) {
+                                 direction.pending.pop_front();
+                                 if (error)
+                                 {
+                                   direction.pending.clear();
+                                 }
+                                 do_write(direction);
+                               });
+    });
+  }
+
+  tcp::socket client_;
+  tcp::socket server_;
+  std::chrono::milliseconds delay_;
+  relay_direction upstream_;
+  relay_direction downstream_;
+};
+
+class relay
+{
+public:
+  relay(boost::asio::io_context &io_context, unsigned short port, const tcp::resolver::results_type &endpoints,
+        std::chrono::milliseconds delay)
+      : io_context_(io_context), acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), endpoints_(endpoints),
+        delay_(delay)
+  {
+    do_accept();
+  }
+
+private:
+  void do_accept()
+  {
+    acceptor_.async_accept(
+        [this](const boost::system::error_code &error, tcp::socket socket) {
+          if (!error)
+          {
+            std::make_shared<relay_connection>(std::move(socket), io_context_, delay_)->start(endpoints_);
+          }
+
+          do_accept();
+        });
+  }
+
+  boost::asio::io_context &io_context_;
+  tcp::acceptor acceptor_;
+  tcp::resolver::results_type endpoints_;
+  std::chrono::milliseconds delay_;
+};
+
+// Return the value of a "--name=value" argument, or null if arg is not name.
+const char *option_value(const char *arg, const char *name)
+{
+  std::size_t length = std::strlen(name);
+  if (std::strncmp(arg, name, length) == 0 && arg[length] == '=')
+  {
+    return arg + length + 1;
+  }
+  return nullptr;
+}
+
+// Run one client over the given connections and print what it measured.
+void run_client(const char *name, const tcp::resolver::results_type &endpoints, const std::string &request,
+                bool early, std::size_t connections)
+{
+  boost::asio::io_context io_context;
+  boost::asio::ssl::context context(boost::asio::ssl::context::tls_client);
+  SSL_CTX_set_min_proto_version(context.native_handle(), TLS1_3_VERSION);
+
+  // Only latency is measured, so the server is not authenticated.
+  context.set_verify_mode(boost::asio::ssl::verify_none);
+
+  client c(io_context, context.native_handle(), endpoints, request, early, connections);
+  io_context.run();
+
+  client_tally tally = c.result();
+  std::sort(tally.latencies.begin(), tally.latencies.end());
+  double total_ms = 0;
+  for (auto latency : tally.latencies)
+  {
+    total_ms += std::chrono::duration<double, std::milli>(latency).count();
+  }
+  double median_ms = tally.latencies.empty()
+                         ? 0
+                         : std::chrono::duration<double, std::milli>(tally.latencies[tally.latencies.size() / 2]).count();
+  std::cout << std::fixed << std::setprecision(2) << std::left << std::setw(18) << name << std::right
+            << std::setw(5) << tally.latencies.size() << " requests" << std::setw(5) << tally.resumed << " resumed"
+            << std::setw(5) << tally.early_accepted << " early" << std::setw(5) << tally.early_rejected
+            << " rejected" << std::setw(9) << (tally.latencies.empty() ? 0 : total_ms / tally.latencies.size())
+            << " ms mean" << std::setw(9) << median_ms << " ms p50" << std::setw(4) << tally.failures
+            << " failed\n";
+}
+
+int main(int argc, char *argv[])
+{
+  try
+  {
+    std::string mode = argc > 1 ? argv[1] : "";
+    if ((mode != "server" || argc < 3) && (mode != "client" || argc < 4) && (mode != "relay" || argc < 5))
+    {
+      std::cerr << "Usage: early_data server <port> [options]\n";
+      std::cerr << "         Answers \"GET <route>\" lines, from early data for routes opted in.\n";
+      std::cerr << "         --early-routes=<a,b>     routes safe to serve from replayable early data;\n";
+      std::cerr << "                                  early data is refused if none\n";
+      std::cerr << "         --max-early-data=<n>     bytes of early data accepted (default 16384)\n";
+      std::cerr << "         --replay-cache=<n>       ClientHellos remembered against replay\n";
+      std::cerr << "         --certificate=<pem>      certificate chain (default server.pem)\n";
+      std::cerr << "         --private-key=<pem>      its private key (default server.pem)\n";
+      std::cerr << "       early_data client <host> <port> [options]\n";
+      std::cerr << "         Times requests on resumed connections, without and with early data.\n";
+      std::cerr << "         --route=<route>          route requested (default /)\n";
+      std::cerr << "         --connections=<n>        connections in each run (default 20)\n";
+      std::cerr << "       early_data relay <port> <host> <port> [options]\n";
+      std::cerr << "         Relays connections to host and port, adding delay each way.\n";
+      std::cerr << "         --delay=<ms>             one-way delay (default 25)\n";
+      return 1;
+    }
+
+    boost::asio::io_context io_context;
+    tcp::resolver resolver(io_context);
+
+    if (mode == "server")
+    {
+      server_options opts;
+      for (int i = 3; i < argc; ++i)
+      {
+        const char *value = nullptr;
+        if ((value = option_value(argv[i], "--early-routes")))
+        {
+          std::string list = value;
+          for (std::size_t start = 0, end = 0; start < list.size(); start = end + 1)
+          {
+            end = std::min(list.find(',', start), list.size());
+            opts.early_routes.insert(list.substr(start, end - start));
+          }
+        }
+        else if ((value = option_value(argv[i], "--max-early-data")))
+        {
+          opts.max_early_data = std::strtoul(value, nullptr, 10);
+        }
+        else if ((value = option_value(argv[i], "--replay-cache")))
+        {
+          opts.replay_cache_size = std::strtoul(value, nullptr, 10);
+        }
+        else if ((value = option_value(argv[i], "--certificate")))
+        {
+          opts.certificate = value;
+        }
+        else if ((value = option_value(argv[i], "--private-key")))
+        {
+          opts.private_key = value;
+        }
+        else
+        {
+          std::cerr << "Unknown option: " << argv[i] << "\n";
+          return 1;
+        }
+      }
+
+      server s(io_context, std::atoi(argv[2]), opts);
+      io_context.run();
+    }
+    else if (mode == "client")
+    {
+      std::string route = "/";
+      std::size_t connections = 20;
+      for (int i = 4; i < argc; ++i)
+      {
+        const char *value = nullptr;
+        if ((value = option_value(argv[i], "--route")))
+        {
+          route = value;
+        }
+        else if ((value = option_value(argv[i], "--connections")))
+        {
+          connections = std::strtoul(value, nullptr, 10);
+        }
+        else
+        {
+          std::cerr << "Unknown option: " << argv[i] << "\n";
+          return 1;
+        }
+      }
+
+      auto endpoints = resolver.resolve(argv[2], argv[3]);
+      std::string request = "GET " + route + "\n";
+      run_client("without early data", endpoints, request, false, connections);
+      run_client("with early data", endpoints, request, true, connections);
+    }
+    else
+    {
+      std::chrono::milliseconds delay(25);
+      for (int i = 5; i < argc; ++i)
+      {
+        const char *value = nullptr;
+        if ((value = option_value(argv[i], "--delay")))
+        {
+          delay = std::chrono::milliseconds(std::atol(value));
+        }
+        else
+        {
+          std::cerr << "Unknown option: " << argv[i] << "\n";
+          return 1;
+        }
+      }
+
+      relay r(io_context, std::atoi(argv[2]), resolver.resolve(argv[3], argv[4]), delay);
+      io_context.run();
+    }
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Exception: " << e.what() << "\n";
+  }
+
+  return 0;
+}
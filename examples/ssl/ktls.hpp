@@ -0,0 +1,429 @@
+#ifndef KTLS_HPP
+#define KTLS_HPP
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#if defined(__linux__)
+#include <arpa/inet.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Kernel TLS. Once OpenSSL has completed a handshake, the keys of the record
+// layer are handed to the kernel, which from then on encrypts what is written
+// to the socket and decrypts what is read from it. Data then moves with plain
+// reads and writes, or sendfile, without passing through user space buffers
+// for encryption. Connections the kernel cannot take over are left to
+// OpenSSL.
+namespace ktls
+{
+
+// The key, IV and next record sequence number for one direction.
+struct record_keys
+{
+  std::vector<unsigned char> key;
+  std::vector<unsigned char> iv;
+  std::uint64_t sequence = 0;
+};
+
+// Collects during the handshake what OpenSSL does not expose afterwards: the
+// TLS 1.3 application traffic secrets, and how many records the server has
+// already sent under them.
+class key_capture
+{
+public:
+  key_capture(const key_capture &) = delete;
+  key_capture &operator=(const key_capture &) = delete;
+
+  key_capture() = default;
+
+  ~key_capture()
+  {
+    clear();
+  }
+
+  // Install the key log callback on a context, before its first handshake.
+  static void install(SSL_CTX *ctx)
+  {
+    SSL_CTX_set_keylog_callback(ctx, &key_capture::keylog_callback);
+  }
+
+  // Collect for a connection about to perform its handshake.
+  void attach(SSL *ssl)
+  {
+    SSL_set_ex_data(ssl, index(), this);
+    SSL_set_msg_callback(ssl, &key_capture::message_callback);
+    SSL_set_msg_callback_arg(ssl, this);
+  }
+
+  // Stop collecting, and forget the secrets.
+  void detach(SSL *ssl)
+  {
+    SSL_set_msg_callback(ssl, nullptr);
+    SSL_set_ex_data(ssl, index(), nullptr);
+    clear();
+  }
+
+  std::vector<unsigned char> client_secret;
+  std::vector<unsigned char> server_secret;
+
+  // The session tickets sent after a TLS 1.3 handshake, one record each.
+  std::uint64_t tickets_sent = 0;
+
+private:
+  void clear()
+  {
+    OPENSSL_cleanse(client_secret.data(), client_secret.size());
+    OPENSSL_cleanse(server_secret.data(), server_secret.size());
+    client_secret.clear();
+    server_secret.clear();
+  }
+
+  static int index()
+  {
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+  }
+
+  // Lines look like "SERVER_TRAFFIC_SECRET_0 <client random> <secret>".
+  static void keylog_callback(const SSL *ssl, const char *line)
+  {
+    key_capture *self = static_cast<key_capture *>(SSL_get_ex_data(ssl, index()));
+    if (!self)
+    {
+      return;
+    }
+
+    std::vector<unsigned char> *secret = nullptr;
+    if (std::strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0)
+    {
+      secret = &self->client_secret;
+    }
+    else if (std::strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0)
+    {
+      secret = &self->server_secret;
+    }
+    else
+    {
+      return;
+    }
+
+    const char *hex = std::strrchr(line, ' ') + 1;
+    secret->clear();
+    for (; hex[0] && hex[1]; hex += 2)
+    {
+      char byte[3] = {hex[0], hex[1], 0};
+      secret->push_back(static_cast<unsigned char>(std::strtoul(byte, nullptr, 16)));
+    }
+  }
+
+  static void message_callback(int write_p, int version, int content_type, const void *buf,
+                               std::size_t len, SSL * /*ssl*/, void *arg)
+  {
+    const unsigned char *message = static_cast<const unsigned char *>(buf);
+    if (write_p && version == TLS1_3_VERSION && content_type == SSL3_RT_HANDSHAKE && len > 0 &&
+        message[0] == SSL3_MT_NEWSESSION_TICKET)
+    {
+      ++static_cast<key_capture *>(arg)->tickets_sent;
+    }
+  }
+};
+
+namespace detail
+{
+
+// HKDF-Expand-Label from RFC 8446, with an empty context.
+inline bool expand_label(const EVP_MD *md, const std::vector<unsigned char> &secret, const std::string &label,
+                         std::size_t length, std::vector<unsigned char> &out)
+{
+  std::string full_label = "tls13 " + label;
+  std::vector<unsigned char> info;
+  info.push_back(static_cast<unsigned char>(length >> 8));
+  info.push_back(static_cast<unsigned char>(length));
+  info.push_back(static_cast<unsigned char>(full_label.size()));
+  info.insert(info.end(), full_label.begin(), full_label.end());
+  info.push_back(0);
+
+  out.resize(length);
+  std::size_t out_length = length;
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+  bool ok = ctx && EVP_PKEY_derive_init(ctx) > 0 &&
+            EVP_PKEY_CTX_hkdf_mode(ctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+            EVP_PKEY_CTX_set_hkdf_md(ctx, md) > 0 &&
+            EVP_PKEY_CTX_set1_hkdf_key(ctx, secret.data(), static_cast<int>(secret.size())) > 0 &&
+            EVP_PKEY_CTX_add1_hkdf_info(ctx, info.data(), static_cast<int>(info.size())) > 0 &&
+            EVP_PKEY_derive(ctx, out.data(), &out_length) > 0;
+  EVP_PKEY_CTX_free(ctx);
+  return ok && out_length == length;
+}
+
+// The TLS 1.2 key block, from the master secret and both randoms.
+inline bool key_block(SSL *ssl, const EVP_MD *md, std::size_t length, std::vector<unsigned char> &out)
+{
+  unsigned char master[SSL_MAX_MASTER_KEY_LENGTH];
+  std::size_t master_length = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+  unsigned char client_random[SSL3_RANDOM_SIZE];
+  unsigned char server_random[SSL3_RANDOM_SIZE];
+  SSL_get_client_random(ssl, client_random, sizeof(client_random));
+  SSL_get_server_random(ssl, server_random, sizeof(server_random));
+
+  static const unsigned char label[] = "key expansion";
+  out.resize(length);
+  std::size_t out_length = length;
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr);
+  bool ok = ctx && EVP_PKEY_derive_init(ctx) > 0 && EVP_PKEY_CTX_set_tls1_prf_md(ctx, md) > 0 &&
+            EVP_PKEY_CTX_set1_tls1_prf_secret(ctx, master, static_cast<int>(master_length)) > 0 &&
+            EVP_PKEY_CTX_add1_tls1_prf_seed(ctx, label, sizeof(label) - 1) > 0 &&
+            EVP_PKEY_CTX_add1_tls1_prf_seed(ctx, server_random, sizeof(server_random)) > 0 &&
+            EVP_PKEY_CTX_add1_tls1_prf_seed(ctx, client_random, sizeof(client_random)) > 0 &&
+            EVP_PKEY_derive(ctx, out.data(), &out_length) > 0;
+  EVP_PKEY_CTX_free(ctx);
+  OPENSSL_cleanse(master, sizeof(master));
+  return ok && out_length == length;
+}
+
+} // namespace detail
+
+// Derive the record keys of the server side of an established connection.
+// Returns false for protocol versions and ciphers other than TLS 1.2 and 1.3
+// with AES-GCM or ChaCha20-Poly1305.
+inline bool derive_server_keys(SSL *ssl, const key_capture &capture, record_keys &tx, record_keys &rx)
+{
+  const SSL_CIPHER *cipher = SSL_get_current_cipher(ssl);
+  const EVP_MD *md = cipher ? SSL_CIPHER_get_handshake_digest(cipher) : nullptr;
+  if (!md)
+  {
+    return false;
+  }
+
+  std::size_t key_length = 0;
+  bool gcm = true;
+  switch (SSL_CIPHER_get_cipher_nid(cipher))
+  {
+  case NID_aes_128_gcm:
+    key_length = 16;
+    break;
+  case NID_aes_256_gcm:
+    key_length = 32;
+    break;
+  case NID_chacha20_poly1305:
+    key_length = 32;
+    gcm = false;
+    break;
+  default:
+    return false;
+  }
+
+  if (SSL_version(ssl) == TLS1_3_VERSION)
+  {
+    // The server has sent its tickets under its traffic key, and the client
+    // nothing yet under its own.
+    if (capture.client_secret.empty() || capture.server_secret.empty())
+    {
+      return false;
+    }
+    tx.sequence = capture.tickets_sent;
+    rx.sequence = 0;
+    return detail::expand_label(md, capture.server_secret, "key", key_length, tx.key) &&
+           detail::expand_label(md, capture.server_secret, "iv", 12, tx.iv) &&
+           detail::expand_label(md, capture.client_secret, "key", key_length, rx.key) &&
+           detail::expand_label(md, capture.client_secret, "iv", 12, rx.iv);
+  }
+
+  if (SSL_version(ssl) == TLS1_2_VERSION)
+  {
+    // Each side's Finished was the first record under the new keys. AES-GCM
+    // takes only the 4 byte implicit part of its nonce from the key block.
+    std::size_t iv_length = gcm ? 4 : 12;
+    std::vector<unsigned char> block;
+    if (!detail::key_block(ssl, md, 2 * (key_length + iv_length), block))
+    {
+      return false;
+    }
+    const unsigned char *p = block.data();
+    rx.key.assign(p, p + key_length);
+    tx.key.assign(p + key_length, p + 2 * key_length);
+    rx.iv.assign(p + 2 * key_length, p + 2 * key_length + iv_length);
+    tx.iv.assign(p + 2 * key_length + iv_length, p + 2 * (key_length + iv_length));
+    tx.sequence = 1;
+    rx.sequence = 1;
+    OPENSSL_cleanse(block.data(), block.size());
+    return true;
+  }
+
+  return false;
+}
+
+enum result
+{
+  // The kernel now handles the records in both directions.
+  enabled,
+
+  // The connection is unchanged, and stays with OpenSSL.
+  unsupported,
+
+  // The kernel took over sending but not receiving, and the connection can
+  // no longer be used.
+  failed
+};
+
+#if defined(__linux__)
+
+namespace detail
+{
+
+union crypto_info
+{
+  tls_crypto_info info;
+  tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+  tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+  tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+};
+
+template <typename Info>
+socklen_t fill(Info &info, int version, int cipher_type, const record_keys &keys)
+{
+  std::memset(&info, 0, sizeof(info));
+  info.info.version = static_cast<__u16>(version);
+  info.info.cipher_type = static_cast<__u16>(cipher_type);
+  std::memcpy(info.key, keys.key.data(), sizeof(info.key));
+
+  unsigned char sequence[8];
+  for (int i = 0; i < 8; ++i)
+  {
+    sequence[i] = static_cast<unsigned char>(keys.sequence >> (56 - 8 * i));
+  }
+  std::memcpy(info.rec_seq, sequence, sizeof(info.rec_seq));
+
+  if (sizeof(info.salt) == 0)
+  {
+    // ChaCha20-Poly1305 takes its whole nonce as the IV.
+    std::memcpy(info.iv, keys.iv.data(), sizeof(info.iv));
+  }
+  else
+  {
+    // AES-GCM splits the nonce into a salt and the rest. The rest of a TLS
+    // 1.2 nonce is sent with each record, and is chosen by the sender.
+    std::memcpy(info.salt, keys.iv.data(), sizeof(info.salt));
+    if (version == TLS_1_3_VERSION)
+    {
+      std::memcpy(info.iv, keys.iv.data() + sizeof(info.salt), sizeof(info.iv));
+    }
+    else
+    {
+      std::memcpy(info.iv, sequence, sizeof(info.iv));
+    }
+  }
+  return sizeof(info);
+}
+
+inline socklen_t fill(crypto_info &info, SSL *ssl, const record_keys &keys)
+{
+  int version = SSL_version(ssl) == TLS1_3_VERSION ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+  switch (SSL_CIPHER_get_cipher_nid(SSL_get_current_cipher(ssl)))
+  {
+  case NID_aes_128_gcm:
+    return fill(info.aes_gcm_128, version, TLS_CIPHER_AES_GCM_128, keys);
+  case NID_aes_256_gcm:
+    return fill(info.aes_gcm_256, version, TLS_CIPHER_AES_GCM_256, keys);
+  default:
+    return fill(info.chacha20_poly1305, version, TLS_CIPHER_CHACHA20_POLY1305, keys);
+  }
+}
+
+} // namespace detail
+
+// Whether the kernel offers TLS at all, checked once on a loopback
+// connection.
+inline bool available()
+{
+  static const bool available = [] {
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    int client = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    bool ok = listener >= 0 && client >= 0 &&
+              ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0 &&
+              ::listen(listener, 1) == 0 &&
+              ::getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length) == 0 &&
+              ::connect(client, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0 &&
+              ::setsockopt(client, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+    if (listener >= 0)
+    {
+      ::close(listener);
+    }
+    if (client >= 0)
+    {
+      ::close(client);
+    }
+    return ok;
+  }();
+  return available;
+}
+
+// Hand the record layer of an established server connection on descriptor
+// to the kernel. OpenSSL must hold no data that is still to be sent or has
+// been received but not yet read, so this is done straight after the
+// handshake.
+inline result enable(int descriptor, SSL *ssl, const key_capture &capture)
+{
+  if (!available() || SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0 ||
+      BIO_ctrl_wpending(SSL_get_wbio(ssl)) > 0)
+  {
+    return unsupported;
+  }
+
+  record_keys tx;
+  record_keys rx;
+  if (!derive_server_keys(ssl, capture, tx, rx))
+  {
+    return unsupported;
+  }
+
+  detail::crypto_info tx_info;
+  detail::crypto_info rx_info;
+  socklen_t tx_length = detail::fill(tx_info, ssl, tx);
+  socklen_t rx_length = detail::fill(rx_info, ssl, rx);
+  OPENSSL_cleanse(tx.key.data(), tx.key.size());
+  OPENSSL_cleanse(rx.key.data(), rx.key.size());
+
+  result r = unsupported;
+  if (::setsockopt(descriptor, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 &&
+      ::setsockopt(descriptor, SOL_TLS, TLS_TX, &tx_info, tx_length) == 0)
+  {
+    r = ::setsockopt(descriptor, SOL_TLS, TLS_RX, &rx_info, rx_length) == 0 ? enabled : failed;
+  }
+  OPENSSL_cleanse(&tx_info, sizeof(tx_info));
+  OPENSSL_cleanse(&rx_info, sizeof(rx_info));
+  return r;
+}
+
+#else // defined(__linux__)
+
+inline bool available()
+{
+  return false;
+}
+
+inline result enable(int /*descriptor*/, SSL * /*ssl*/, const key_capture & /*capture*/)
+{
+  return unsupported;
+}
+
+#endif // defined(__linux__)
+
+} // namespace ktls
+
+#endif // KTLS_HPP
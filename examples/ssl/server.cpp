@@ -1,80 +1,393 @@
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
+#include "ktls.hpp"
 
 using boost::asio::ip::tcp;
 
+struct server_options
+{
+  // The PEM files holding the certificate chain and its private key.
+  std::string certificate = "server.pem";
+  std::string private_key = "server.pem";
+
+  // The threads performing handshakes.
+  std::size_t handshake_threads = 1;
+
+  // The threads moving data for established sessions, each on its own.
+  std::size_t io_threads = 1;
+
+  // The most handshakes in progress at once. Beyond it the server stops
+  // accepting, and new connections wait in the listen backlog.
+  std::size_t max_handshakes = 256;
+
+  // The seconds a client is given to complete its handshake.
+  long handshake_timeout = 10;
+
+  // The seconds between printed metrics, 0 for none.
+  long stats_interval = 0;
+
+  // Hand the record layer of established sessions to the kernel, where it
+  // supports the negotiated cipher.
+  bool ktls = false;
+
+  // A file sent to each client in place of the echo, empty to echo.
+  std::string send_file;
+
+  // The bytes read or written by a session at once.
+  std::size_t buffer_size = 16384;
+
+  // The bytes a session sends in small records before switching to full
+  // 16 KB records, 0 for full records throughout. Small records only help a
+  // client on a lossy or slow path, and cost throughput, so they are opt-in.
+  std::size_t record_ramp = 0;
+};
+
+// Counters shared by the acceptor, the handshake pool and the I/O workers.
+struct metrics
+{
+  std::atomic<std::size_t> accepted{0};
+  std::atomic<std::size_t> handshakes{0};
+  std::atomic<std::size_t> handshake_failures{0};
+  std::atomic<std::size_t> handshake_timeouts{0};
+  std::atomic<std::uint64_t> handshake_microseconds{0};
+  std::atomic<std::size_t> accept_pauses{0};
+  std::atomic<std::size_t> ktls_sessions{0};
+  std::atomic<std::size_t> ktls_fallbacks{0};
+};
+
+// A thread running the data path of the sessions handed to it, which never
+// waits behind a handshake.
+struct io_worker
+{
+  boost::asio::thread_pool thread{1};
+  std::atomic<std::size_t> sessions{0};
+};
+
+// A record this small, with its framing, fits in one TCP segment on a path
+// with a 1500 byte MTU, so the client can decrypt it as soon as it arrives.
+const std::size_t small_record_size = 1360;
+
+// After this long without writing, a session returns to small records, since
+// its congestion window has likely shrunk.
+const std::chrono::seconds record_ramp_idle(1);
+
 class session : public std::enable_shared_from_this<session>
 {
 public:
-  session(tcp::socket socket, boost::asio::ssl::context &context)
-      : socket_(std::move(socket), context)
+  typedef std::function<void(std::shared_ptr<session>, const boost::system::error_code &)> handshake_handler;
+
+  session(tcp::socket socket, boost::asio::ssl::context &context, const server_options &opts)
+      : socket_(std::move(socket), context), handshake_timer_(socket_.get_executor()),
+        timed_out_(false), worker_(nullptr), options_(opts), ktls_(false), file_(-1),
+        file_offset_(0), file_size_(0), data_(opts.buffer_size), ramp_sent_(0),
+        record_size_(SSL3_RT_MAX_PLAIN_LENGTH)
   {
+    if (options_.ktls)
+    {
+      keys_.attach(socket_.native_handle());
+    }
   }
 
-  void start()
+  ~session()
   {
-    do_handshake();
+    if (worker_)
+    {
+      --worker_->sessions;
+    }
+    if (file_ >= 0)
+    {
+      ::close(file_);
+    }
   }
 
-private:
-  void do_handshake()
+  // Perform the handshake on the executor the socket was accepted with,
+  // closing the connection if it takes longer than timeout.
+  void handshake(std::chrono::steady_clock::duration timeout, handshake_handler handler)
   {
     auto self(shared_from_this());
-    socket_.async_handshake(boost::asio::ssl::stream_base::server,
-                            [this, self](const boost::system::error_code &error) {
-                              if (!error)
-                              {
-                                do_read();
-                              }
-                            });
+    boost::asio::dispatch(socket_.get_executor(), [this, self, timeout, handler]() {
+      handshake_timer_.expires_after(timeout);
+      handshake_timer_.async_wait([this, self](const boost::system::error_code &error) {
+        if (!error)
+        {
+          timed_out_ = true;
+          boost::system::error_code ignored_ec;
+          socket_.lowest_layer().close(ignored_ec);
+        }
+      });
+
+      socket_.async_handshake(boost::asio::ssl::stream_base::server,
+                              [this, self, handler](const boost::system::error_code &error) {
+                                handshake_timer_.cancel();
+                                handler(self, timed_out_ ? boost::asio::error::timed_out : error);
+                              });
+    });
+  }
+
+  // Give the record layer to the kernel, now that the handshake is done.
+  ktls::result enable_ktls()
+  {
+    ktls::result result = ktls::enable(socket_.next_layer().native_handle(), socket_.native_handle(), keys_);
+    keys_.detach(socket_.native_handle());
+    ktls_ = result == ktls::enabled;
+    return result;
+  }
+
+  // Move the connection to the worker's thread and echo there. The TLS
+  // state stays with the stream; only the socket is registered anew. The
+  // stream's internal timers stay with the handshake pool, but they are only
+  // waited on when a read and a write are outstanding together, which an
+  // echo never does.
+  void start(io_worker &worker)
+  {
+    boost::system::error_code ec;
+    tcp::socket &socket = socket_.next_layer();
+    tcp::endpoint local = socket.local_endpoint(ec);
+    tcp::socket::native_handle_type descriptor = socket.release(ec);
+    if (ec)
+    {
+      return;
+    }
+    tcp::socket moved(worker.thread);
+    moved.assign(local.protocol(), descriptor, ec);
+    if (ec)
+    {
+      return;
+    }
+    socket = std::move(moved);
+
+    worker_ = &worker;
+    ++worker.sessions;
+    auto self(shared_from_this());
+    boost::asio::post(worker.thread, [this, self]() {
+      if (options_.send_file.empty())
+      {
+        do_read();
+      }
+      else
+      {
+        do_send_file();
+      }
+    });
+  }
+
+private:
+  // Read from the client, through OpenSSL unless the kernel handles TLS.
+  template <typename MutableBufferSequence, typename ReadHandler>
+  void async_read_some(const MutableBufferSequence &buffers, ReadHandler &&handler)
+  {
+    if (ktls_)
+    {
+      socket_.next_layer().async_read_some(buffers, std::forward<ReadHandler>(handler));
+    }
+    else
+    {
+      socket_.async_read_some(buffers, std::forward<ReadHandler>(handler));
+    }
+  }
+
+  // Write to the client, through OpenSSL unless the kernel handles TLS.
+  template <typename ConstBufferSequence, typename WriteHandler>
+  void async_write(const ConstBufferSequence &buffers, WriteHandler &&handler)
+  {
+    if (ktls_)
+    {
+      boost::asio::async_write(socket_.next_layer(), buffers, std::forward<WriteHandler>(handler));
+    }
+    else
+    {
+      size_records(boost::asio::buffer_size(buffers));
+      boost::asio::async_write(socket_, buffers, std::forward<WriteHandler>(handler));
+    }
+  }
+
+  // Choose the record size for a write of length bytes. A new or idle
+  // session sends small records, each of which the client can decrypt
+  // without waiting for the rest of a 16 KB record to arrive, and moves to
+  // full records once it has sent record_ramp bytes, when the framing and
+  // MAC of each record start to cost throughput.
+  void size_records(std::size_t length)
+  {
+    if (options_.record_ramp == 0)
+    {
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_write_ > record_ramp_idle)
+    {
+      ramp_sent_ = 0;
+    }
+    last_write_ = now;
+    std::size_t record_size = ramp_sent_ < options_.record_ramp ? small_record_size : SSL3_RT_MAX_PLAIN_LENGTH;
+    if (record_size != record_size_)
+    {
+      // Lowering the fragment also lowers the split fragment, which would
+      // otherwise keep records small after the ramp.
+      SSL_set_max_send_fragment(socket_.native_handle(), record_size);
+      SSL_set_split_send_fragment(socket_.native_handle(), record_size);
+      record_size_ = record_size;
+    }
+    ramp_sent_ += length;
   }
 
   void do_read()
   {
     auto self(shared_from_this());
-    socket_.async_read_some(boost::asio::buffer(data_),
-                            [this, self](const boost::system::error_code &ec, std::size_t length) {
-                              if (!ec)
-                              {
-                                do_write(length);
-                              }
-                            });
+    async_read_some(boost::asio::buffer(data_),
+                    [this, self](const boost::system::error_code &ec, std::size_t length) {
+                      if (!ec)
+                      {
+                        do_write(length);
+                      }
+                    });
   }
 
   void do_write(std::size_t length)
   {
     auto self(shared_from_this());
-    boost::asio::async_write(socket_, boost::asio::buffer(data_),
-                             [this, self](const boost::system::error_code &ec, std::size_t /*length*/) {
-                               if (!ec)
-                               {
-                                 do_read();
-                               }
-                             });
+    async_write(boost::asio::buffer(data_.data(), length),
+                [this, self](const boost::system::error_code &ec, std::size_t /*length*/) {
+                  if (!ec)
+                  {
+                    do_read();
+                  }
+                });
+  }
+
+  // Send the file, then close the connection.
+  void do_send_file()
+  {
+    tcp::socket &socket = socket_.next_layer();
+    if (file_ < 0)
+    {
+      struct stat status;
+      file_ = ::open(options_.send_file.c_str(), O_RDONLY);
+      if (file_ < 0 || ::fstat(file_, &status) != 0)
+      {
+        return;
+      }
+      file_size_ = status.st_size;
+      boost::system::error_code ignored_ec;
+      socket.non_blocking(true, ignored_ec);
+    }
+
+    auto self(shared_from_this());
+    if (ktls_)
+    {
+      // The kernel encrypts the file's pages as it sends them, so they are
+      // never copied into user space.
+      while (file_offset_ < file_size_)
+      {
+        ssize_t n = ::sendfile(socket.native_handle(), file_, &file_offset_, file_size_ - file_offset_);
+        if (n < 0 && errno == EAGAIN)
+        {
+          socket.async_wait(tcp::socket::wait_write, [this, self](const boost::system::error_code &ec) {
+            if (!ec)
+            {
+              do_send_file();
+            }
+          });
+          return;
+        }
+        if (n == 0 || (n < 0 && errno != EINTR))
+        {
+          return;
+        }
+      }
+    }
+    else if (file_offset_ < file_size_)
+    {
+      ssize_t n = ::pread(file_, data_.data(), data_.size(), file_offset_);
+      if (n <= 0)
+      {
+        return;
+      }
+      file_offset_ += n;
+      async_write(boost::asio::buffer(data_.data(), n),
+                  [this, self](const boost::system::error_code &ec, std::size_t /*length*/) {
+                    if (!ec)
+                    {
+                      do_send_file();
+                    }
+                  });
+      return;
+    }
+
+    boost::system::error_code ignored_ec;
+    socket.shutdown(tcp::socket::shutdown_send, ignored_ec);
   }
 
   boost::asio::ssl::stream<tcp::socket> socket_;
-  char data_[1024];
+  boost::asio::steady_timer handshake_timer_;
+  bool timed_out_;
+  io_worker *worker_;
+  const server_options &options_;
+  ktls::key_capture keys_;
+
+  // Whether the kernel handles the records.
+  bool ktls_;
+
+  int file_;
+  off_t file_offset_;
+  off_t file_size_;
+  std::vector<char> data_;
+
+  // The bytes written since the session last started small records.
+  std::size_t ramp_sent_;
+  std::size_t record_size_;
+  std::chrono::steady_clock::time_point last_write_;
 };
 
+// Accepts connections on the main thread, performs their handshakes on the
+// handshake pool, and hands established sessions to the least busy I/O
+// worker, so a burst of handshakes cannot delay data for existing sessions.
 class server
 {
 public:
-  server(boost::asio::io_context &io_context, unsigned short port)
-      : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
-        context_(boost::asio::ssl::context::sslv23)
+  server(boost::asio::io_context &io_context, unsigned short port, const server_options &opts)
+      : io_context_(io_context), context_(boost::asio::ssl::context::sslv23),
+        acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), options_(opts),
+        handshake_pool_(opts.handshake_threads), workers_(opts.io_threads),
+        handshakes_in_flight_(0), accept_paused_(false), stats_timer_(io_context)
   {
     context_.set_options(
         boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::single_dh_use);
     context_.set_password_callback(std::bind(&server::get_password, this));
-    context_.use_certificate_chain_file("server.pem");
-    context_.use_private_key_file("server.pem", boost::asio::ssl::context::pem);
+    context_.use_certificate_chain_file(options_.certificate);
+    context_.use_private_key_file(options_.private_key, boost::asio::ssl::context::pem);
     //context_.use_tmp_dh_file("dh2048.pem");
 
+    if (options_.ktls)
+    {
+      ktls::key_capture::install(context_.native_handle());
+      if (!ktls::available())
+      {
+        std::cerr << "Kernel TLS is unavailable, sessions stay in user space\n";
+      }
+    }
+
     do_accept();
+
+    if (options_.stats_interval > 0)
+    {
+      do_report();
+    }
   }
 
 private:
@@ -85,33 +398,222 @@ private:
 
   void do_accept()
   {
+    if (handshakes_in_flight_ >= options_.max_handshakes)
+    {
+      // Resumed once a handshake finishes.
+      accept_paused_ = true;
+      ++metrics_.accept_pauses;
+      return;
+    }
+
+    // Each connection gets its own strand in the pool, so its handshake and
+    // its timeout never run at the same time.
     acceptor_.async_accept(
+        boost::asio::make_strand(handshake_pool_),
         [this](const boost::system::error_code &ec, tcp::socket socket) {
           if (!ec)
           {
-            std::make_shared<session>(std::move(socket), context_)->start();
+            ++metrics_.accepted;
+            ++handshakes_in_flight_;
+            auto start = std::chrono::steady_clock::now();
+            std::make_shared<session>(std::move(socket), context_, options_)
+                ->handshake(std::chrono::seconds(options_.handshake_timeout),
+                            [this, start](std::shared_ptr<session> s, const boost::system::error_code &error) {
+                              handshake_finished(s, error, start);
+                            });
           }
 
           do_accept();
         });
   }
+
+  // Called on the handshake pool.
+  void handshake_finished(std::shared_ptr<session> s, const boost::system::error_code &error,
+                          std::chrono::steady_clock::time_point start)
+  {
+    boost::asio::post(io_context_, [this]() {
+      --handshakes_in_flight_;
+      if (accept_paused_)
+      {
+        accept_paused_ = false;
+        do_accept();
+      }
+    });
+
+    if (error == boost::asio::error::timed_out)
+    {
+      ++metrics_.handshake_timeouts;
+      return;
+    }
+    if (error)
+    {
+      ++metrics_.handshake_failures;
+      return;
+    }
+
+    ++metrics_.handshakes;
+    metrics_.handshake_microseconds += std::chrono::duration_cast<std::chrono::microseconds>(
+                                           std::chrono::steady_clock::now() - start)
+                                           .count();
+
+    if (options_.ktls)
+    {
+      ktls::result result = s->enable_ktls();
+      if (result == ktls::failed)
+      {
+        return;
+      }
+      ++(result == ktls::enabled ? metrics_.ktls_sessions : metrics_.ktls_fallbacks);
+    }
+
+    io_worker *least_busy = &workers_.front();
+    for (io_worker &worker : workers_)
+    {
+      if (worker.sessions < least_busy->sessions)
+      {
+        least_busy = &worker;
+      }
+    }
+    s->start(*least_busy);
+  }
+
+  void do_report()
+  {
+    stats_timer_.expires_after(std::chrono::seconds(options_.stats_interval));
+    stats_timer_.async_wait([this](const boost::system::error_code &ec) {
+      if (ec)
+      {
+        return;
+      }
+
+      std::size_t handshakes = metrics_.handshakes;
+      std::cout << "accepted " << metrics_.accepted << ", handshakes " << handshakes << " (mean "
+                << (handshakes ? metrics_.handshake_microseconds / handshakes : 0) << " us), failed "
+                << metrics_.handshake_failures << ", timed out " << metrics_.handshake_timeouts
+                << ", in progress " << handshakes_in_flight_ << ", accept pauses "
+                << metrics_.accept_pauses;
+      if (options_.ktls)
+      {
+        std::cout << ", kernel tls " << metrics_.ktls_sessions << ", user space tls "
+                  << metrics_.ktls_fallbacks;
+      }
+      std::cout << ", sessions";
+      for (const io_worker &worker : workers_)
+      {
+        std::cout << " " << worker.sessions;
+      }
+      std::cout << std::endl;
+
+      do_report();
+    });
+  }
+
+  boost::asio::io_context &io_context_;
   boost::asio::ssl::context context_;
   tcp::acceptor acceptor_;
+  server_options options_;
+  boost::asio::thread_pool handshake_pool_;
+  std::vector<io_worker> workers_;
+  metrics metrics_;
+
+  // Only touched on the main thread.
+  std::size_t handshakes_in_flight_;
+  bool accept_paused_;
+  boost::asio::steady_timer stats_timer_;
 };
 
+// Return the value of a "--name=value" argument, or null if arg is not name.
+const char *option_value(const char *arg, const char *name)
+{
+  std::size_t length = std::strlen(name);
+  if (std::strncmp(arg, name, length) == 0 && arg[length] == '=')
+  {
+    return arg + length + 1;
+  }
+  return nullptr;
+}
+
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 2)
+    if (argc < 2)
+    {
+      std::cerr << "Usage: server <port> [options]\n";
+      std::cerr << "  Options:\n";
+      std::cerr << "    --certificate=<pem>       certificate chain (default server.pem)\n";
+      std::cerr << "    --private-key=<pem>       its private key (default server.pem)\n";
+      std::cerr << "    --handshake-threads=<n>   threads performing handshakes\n";
+      std::cerr << "    --io-threads=<n>          threads moving data for established sessions\n";
+      std::cerr << "    --max-handshakes=<n>      handshakes in progress before accepting pauses\n";
+      std::cerr << "    --handshake-timeout=<s>   seconds a client has to complete its handshake\n";
+      std::cerr << "    --stats=<s>               print metrics every s seconds\n";
+      std::cerr << "    --ktls                    encrypt in the kernel after the handshake\n";
+      std::cerr << "    --send-file=<path>        send a file to each client instead of echoing\n";
+      std::cerr << "    --buffer-size=<bytes>     bytes read or written at once (default 16384)\n";
+      std::cerr << "    --record-ramp=<bytes>     bytes sent in small records first (default 0, none)\n";
+      return 1;
+    }
+
+    server_options opts;
+    for (int i = 2; i < argc; ++i)
     {
-      std::cerr << "Usage: server <port>\n";
+      const char *value = nullptr;
+      if ((value = option_value(argv[i], "--certificate")))
+      {
+        opts.certificate = value;
+      }
+      else if ((value = option_value(argv[i], "--private-key")))
+      {
+        opts.private_key = value;
+      }
+      else if ((value = option_value(argv[i], "--handshake-threads")))
+      {
+        opts.handshake_threads = std::max(1L, std::strtol(value, nullptr, 10));
+      }
+      else if ((value = option_value(argv[i], "--io-threads")))
+      {
+        opts.io_threads = std::max(1L, std::strtol(value, nullptr, 10));
+      }
+      else if ((value = option_value(argv[i], "--max-handshakes")))
+      {
+        opts.max_handshakes = std::max(1L, std::strtol(value, nullptr, 10));
+      }
+      else if ((value = option_value(argv[i], "--handshake-timeout")))
+      {
+        opts.handshake_timeout = std::strtol(value, nullptr, 10);
+      }
+      else if (std::strcmp(argv[i], "--ktls") == 0)
+      {
+        opts.ktls = true;
+      }
+      else if ((value = option_value(argv[i], "--send-file")))
+      {
+        opts.send_file = value;
+      }
+      else if ((value = option_value(argv[i], "--buffer-size")))
+      {
+        opts.buffer_size = std::max(1L, std::strtol(value, nullptr, 10));
+      }
+      else if ((value = option_value(argv[i], "--record-ramp")))
+      {
+        opts.record_ramp = std::strtoul(value, nullptr, 10);
+      }
+      else if ((value = option_value(argv[i], "--stats")))
+      {
+        opts.stats_interval = std::strtol(value, nullptr, 10);
+      }
+      else
+      {
+        std::cerr << "Unknown option: " << argv[i] << "\n";
+        return 1;
+      }
     }
 
     boost::asio::io_context io_context;
 
     using namespace std; // For atoi
-    server s(io_context, atoi(argv[1]));
+    server s(io_context, atoi(argv[1]), opts);
 
     io_context.run();
   }
@@ -121,4 +623,4 @@ int main(int argc, char* argv[])
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,356 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+
+// Opt-in tracing of asynchronous operations. Each operation is recorded as an
+// async begin event when it is initiated and an async end event when its
+// handler is called, and the handler's run is recorded as a complete event.
+// Events go into a ring buffer owned by the thread recording them and are
+// written out as Chrome trace-event JSON, which Perfetto and chrome://tracing
+// can open. While tracing is disabled, every trace point costs one branch.
+namespace trace
+{
+
+// One recorded event.
+struct event
+{
+  const char *name;
+  const char *category;
+  char phase;
+  std::uint64_t id;
+  std::int64_t timestamp;
+  std::int64_t duration;
+};
+
+// The most recent events recorded by one thread. Only the owning thread
+// writes to the ring, so recording takes no locks. Each slot carries the
+// sequence number of the event in it, as a seqlock, so that a snapshot taken
+// from another thread while events are recorded skips the slots being
+// overwritten instead of reading them torn. The event itself is stored as
+// relaxed atomic words, so the concurrent copy is not a data race.
+class ring
+{
+public:
+  ring(const ring &) = delete;
+  ring &operator=(const ring &) = delete;
+
+  enum
+  {
+    capacity = 1 << 16
+  };
+
+  explicit ring(int thread_id)
+      : slots_(new slot[capacity]), head_(0), thread_id_(thread_id)
+  {
+  }
+
+  void push(const event &e)
+  {
+    std::size_t head = head_.load(std::memory_order_relaxed);
+    slot &s = slots_[head % capacity];
+    std::uint64_t words[event_words];
+    std::memcpy(words, &e, sizeof(event));
+
+    // Zero marks the slot as being written; readers seeing it, or seeing it
+    // change while they copy, drop the slot.
+    s.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (std::size_t i = 0; i < event_words; ++i)
+    {
+      s.words[i].store(words[i], std::memory_order_relaxed);
+    }
+    s.sequence.store(head + 1, std::memory_order_release);
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Copy out the events still in the ring, oldest first. Events overwritten
+  // by the owning thread while the copy is made are left out.
+  std::vector<event> snapshot() const
+  {
+    std::size_t head = head_.load(std::memory_order_acquire);
+    std::size_t first = head > capacity ? head - capacity : 0;
+    std::vector<event> events;
+    events.reserve(head - first);
+    for (std::size_t i = first; i < head; ++i)
+    {
+      const slot &s = slots_[i % capacity];
+      std::uint64_t sequence = s.sequence.load(std::memory_order_acquire);
+      if (sequence != i + 1)
+      {
+        continue;
+      }
+      std::uint64_t words[event_words];
+      for (std::size_t w = 0; w < event_words; ++w)
+      {
+        words[w] = s.words[w].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (s.sequence.load(std::memory_order_relaxed) != sequence)
+      {
+        continue;
+      }
+      event e;
+      std::memcpy(&e, words, sizeof(event));
+      events.push_back(e);
+    }
+    return events;
+  }
+
+  int thread_id() const
+  {
+    return thread_id_;
+  }
+
+private:
+  static_assert(sizeof(event) % sizeof(std::uint64_t) == 0, "events are copied as whole words");
+  static const std::size_t event_words = sizeof(event) / sizeof(std::uint64_t);
+
+  struct slot
+  {
+    std::atomic<std::uint64_t> sequence{0};
+    std::atomic<std::uint64_t> words[event_words];
+  };
+
+  std::unique_ptr<slot[]> slots_;
+  std::atomic<std::size_t> head_;
+  int thread_id_;
+};
+
+namespace detail
+{
+
+inline std::atomic<bool> enabled(false);
+
+// The rings of every thread that has recorded an event.
+struct registry
+{
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ring>> rings;
+};
+
+inline registry &rings()
+{
+  static registry r;
+  return r;
+}
+
+inline ring &this_thread_ring()
+{
+  thread_local std::shared_ptr<ring> r = [] {
+    registry &reg = rings();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.rings.push_back(std::make_shared<ring>(static_cast<int>(reg.rings.size()) + 1));
+    return reg.rings.back();
+  }();
+  return *r;
+}
+
+inline std::int64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+inline void record(const char *name, const char *category, char phase, const void *id,
+                   std::int64_t timestamp, std::int64_t duration = 0)
+{
+  this_thread_ring().push(event{name, category, phase, reinterpret_cast<std::uintptr_t>(id),
+                                timestamp, duration});
+}
+
+} // namespace detail
+
+// Start recording events.
+inline void enable()
+{
+  detail::enabled.store(true, std::memory_order_relaxed);
+}
+
+// Whether events are being recorded.
+inline bool enabled()
+{
+  return detail::enabled.load(std::memory_order_relaxed);
+}
+
+// Record the initiation of an asynchronous operation on the object id.
+inline void async_begin(const char *name, const char *category, const void *id)
+{
+  if (enabled())
+  {
+    detail::record(name, category, 'b', id, detail::now());
+  }
+}
+
+// Record the completion of an asynchronous operation on the object id.
+inline void async_end(const char *name, const char *category, const void *id)
+{
+  if (enabled())
+  {
+    detail::record(name, category, 'e', id, detail::now());
+  }
+}
+
+// Records the time from its construction to its destruction as a complete
+// event.
+class span
+{
+public:
+  span(const span &) = delete;
+  span &operator=(const span &) = delete;
+
+  span(const char *name, const char *category)
+      : name_(name), category_(category), start_(enabled() ? detail::now() : -1)
+  {
+  }
+
+  ~span()
+  {
+    if (start_ >= 0)
+    {
+      detail::record(name_, category_, 'X', nullptr, start_, detail::now() - start_);
+    }
+  }
+
+private:
+  const char *name_;
+  const char *category_;
+  std::int64_t start_;
+};
+
+// A completion handler that records the end of its operation and its own run.
+template <typename Handler>
+class traced_handler
+{
+public:
+  traced_handler(const char *name, const char *category, const void *id, Handler handler)
+      : name_(name), category_(category), id_(id), handler_(std::move(handler))
+  {
+  }
+
+  template <typename... Args>
+  void operator()(Args &&... args)
+  {
+    if (!enabled())
+    {
+      handler_(std::forward<Args>(args)...);
+      return;
+    }
+    async_end(name_, category_, id_);
+    span s(name_, category_);
+    handler_(std::forward<Args>(args)...);
+  }
+
+private:
+  const char *name_;
+  const char *category_;
+  const void *id_;
+  Handler handler_;
+};
+
+// Wrap the completion handler of an operation being initiated on the object
+// id, recording the initiation.
+template <typename Handler>
+traced_handler<Handler> traced(const char *name, const char *category, const void *id, Handler handler)
+{
+  async_begin(name, category, id);
+  return traced_handler<Handler>(name, category, id, std::move(handler));
+}
+
+// Write the events of every thread as Chrome trace-event JSON.
+inline void write_json(std::ostream &os)
+{
+  std::vector<std::shared_ptr<ring>> rings;
+  {
+    detail::registry &reg = detail::rings();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    rings = reg.rings;
+  }
+
+  const int pid = ::getpid();
+  os << "{\"traceEvents\":[\n";
+  bool first = true;
+  os << std::fixed << std::setprecision(3);
+  for (const auto &r : rings)
+  {
+    for (const event &e : r->snapshot())
+    {
+      os << (first ? "" : ",\n") << "{\"name\":\"" << e.name << "\",\"cat\":\"" << e.category
+         << "\",\"ph\":\"" << e.phase << "\",\"ts\":" << e.timestamp / 1000.0
+         << ",\"pid\":" << pid << ",\"tid\":" << r->thread_id();
+      if (e.phase == 'X')
+      {
+        os << ",\"dur\":" << e.duration / 1000.0;
+      }
+      else
+      {
+        os << ",\"id\":\"0x" << std::hex << e.id << std::dec << "\"";
+      }
+      os << "}";
+      first = false;
+    }
+  }
+  os << "\n]}\n";
+}
+
+// Write the events to a new file in the working directory, named after the
+// process, and return its name.
+inline std::string dump()
+{
+  static std::atomic<int> sequence(0);
+  std::string path = "trace-" + std::to_string(::getpid()) + "-" + std::to_string(sequence++) + ".json";
+  std::ofstream os(path.c_str());
+  write_json(os);
+  return path;
+}
+
+// Dumps the events each time the process receives SIGUSR1.
+class signal_dumper
+{
+public:
+  explicit signal_dumper(boost::asio::io_context &io_context)
+      : signals_(io_context, SIGUSR1)
+  {
+    do_wait();
+  }
+
+  // Stop waiting for the signal, so that the io_context can run out of work.
+  void cancel()
+  {
+    boost::system::error_code ignored_ec;
+    signals_.cancel(ignored_ec);
+  }
+
+private:
+  void do_wait()
+  {
+    signals_.async_wait([this](boost::system::error_code ec, int /*signo*/) {
+      if (!ec)
+      {
+        std::cerr << "trace written to " << dump() << "\n";
+        do_wait();
+      }
+    });
+  }
+
+  boost::asio::signal_set signals_;
+};
+
+} // namespace trace
+
+#endif // TRACE_HPP